@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <assert.h>
 #include <stdlib.h>
@@ -5,9 +6,37 @@
 #include <string.h>
 #include <errno.h>
 #include <stdint.h>
+#include <limits.h>
+#include <stddef.h>
+#include <time.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <linux/io_uring.h>
+#include <zlib.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #define LOG 1
+// the encoders allocate from the pool as well
+void *pool_malloc(const size_t size);
+void *pool_realloc(void *pointer, const size_t size);
+void pool_free(void *pointer);
+#define STBIW_MALLOC(size) pool_malloc(size)
+#define STBIW_REALLOC(pointer, size) pool_realloc(pointer, size)
+#define STBIW_REALLOC_SIZED(pointer, old_size, size) pool_realloc(pointer, size)
+#define STBIW_FREE(pointer) pool_free(pointer)
 #define STB_IMAGE_WRITE_IMPLEMENTATION
+#define STBIW_USE_PTHREADS
 #include "stb_image_write.h"
 
 #define ERR_SET "\033[0;31m"
@@ -15,39 +44,323 @@
 #define RESET "\033[0m"
 
 void usage(FILE *file, const char *program){
-    fprintf(file, "Usage: %s [-flag] [path-to-file]\nFlags:\n\
-     -ciff  provide a {.ciff} file\n\
-     -caff  provide a {.caff} file \n",
-    program);
+    fprintf(file, "Usage: %s [-options] [-flag] [path-to-file...]\n\
+       %s -daemon [path-to-socket] [-workers count]\nFlags:\n\
+     -ciff     provide a {.ciff} file\n\
+     -caff     provide a {.caff} file, either may be gzip-compressed\n\
+     -bundle   provide a {.tar} of {.ciff} and {.caff} files, converted straight from it\nOptions:\n\
+     -quality  quality of the JPG between 1 and 100 (default: 99)\n\
+     -progressive  write a progressive JPG\n\
+     -optimize  build the JPG Huffman tables for each image\n\
+     -uring    read and write the files through io_uring\n\
+     -format   format of the output: jpg, png or qoi (default: jpg)\n\
+     -all      convert every frame of a CAFF to {name}_{index}.{format}\n\
+     -frame    convert the n-th frame of a CAFF instead of the first, counted from 0\n\
+     -repack   write a CAFF as an indexed {name}.icaff with compressed frames, or back\n\
+     -stream   parse the input as it arrives, e.g. from a pipe, and convert while reading\n\
+     -validate check every block header of a file before reading any pixels\n\
+     -pread    convert every frame like -all, each thread reads its own at the block offset, durations to {name}.json\n\
+     -y4m      write every frame for its duration at n frames per second as YUV4MPEG2 to standard output\n\
+     -output   write under a directory, sharded by name, renamed into place and synced in batches\n\
+     -tar      append every output to a single tar archive, \"-\" for standard output\n\
+     -threads  number of encoding threads, also for a single PNG (default: number of CPUs)\n\
+     -sample   choose the PNG filter on every n-th row only (default: 1)\n\
+     -ladder   write previews instead of the image, e.g. 64,256,1024 to {name}_{size}.{format}, full for {name}.{format}\n\
+     -tile     cut the image into tiles of n pixels, {name}_{column}_{row}.{format}\n\
+     -dzi      tile every level of a deep zoom pyramid under {name}_files and write {name}.dzi\n\
+     -level    PNG compression from 1 (fast) to 9 (max ratio) (default: 8)\n\
+     -daemon   serve conversions on a unix domain socket\n\
+     -workers  number of daemon worker processes (default: 4)\n",
+    program, program);
 } 
 
 bool check_extension(const char *file_path) {
-    const char *extension = strrchr(file_path, '.');
-    if (extension == NULL) {
+    size_t length = strlen(file_path);
+    // either may be gzip-compressed
+    if (length > 3 && strcmp(file_path + length - 3, ".gz") == 0) {
+        length -= 3;
+    }
+    // a repacked CAFF
+    if (length >= 6 && strncmp(file_path + length - 6, ".icaff", 6) == 0) {
+        return true;
+    }
+    if (length < 5) {
         return false; // No extension found
     }
-    ++extension;
-    return (strcmp(extension, "ciff") == 0 || strcmp(extension, "caff") == 0);
+    const char *extension = file_path + length - 5;
+    return (strncmp(extension, ".ciff", 5) == 0 || strncmp(extension, ".caff", 5) == 0);
+}
+
+typedef enum {
+    FORMAT_JPG,
+    FORMAT_PNG,
+    FORMAT_QOI,
+} Format;
+const char *const formats[] = { "jpg", "png", "qoi" };
+Format g_format;
+
+void make_directory(const char *path){
+    if (mkdir(path, 0755) != 0 && errno != EEXIST){
+        fprintf(stderr, "%sERROR%s: could not create the directory \"%s\": %s\n",
+                ERR_SET, RESET, path, strerror(errno));
+        exit(-1);
+    }
+}
+
+// OUTPUT ROOT
+/* with -output the outputs go under a root directory, in two
+levels of 256 shards picked by a hash of the input name, so no
+directory grows past a few thousand entries even for millions of
+outputs, and everything made from one input stays together. the
+shards are created the first time they are used */
+#define SHARDS 256
+#define SHARD_PREFIX 7
+const char *g_output_root;
+bool g_shards_made[SHARDS * (SHARDS + 1)];
+
+// {root}/{xx}/{yy}/ in front of the name, by FNV-1a of the name
+void set_shard_prefix(char *file_name, const char *name){
+    uint32_t hash = 2166136261u;
+    for (const char *c = name; *c != '\0'; ++c){
+        hash = (hash ^ (uint8_t)*c) * 16777619u;
+    }
+    const size_t first = hash & (SHARDS - 1), second = (hash >> 8) & (SHARDS - 1);
+    const size_t root_length = strlen(g_output_root);
+    char path[root_length + SHARD_PREFIX + 1];
+    snprintf(path, sizeof(path), "%s/%02zx/%02zx/", g_output_root, first, second);
+    if (!g_shards_made[SHARDS + first * SHARDS + second]){
+        if (!g_shards_made[first]){
+            make_directory(g_output_root);
+            path[root_length + 3] = '\0';
+            make_directory(path);
+            path[root_length + 3] = '/';
+            g_shards_made[first] = true;
+        }
+        path[root_length + 6] = '\0';
+        make_directory(path);
+        path[root_length + 6] = '/';
+        g_shards_made[SHARDS + first * SHARDS + second] = true;
+    }
+    memcpy(file_name, path, root_length + SHARD_PREFIX);
 }
 
 char *g_file_name;
+size_t g_file_name_capacity;
+// the output named after a relative path, directories and all
+void set_output_name(const char *path){
+    const size_t prefix = g_output_root != NULL ? strlen(g_output_root) + SHARD_PREFIX : 0;
+    /* the buffer is kept between conversions,
+    + 5 bytes for the extension and the terminator */
+    const size_t capacity = prefix + strlen(path) + 5;
+    if (capacity > g_file_name_capacity){
+        char *file_name = realloc(g_file_name, capacity);
+        if (file_name == NULL){
+            fprintf(stderr, "%sERROR%s: could not allocate the output filename\n",
+                    ERR_SET, RESET);
+            exit(-1);
+        }
+        g_file_name = file_name;
+        g_file_name_capacity = capacity;
+    }
+    char *name = g_file_name + prefix;
+    strcpy(name, path);
+    char *ext = strrchr(name, '.');
+    if (ext != NULL && strcmp(ext, ".gz") == 0) {
+        *ext = '\0';
+        ext = strrchr(name, '.');
+    }
+    if (ext != NULL) {
+        *ext = '\0';
+    }
+    if (g_output_root != NULL){ set_shard_prefix(g_file_name, name); }
+    strcat(g_file_name, ".");
+    strcat(g_file_name, formats[g_format]);
+}
+
+// the output is named after the file, its directories are dropped
 void set_g_file_name(const char* file_path) {
-    char *separator = strrchr(file_path, '/');
+    const char *separator = strrchr(file_path, '/');
     if (separator == NULL) {
-        separator = (char*)file_path;
+        separator = file_path;
     } else { ++separator; }
-    char *file_name = strdup(separator);
-    if (file_name == NULL){
-        fprintf(stderr, "%sERROR%s: filename was not provided in the path\n",
-                ERR_SET, RESET);
-        exit(-1);
+    set_output_name(separator);
+}
+
+// {name}_{index}.{format} for frames and previews
+void set_frame_file_name(char *file_name, const size_t capacity, const size_t index){
+    const int stem = (int)(strlen(g_file_name) - strlen(formats[g_format]) - 1);
+    snprintf(file_name, capacity, "%.*s_%zu.%s", stem, g_file_name, index, formats[g_format]);
+}
+
+/* {name}_{column}_{row}.{format} for tiles, with -dzi
+{name}_files/{level}/{column}_{row}.{format} */
+bool g_dzi;
+void set_tile_file_name(char *file_name, const size_t capacity, const size_t level,
+                        const size_t column, const size_t row){
+    const int stem = (int)(strlen(g_file_name) - strlen(formats[g_format]) - 1);
+    if (g_dzi){
+        snprintf(file_name, capacity, "%.*s_files/%zu/%zu_%zu.%s",
+                 stem, g_file_name, level, column, row, formats[g_format]);
+    } else {
+        snprintf(file_name, capacity, "%.*s_%zu_%zu.%s",
+                 stem, g_file_name, column, row, formats[g_format]);
     }
-    char *ext = strrchr(file_name, '.');
-    if (ext != NULL) {
-        *ext = '\0';
+}
+
+// POOL
+/* pixel buffers, outputs and the scratch of the encoders come
+in size classes, four to each power of two. a thread keeps what
+it frees in a list per class and hands it out again for the
+next request of that class, so frames and files reuse buffers
+without going through malloc and its locks. what a thread holds
+when it ends goes to a shared depot for the threads after it */
+#define POOL_SMALLEST 64
+// the largest class holds 2 GB, larger buffers are not kept
+#define POOL_CLASSES 101
+#define POOL_BUDGET ((size_t)64 << 20)
+#define POOL_DEPOT_BUDGET ((size_t)512 << 20)
+
+// in front of every buffer, keeps it 16-byte aligned
+typedef struct {
+    size_t capacity;
+    size_t size_class;
+} PoolHeader;
+
+typedef struct {
+    void *free[POOL_CLASSES];
+    size_t bytes;
+} PoolCache;
+
+_Thread_local PoolCache g_pool_cache;
+_Thread_local bool g_pool_registered;
+PoolCache g_pool_depot;
+pthread_mutex_t g_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_key_t g_pool_key;
+pthread_once_t g_pool_once = PTHREAD_ONCE_INIT;
+
+size_t pool_class(const size_t size){
+    if (size <= POOL_SMALLEST){ return 0; }
+    // size is in (2^k, 2^(k+1)], the classes split that range in quarters
+    const size_t k = 63 - (size_t)__builtin_clzll((unsigned long long)size - 1);
+    const size_t quarter = ((size - 1) >> (k - 2)) - 3;
+    const size_t size_class = (k - 6) * 4 + quarter;
+    return size_class < POOL_CLASSES ? size_class : POOL_CLASSES;
+}
+
+size_t pool_capacity(const size_t size_class){
+    if (size_class == 0){ return POOL_SMALLEST; }
+    const size_t k = 6 + (size_class - 1) / 4;
+    return ((size_t)1 << k) + (((size_class - 1) % 4 + 1) << (k - 2));
+}
+
+void *pool_take(PoolCache *cache, const size_t size_class){
+    void *pointer = cache->free[size_class];
+    if (pointer != NULL){
+        cache->free[size_class] = *(void **)pointer;
+        cache->bytes -= pool_capacity(size_class);
+    }
+    return pointer;
+}
+
+bool pool_put(PoolCache *cache, const size_t size_class, void *pointer, const size_t budget){
+    const size_t capacity = pool_capacity(size_class);
+    if (cache->bytes + capacity > budget){ return false; }
+    *(void **)pointer = cache->free[size_class];
+    cache->free[size_class] = pointer;
+    cache->bytes += capacity;
+    return true;
+}
+
+// at the end of a thread
+void pool_release(void *argument){
+    PoolCache *cache = argument;
+    pthread_mutex_lock(&g_pool_lock);
+    for (size_t c = 0; c < POOL_CLASSES; ++c){
+        void *pointer;
+        while ((pointer = pool_take(cache, c)) != NULL){
+            if (!pool_put(&g_pool_depot, c, pointer, POOL_DEPOT_BUDGET)){
+                free((PoolHeader *)pointer - 1);
+            }
+        }
+    }
+    pthread_mutex_unlock(&g_pool_lock);
+}
+
+void pool_create_key(void){
+    pthread_key_create(&g_pool_key, pool_release);
+}
+
+void *pool_malloc(const size_t size){
+    // the header would wrap the size around
+    if (size > SIZE_MAX - sizeof(PoolHeader)){ return NULL; }
+    const size_t size_class = pool_class(size);
+    if (size_class < POOL_CLASSES){
+        void *pointer = pool_take(&g_pool_cache, size_class);
+        if (pointer == NULL){
+            pthread_mutex_lock(&g_pool_lock);
+            pointer = pool_take(&g_pool_depot, size_class);
+            pthread_mutex_unlock(&g_pool_lock);
+        }
+        if (pointer != NULL){ return pointer; }
+    }
+    const size_t capacity = size_class < POOL_CLASSES ? pool_capacity(size_class) : size;
+    PoolHeader *header = malloc(sizeof(PoolHeader) + capacity);
+    if (header == NULL){ return NULL; }
+    header->capacity = capacity;
+    header->size_class = size_class;
+    return header + 1;
+}
+
+void pool_free(void *pointer){
+    if (pointer == NULL){ return; }
+    PoolHeader *header = (PoolHeader *)pointer - 1;
+    if (header->size_class < POOL_CLASSES){
+        if (!g_pool_registered){
+            pthread_once(&g_pool_once, pool_create_key);
+            pthread_setspecific(g_pool_key, &g_pool_cache);
+            g_pool_registered = true;
+        }
+        if (pool_put(&g_pool_cache, header->size_class, pointer, POOL_BUDGET)){ return; }
+    }
+    free(header);
+}
+
+// a buffer only moves when it outgrows its class
+void *pool_realloc(void *pointer, const size_t size){
+    if (pointer == NULL){ return pool_malloc(size); }
+    PoolHeader *header = (PoolHeader *)pointer - 1;
+    if (size <= header->capacity){ return pointer; }
+    if (size > SIZE_MAX - sizeof(PoolHeader)){ return NULL; }
+    if (header->size_class == POOL_CLASSES){
+        PoolHeader *grown = realloc(header, sizeof(PoolHeader) + size);
+        if (grown == NULL){ return NULL; }
+        grown->capacity = size;
+        return grown + 1;
     }
-    strcat((char *)file_name, ".jpg");
-    g_file_name = file_name;
+    void *grown = pool_malloc(size);
+    if (grown == NULL){ return NULL; }
+    memcpy(grown, pointer, header->capacity);
+    pool_free(pointer);
+    return grown;
+}
+
+/* pixels are read into a buffer that only
+ever grows, so consecutive conversions
+do not allocate again */
+uint8_t *g_pixels;
+size_t g_pixels_capacity;
+uint8_t *acquire_pixels(const size_t pixel_size){
+    if (pixel_size > g_pixels_capacity){
+        uint8_t *pixels = pool_realloc(g_pixels, pixel_size);
+        if (pixels == NULL){
+            fprintf(stderr, "%sERROR%s: could not allocate %zu bytes for the pixels\n",
+                    ERR_SET, RESET, pixel_size);
+            exit(-1);
+        }
+        g_pixels = pixels;
+        g_pixels_capacity = pixel_size;
+    }
+    return g_pixels;
 }
 
 void read_bytes_to_buffer(FILE *file, void *buffer, const size_t buffer_capacity){
@@ -201,236 +514,3098 @@ void read_caff_credits(FILE *file){
     }
 }
 
-void create_jpg(uint8_t *rgb_pixels, size_t width, size_t height){
-    int quality = 99;
-    int stride_in_bytes = 3 * width;
-    int write = stbi_write_jpg(g_file_name, width, height, 3, rgb_pixels, quality);
-    if (write == 0) {
-        fprintf(stderr,
-                "%sERROR%s: output file could not be written\n",
-                ERR_SET, RESET);
-        exit(-1);
-    } else if (write == -1) {
-        fprintf(stderr,
-                "%sERROR%s: could not open output file for writing\n",
-                ERR_SET, RESET);
-        exit(-1);
-    } else if (write == -2) {
-        fprintf(stderr,
-                "%sERROR%s: output file is not a JPEG file\n",
-                ERR_SET, RESET);
-        exit(-1);
-    } else if (write == -3) {
-        fprintf(stderr,
-                "%sERROR%s: output file has invalid parameters\n",
-                ERR_SET, RESET);
-        exit(-1);
+// OUTPUT
+/* images are encoded into memory and
+written out in one piece afterwards */
+typedef struct {
+    uint8_t *data;
+    size_t size;
+    size_t capacity;
+} Output;
+Output g_output;
+
+void append_output(void *context, void *data, int size){
+    Output *output = context;
+    if (output->size + size > output->capacity){
+        size_t capacity = output->capacity != 0 ? output->capacity : 1 << 16;
+        while (capacity < output->size + size){ capacity *= 2; }
+        uint8_t *grown = pool_realloc(output->data, capacity);
+        if (grown == NULL){
+            fprintf(stderr, "%sERROR%s: could not allocate %zu bytes for the output\n",
+                    ERR_SET, RESET, capacity);
+            exit(-1);
+        }
+        output->data = grown;
+        output->capacity = capacity;
     }
-    assert(write == 1);
-#if LOG
-    printf("successfully saved to \"%s\"\n", g_file_name);
-#endif
+    memcpy(output->data + output->size, data, size);
+    output->size += size;
 }
 
-#define WDT 8
-#define HGT 8
-#define ESC 10
-const uint8_t magic_ciff[MGC] = {67, 73, 70, 70};
-void read_ciff(FILE *file, bool save){
-    // MAGIC
-    uint8_t magic[MGC];
-    read_bytes_to_buffer(file, magic, MGC);
-    if (memcmp(magic_ciff, magic, MGC) != 0){
-        fprintf(stderr,
-                "%sERROR%s: file has unknown magic in a block: %c %c %c %c\n",
-                ERR_SET, RESET,
-                (char)magic[0],
-                (char)magic[1],
-                (char)magic[2],
-                (char)magic[3]);
-        exit(-1);
+// the parts in order, also when the descriptor takes them in pieces
+void write_parts(const int fd, struct iovec *parts, int count){
+    while (count != 0){
+        const ssize_t written = writev(fd, parts, count);
+        if (written < 0){
+            if (errno == EINTR){ continue; }
+            fprintf(stderr, "%sERROR%s: could not write the output: %s\n",
+                    ERR_SET, RESET, strerror(errno));
+            exit(-1);
+        }
+        size_t left = (size_t)written;
+        while (count != 0 && left >= parts->iov_len){
+            left -= parts->iov_len;
+            ++parts;
+            --count;
+        }
+        if (count != 0){
+            parts->iov_base = (uint8_t *)parts->iov_base + left;
+            parts->iov_len -= left;
+        }
     }
+}
 
-    // HEADER SIZE
-    const size_t header_size = read_bytes_to_value(file, CAP);
+// IO_URING
+/* optional backend for converting a batch of files, it talks
+to the kernel through the raw system calls, so liburing is
+not needed. inputs are read into registered buffers ahead of
+the conversion and the outputs are written behind it, the
+converting thread only waits when there is nothing to convert */
+#define SLOTS 8
+#define SLOTS_BUDGET ((size_t)256 << 20)
+#define CHUNK ((size_t)1 << 30)
+#define RING_READ 0
+#define RING_WRITE 1
 
-    /* 8-byte long integer,
-    its value is the size of the image
-	pixels located at the end of the file.
-    Its value must be width*heigth*3 */
-    // CONTENT SIZE
-    size_t pixel_size = read_bytes_to_value(file, CAP);
-    // WIDTH
-    size_t width_size = read_bytes_to_value(file, WDT);
-    // HEIGHT
-    size_t height_size = read_bytes_to_value(file, HGT);
+typedef struct {
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    void *cq_ring;
+    size_t sq_ring_size;
+    size_t cq_ring_size;
+    size_t sqes_size;
+    unsigned queued;
+} Ring;
 
-    if (pixel_size != (width_size * height_size * 3)){
-        fprintf(stderr,
-                "%sERROR%s: pixel size is not equal to size defined in header\n",
-                ERR_SET, RESET);
-        exit(-1);
+// input file read ahead of the conversion
+typedef struct {
+    const char *path;
+    int fd;
+    uint8_t *buffer;
+    struct iovec iov;
+    size_t size;
+    size_t done;
+    bool ready;
+} Slot;
+
+// output file written behind the conversion
+typedef struct {
+    int fd;
+    Output output;
+    struct iovec iov;
+    size_t done;
+} Pending;
+
+bool g_uring;
+Ring *g_ring;
+Slot g_slots[SLOTS];
+size_t g_slot_count;
+bool g_slots_registered;
+Pending g_pending[SLOTS];
+
+bool ring_setup(Ring *ring, unsigned entries){
+    struct io_uring_params params = {0};
+    ring->fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0){ return false; }
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP){
+        if (ring->cq_ring_size > ring->sq_ring_size){ ring->sq_ring_size = ring->cq_ring_size; }
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    ring->cq_ring = ring->sq_ring;
+    if (ring->sq_ring != MAP_FAILED && !(params.features & IORING_FEAT_SINGLE_MMAP)){
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED){
+        close(ring->fd);
+        return false;
     }
-    assert(pixel_size == (width_size * height_size * 3));
 
-    // bytes for caption and tags
-    const size_t caption_tags_size = header_size - MGC    // 4-byte magic
-                                                 - CAP    // 8-byte header size
-                                                 - CAP    // 8-byte content size
-                                                 - WDT    // 8-byte width of image
-                                                 - HGT;   // 8-byte height of image
+    uint8_t *sq = ring->sq_ring;
+    uint8_t *cq = ring->cq_ring;
+    ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    ring->queued = 0;
+    return true;
+}
 
-    // CAPTION
-    uint8_t caption_temp[caption_tags_size];
-    size_t iter = 0;
-    uint8_t buffer[1];
-    read_bytes_to_buffer(file, buffer, 1);
-    while (buffer[0] != ESC) {
-        caption_temp[iter++] = buffer[0];
-        read_bytes_to_buffer(file, buffer, 1);
-        if (iter == caption_tags_size){
-            fprintf(stderr,
-                    "%sERROR%s: file caption larger than what header defines\n",
-                    ERR_SET, RESET);
-            exit(-1);
-        }
+void ring_teardown(Ring *ring){
+    munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring != ring->sq_ring){ munmap(ring->cq_ring, ring->cq_ring_size); }
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+}
+
+/* at most one operation per slot and pending
+write is in flight, the queue never fills up */
+struct io_uring_sqe *ring_sqe(Ring *ring){
+    const unsigned tail = *ring->sq_tail;
+    const unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ++ring->queued;
+    return sqe;
+}
+
+void ring_submit(Ring *ring, unsigned wait){
+    int submitted = (int)syscall(__NR_io_uring_enter, ring->fd, ring->queued, wait,
+                                 wait != 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if (submitted < 0){
+        if (errno == EINTR){ return; }
+        fprintf(stderr, "%sERROR%s: could not submit to io_uring: %s\n",
+                ERR_SET, RESET, strerror(errno));
+        exit(-1);
     }
-    // escaped caption
-    size_t caption_size = iter + 1;
-    if (iter == 0){
-        printf("%sWARNING%s: file does not define the caption\n",
-                WARN_SET, RESET);
+    ring->queued -= submitted;
+}
+
+void ring_read(size_t index){
+    Slot *slot = &g_slots[index];
+    size_t length = slot->size - slot->done;
+    if (length > CHUNK){ length = CHUNK; }
+
+    struct io_uring_sqe *sqe = ring_sqe(g_ring);
+    sqe->fd = slot->fd;
+    sqe->off = slot->done;
+    if (g_slots_registered){
+        sqe->opcode = IORING_OP_READ_FIXED;
+        sqe->addr = (uint64_t)(uintptr_t)(slot->buffer + slot->done);
+        sqe->len = length;
+        sqe->buf_index = index;
     } else {
-        uint8_t caption[caption_size];
-        // copy data from temp caption
-        for (unsigned int i = 0; i < caption_size; ++i){
-            caption[i] = caption_temp[i];
-        }
-#if LOG
-        printf("caption: ");
-        print_ascii(caption, caption_size);
-#endif
+        slot->iov.iov_base = slot->buffer + slot->done;
+        slot->iov.iov_len = length;
+        sqe->opcode = IORING_OP_READV;
+        sqe->addr = (uint64_t)(uintptr_t)&slot->iov;
+        sqe->len = 1;
     }
+    sqe->user_data = (uint64_t)RING_READ << 32 | index;
+}
 
-    // TAGS
-    size_t tags_size = caption_tags_size - caption_size;
-    if (tags_size == 0){
-        printf("%sWARNING%s: file does not include any tags\n",
-                WARN_SET, RESET);
+void ring_write(size_t index){
+    Pending *pending = &g_pending[index];
+    size_t length = pending->output.size - pending->done;
+    if (length > CHUNK){ length = CHUNK; }
+
+    pending->iov.iov_base = pending->output.data + pending->done;
+    pending->iov.iov_len = length;
+    struct io_uring_sqe *sqe = ring_sqe(g_ring);
+    sqe->opcode = IORING_OP_WRITEV;
+    sqe->fd = pending->fd;
+    sqe->off = pending->done;
+    sqe->addr = (uint64_t)(uintptr_t)&pending->iov;
+    sqe->len = 1;
+    sqe->user_data = (uint64_t)RING_WRITE << 32 | index;
+}
+
+void ring_complete(struct io_uring_cqe *cqe){
+    const size_t index = (uint32_t)cqe->user_data;
+    if ((cqe->user_data >> 32) == RING_READ){
+        Slot *slot = &g_slots[index];
+        if (cqe->res <= 0){
+            fprintf(stderr, "%sERROR%s: could not read %zu bytes from file: %s\n",
+                    ERR_SET, RESET, slot->size - slot->done,
+                    cqe->res == 0 ? "end of file" : strerror(-cqe->res));
+            exit(-1);
+        }
+        slot->done += cqe->res;
+        if (slot->done < slot->size){
+            ring_read(index);
+        } else {
+            close(slot->fd);
+            slot->fd = -1;
+            slot->ready = true;
+        }
     } else {
-        uint8_t tags[tags_size];
-        read_bytes_to_buffer(file, tags, tags_size);
-        for (size_t i = 0; i < tags_size; ++i){
-            if (tags[i] == ESC){
-                fprintf(stderr,
-                        "%sERROR%s: file contains escape ASCII in tags\n",
-                        ERR_SET, RESET);
-                exit(-1);
-            }
+        Pending *pending = &g_pending[index];
+        if (cqe->res < 0){
+            fprintf(stderr, "%sERROR%s: output file could not be written: %s\n",
+                    ERR_SET, RESET, strerror(-cqe->res));
+            exit(-1);
+        }
+        pending->done += cqe->res;
+        if (pending->done < pending->output.size){
+            ring_write(index);
+        } else {
+            close(pending->fd);
+            pending->fd = -1;
         }
-#if LOG
-        printf("tags: ");
-        print_tags(tags, tags_size);
-#endif
     }
+}
 
-    // PIXELS
-    if (pixel_size == 0){
-        printf("%sWARNING%s: file is missing the pixel data\n",
-                WARN_SET, RESET);
-    } else {
-        uint8_t pixels[pixel_size];
-        read_bytes_to_buffer(file, pixels, pixel_size);
-        if (save){ create_jpg(pixels, width_size, height_size); }
+void ring_reap(Ring *ring){
+    unsigned head = *ring->cq_head;
+    const unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail){
+        ring_complete(&ring->cqes[head & *ring->cq_mask]);
+        ++head;
     }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
 }
 
-#define DUR 8
-void read_caff_animation(FILE *file, bool save){
-    // DURATION
-    size_t duration = read_bytes_to_value(file, DUR);
-# if LOG
-    printf("duration: %zu\n", duration);
-#endif
-    // CIFF
-    read_ciff(file, save);
+// waits for every output being written
+void ring_drain(Ring *ring){
+    for (size_t i = 0; i < SLOTS; ++i){
+        while (g_pending[i].fd != -1){
+            ring_submit(ring, 1);
+            ring_reap(ring);
+        }
+    }
 }
 
-#define ID 1
-#define SZ 8
-void read_caff(FILE *file){
-    // HEADER
-    size_t header_id = read_bytes_to_value(file, ID);
-    if (header_id != 1){
+void ring_write_output(const char *file_name, Output *output){
+    size_t index = 0;
+    while (g_pending[index].fd != -1){
+        if (++index == SLOTS){
+            ring_submit(g_ring, 1);
+            ring_reap(g_ring);
+            index = 0;
+        }
+    }
+    Pending *pending = &g_pending[index];
+    pending->fd = open(file_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (pending->fd == -1){
         fprintf(stderr,
-                "%sERROR%s: file does not start with a header\n",
+                "%sERROR%s: could not open output file for writing\n",
                 ERR_SET, RESET);
         exit(-1);
     }
-    assert(header_id == 1);
+    // the encoder goes on in the buffer of the finished write
+    Output spare = pending->output;
+    pending->output = *output;
+    pending->done = 0;
+    *output = spare;
+    output->size = 0;
 
-    /* cap is no needed for hdr
-    because all chunks lengths
-    are predefined in the format */
-    const size_t header_size = read_bytes_to_value(file, SZ);
-    assert(header_size == 20);
+    ring_write(index);
+    ring_submit(g_ring, 0);
+}
 
-    /* the only valuable information
-    in the header block is the
-    number of animations in the CAFF */
-    const size_t number_of_animations = read_caff_header(file);
-#if LOG
-    printf("\n");
-#endif
+// ATOMIC OUTPUT
+/* with -output a file is written under a temporary name and
+only gets its own once it is on disk, so a crash never leaves
+a partial file under the final name. instead of an fsync per
+file the renames wait for a batch: one syncfs makes the whole
+batch durable before it is renamed, and the next one makes
+those renames durable along with the next batch */
+#define SYNC_BATCH 256
+#define PART ".part"
+char *g_renames[SYNC_BATCH];
+size_t g_rename_count;
 
-    // ANIMATION + CREDITS blocks
-    /* read all blocks from file
-    + 1 for the credits block */
-    bool save_first = true;
-    for (size_t i = 0; i < number_of_animations + 1; ++i){
-        size_t block_id = read_bytes_to_value(file, ID);
+void sync_outputs(void){
+    const int fd = open(g_output_root, O_RDONLY | O_DIRECTORY);
+    if (fd == -1 || syncfs(fd) != 0){
+        fprintf(stderr, "%sERROR%s: could not sync the outputs: %s\n",
+                ERR_SET, RESET, strerror(errno));
+        exit(-1);
+    }
+    close(fd);
+}
+
+void rename_outputs(void){
+    if (g_ring != NULL){ ring_drain(g_ring); }
+    sync_outputs();
+    for (size_t i = 0; i < g_rename_count; ++i){
+        char part[strlen(g_renames[i]) + sizeof(PART)];
+        snprintf(part, sizeof(part), "%s%s", g_renames[i], PART);
+        if (rename(part, g_renames[i]) != 0){
+            fprintf(stderr, "%sERROR%s: could not rename \"%s\": %s\n",
+                    ERR_SET, RESET, part, strerror(errno));
+            exit(-1);
+        }
+        free(g_renames[i]);
+    }
+    g_rename_count = 0;
+}
+
+// the file was written under its temporary name
+void rename_later(const char *file_name){
+    g_renames[g_rename_count] = strdup(file_name);
+    if (g_renames[g_rename_count] == NULL){
+        fprintf(stderr, "%sERROR%s: could not allocate the output filename\n",
+                ERR_SET, RESET);
+        exit(-1);
+    }
+    if (++g_rename_count == SYNC_BATCH){ rename_outputs(); }
+}
+
+// TAR
+/* with -tar every output becomes an entry of a single tar
+archive, written as soon as the output is finished, so a run
+is one sequential write and no file is created per image. the
+entries are ustar, a name too long for it gets a pax header
+and a size too large for it is written in base-256 */
+#define TAR_BLOCK 512
+#define TAR_NAME 100
+#define TAR_PREFIX 155
+const char *g_tar_path;
+int g_tar_fd = -1;
+
+typedef struct {
+    char name[TAR_NAME];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char checksum[8];
+    char type;
+    char link[TAR_NAME];
+    char magic[6];
+    char version[2];
+    char user[32];
+    char group[32];
+    char major[8];
+    char minor[8];
+    char prefix[TAR_PREFIX];
+    char padding[12];
+} TarHeader;
+
+// a header and the data padded to whole blocks
+void tar_entry(const char *name, const char type, const void *data, const size_t size){
+    static const uint8_t zeros[TAR_BLOCK];
+    TarHeader header;
+    memset(&header, 0, sizeof(header));
+    const size_t length = strlen(name);
+    const char *split = NULL;
+    if (length > TAR_NAME){
+        // the directories go in the prefix, the rest in the name
+        for (const char *c = name + length - TAR_NAME - 1; c < name + length; ++c){
+            if (*c == '/' && c - name <= TAR_PREFIX && c + 1 < name + length){
+                split = c;
+                break;
+            }
+        }
+        if (split == NULL){
+            char record[length + 32];
+            size_t record_size = length + 7;
+            while (snprintf(NULL, 0, "%zu", record_size) + length + 7 != record_size){ ++record_size; }
+            snprintf(record, sizeof(record), "%zu path=%s\n", record_size, name);
+            tar_entry("PaxHeader", 'x', record, record_size);
+        }
+    }
+    if (split != NULL){
+        memcpy(header.prefix, name, (size_t)(split - name));
+        memcpy(header.name, split + 1, length - (size_t)(split - name) - 1);
+    } else {
+        memcpy(header.name, name, length < TAR_NAME ? length : TAR_NAME);
+    }
+    snprintf(header.mode, sizeof(header.mode), "%07o", type == '5' ? 0755 : 0644);
+    snprintf(header.uid, sizeof(header.uid), "%07o", 0);
+    snprintf(header.gid, sizeof(header.gid), "%07o", 0);
+    if (size > 077777777777){
+        // 8 GiB and more do not fit in octal, base-256 as GNU tar writes it
+        uint64_t value = size;
+        for (size_t i = sizeof(header.size) - 1; i > 0; --i){
+            header.size[i] = (char)(value & 0xff);
+            value >>= 8;
+        }
+        header.size[0] = (char)0x80;
+    } else {
+        snprintf(header.size, sizeof(header.size), "%011zo", size);
+    }
+    snprintf(header.mtime, sizeof(header.mtime), "%011llo", (unsigned long long)time(NULL));
+    header.type = type;
+    memcpy(header.magic, "ustar", 6);
+    memcpy(header.version, "00", 2);
+    memset(header.checksum, ' ', sizeof(header.checksum));
+    unsigned checksum = 0;
+    for (size_t i = 0; i < sizeof(header); ++i){ checksum += ((uint8_t *)&header)[i]; }
+    snprintf(header.checksum, sizeof(header.checksum), "%06o", checksum);
+
+    struct iovec parts[3] = {
+        { &header, sizeof(header) },
+        { (void *)data, size },
+        { (void *)zeros, (TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK }
+    };
+    write_parts(g_tar_fd, parts, 3);
+}
+
+/* the archive is opened before anything is logged: on
+standard output the log moves to standard error */
+void tar_open(void){
+    if (strcmp(g_tar_path, "-") == 0){
+        fflush(stdout);
+        g_tar_fd = dup(STDOUT_FILENO);
+        if (g_tar_fd != -1){ dup2(STDERR_FILENO, STDOUT_FILENO); }
+    } else {
+        g_tar_fd = open(g_tar_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    }
+    if (g_tar_fd == -1){
+        fprintf(stderr, "%sERROR%s: could not open the tar for writing: %s\n",
+                ERR_SET, RESET, strerror(errno));
+        exit(-1);
+    }
+}
+
+// two empty blocks end the archive
+void tar_close(void){
+    static const uint8_t zeros[2 * TAR_BLOCK];
+    struct iovec end = { (void *)zeros, sizeof(zeros) };
+    write_parts(g_tar_fd, &end, 1);
+    if (close(g_tar_fd) != 0){
+        fprintf(stderr, "%sERROR%s: could not write to the tar: %s\n",
+                ERR_SET, RESET, strerror(errno));
+        exit(-1);
+    }
+    g_tar_fd = -1;
+}
+
+// a directory of the outputs, an entry of its own in the tar
+void make_output_directory(const char *path){
+    if (g_tar_fd != -1){
+        char name[strlen(path) + 2];
+        snprintf(name, sizeof(name), "%s/", path);
+        tar_entry(name, '5', NULL, 0);
+    } else {
+        make_directory(path);
+    }
+}
+
+// Y4M
+/* with -y4m the frames are not encoded but written to standard
+output as one YUV4MPEG2 stream for ffmpeg and other video tools.
+a frame is converted to full range BT.601 YCbCr without
+subsampling and repeated for its duration at the frame rate,
+rounded by the time elapsed so the error does not add up. the
+frames of every input file follow each other and have to share
+the size of the stream. the log moves to standard error */
+#define Y4M_FRAME "FRAME\n"
+// frames in a single writev, two parts each
+#define Y4M_REPEATS 128
+size_t g_y4m_fps;
+int g_y4m_fd = -1;
+size_t g_y4m_width;
+size_t g_y4m_height;
+// the time of the frames read so far times the frame rate, in milliseconds
+size_t g_y4m_time;
+size_t g_y4m_frames;
+uint8_t *g_y4m_planes;
+size_t g_y4m_capacity;
+
+void y4m_open(void){
+    fflush(stdout);
+    g_y4m_fd = dup(STDOUT_FILENO);
+    if (g_y4m_fd == -1){
+        fprintf(stderr, "%sERROR%s: could not open the stream: %s\n",
+                ERR_SET, RESET, strerror(errno));
+        exit(-1);
+    }
+    dup2(STDERR_FILENO, STDOUT_FILENO);
+    g_y4m_width = 0;
+    g_y4m_height = 0;
+    g_y4m_time = 0;
+    g_y4m_frames = 0;
+}
+
+void y4m_close(void){
+    if (close(g_y4m_fd) != 0){
+        fprintf(stderr, "%sERROR%s: could not write the stream: %s\n",
+                ERR_SET, RESET, strerror(errno));
+        exit(-1);
+    }
+    g_y4m_fd = -1;
+}
+
+void y4m_frame(const uint8_t *rgb_pixels, const size_t width, const size_t height){
+    if (g_y4m_width == 0){
+        char header[128];
+        const int size = snprintf(header, sizeof(header),
+            "YUV4MPEG2 W%zu H%zu F%zu:1 Ip A1:1 C444 XCOLORRANGE=FULL\n",
+            width, height, g_y4m_fps);
+        struct iovec part = { header, (size_t)size };
+        write_parts(g_y4m_fd, &part, 1);
+        g_y4m_width = width;
+        g_y4m_height = height;
+    } else if (width != g_y4m_width || height != g_y4m_height){
+        fprintf(stderr, "%sERROR%s: a %zux%zu frame does not fit the %zux%zu stream\n",
+                ERR_SET, RESET, width, height, g_y4m_width, g_y4m_height);
+        exit(-1);
+    }
+
+    const size_t target = (g_y4m_time + 500) / 1000;
+    const size_t repeats = target - g_y4m_frames;
+    g_y4m_frames = target;
+#if LOG
+    printf("written %zu times to the stream\n", repeats);
+#endif
+    // shorter than a frame at the frame rate
+    if (repeats == 0){ return; }
+
+    const size_t count = width * height;
+    if (3 * count > g_y4m_capacity){
+        uint8_t *grown = pool_realloc(g_y4m_planes, 3 * count);
+        if (grown == NULL){
+            fprintf(stderr, "%sERROR%s: could not allocate %zu bytes for the planes\n",
+                    ERR_SET, RESET, 3 * count);
+            exit(-1);
+        }
+        g_y4m_planes = grown;
+        g_y4m_capacity = 3 * count;
+    }
+    uint8_t *y = g_y4m_planes, *u = y + count, *v = u + count;
+    for (size_t i = 0; i < count; ++i){
+        const int r = rgb_pixels[3 * i], g = rgb_pixels[3 * i + 1], b = rgb_pixels[3 * i + 2];
+        y[i] = (uint8_t)((77 * r + 150 * g + 29 * b + 128) >> 8);
+        const int cb = (-43 * r - 85 * g + 128 * b + 32896) >> 8;
+        const int cr = (128 * r - 107 * g - 21 * b + 32896) >> 8;
+        u[i] = (uint8_t)(cb > 255 ? 255 : cb);
+        v[i] = (uint8_t)(cr > 255 ? 255 : cr);
+    }
+
+    struct iovec parts[2 * Y4M_REPEATS];
+    for (size_t left = repeats; left != 0;){
+        const size_t group = left < Y4M_REPEATS ? left : Y4M_REPEATS;
+        // set again for every group, write_parts moves them as it writes
+        for (size_t i = 0; i < group; ++i){
+            parts[2 * i] = (struct iovec){ Y4M_FRAME, sizeof(Y4M_FRAME) - 1 };
+            parts[2 * i + 1] = (struct iovec){ g_y4m_planes, 3 * count };
+        }
+        write_parts(g_y4m_fd, parts, (int)(2 * group));
+        left -= group;
+    }
+}
+
+void start_outputs(void){
+    if (g_tar_path != NULL){ tar_open(); }
+    if (g_y4m_fps != 0){ y4m_open(); }
+}
+
+// at the end of a batch of files the last renames are made durable too
+void finish_outputs(void){
+    if (g_tar_fd != -1){ tar_close(); }
+    if (g_y4m_fd != -1){ y4m_close(); }
+    if (g_output_root == NULL){ return; }
+    if (g_rename_count != 0){ rename_outputs(); }
+    sync_outputs();
+}
+
+void write_output(const char *file_name, Output *output){
+    if (g_tar_fd != -1){
+        tar_entry(file_name, '0', output->data, output->size);
+        return;
+    }
+    char part[strlen(file_name) + sizeof(PART)];
+    const char *path = file_name;
+    if (g_output_root != NULL){
+        snprintf(part, sizeof(part), "%s%s", file_name, PART);
+        path = part;
+    }
+    if (g_ring != NULL){
+        ring_write_output(path, output);
+    } else {
+        FILE *file = fopen(path, "wb");
+        if (file == NULL) {
+            fprintf(stderr,
+                    "%sERROR%s: could not open output file for writing\n",
+                    ERR_SET, RESET);
+            exit(-1);
+        }
+        if (fwrite(output->data, 1, output->size, file) != output->size || fclose(file) != 0) {
+            fprintf(stderr,
+                    "%sERROR%s: output file could not be written\n",
+                    ERR_SET, RESET);
+            exit(-1);
+        }
+    }
+    if (g_output_root != NULL){ rename_later(file_name); }
+}
+
+#define QUALITY 99
+int g_quality = QUALITY;
+/* the quantization tables and headers of a quality are built
+once, every JPG of the run and every thread shares them */
+stbi_write_jpg_encoder *g_jpg_encoder;
+int g_jpg_encoder_quality;
+
+// before any encoding, a daemon worker keeps it while the quality stays
+void prepare_jpg_encoder(void){
+    if (g_format != FORMAT_JPG){ return; }
+    if (g_jpg_encoder != NULL && g_jpg_encoder_quality == g_quality){ return; }
+    stbi_write_jpg_encoder_free(g_jpg_encoder);
+    g_jpg_encoder = stbi_write_jpg_encoder_create(g_quality);
+    if (g_jpg_encoder == NULL){
+        fprintf(stderr, "%sERROR%s: could not allocate the JPG encoder\n",
+                ERR_SET, RESET);
+        exit(-1);
+    }
+    g_jpg_encoder_quality = g_quality;
+}
+#define LEVEL 8
+/* true if every pixel has R = G = B, stops at the first
+one with colour, which is usually in the first few bytes */
+bool is_grey(const uint8_t *rgb_pixels, const size_t pixel_count){
+    const size_t size = pixel_count * 3;
+    size_t index = 0;
+#ifdef __SSE2__
+    /* 48 bytes are 16 pixels in three registers, each byte is
+    compared to the next one and R and G of a pixel must match */
+    static const int need[3] = {0xb6db, 0xdb6d, 0x6db6};
+    for (; index + 49 <= size; index += 48){
+        for (size_t k = 0; k < 3; k++){
+            const uint8_t *bytes = rgb_pixels + index + k * 16;
+            __m128i equal = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) bytes),
+                                           _mm_loadu_si128((const __m128i *) (bytes + 1)));
+            if ((_mm_movemask_epi8(equal) & need[k]) != need[k]){ return false; }
+        }
+    }
+#endif
+    for (; index < size; index += 3){
+        if (rgb_pixels[index] != rgb_pixels[index + 1] ||
+            rgb_pixels[index] != rgb_pixels[index + 2]){ return false; }
+    }
+    return true;
+}
+
+/* a grey frame is written with the luma component only,
+a third of the blocks to transform and a smaller file */
+void encode_jpg(Output *output, uint8_t *rgb_pixels, size_t width, size_t height){
+    int write;
+    if (width * height != 0 && is_grey(rgb_pixels, width * height)){
+        uint8_t *grey_pixels = pool_malloc(width * height);
+        if (grey_pixels == NULL){
+            fprintf(stderr,
+                    "%sERROR%s: not enough memory for the grey image\n",
+                    ERR_SET, RESET);
+            exit(-1);
+        }
+        for (size_t i = 0; i < width * height; i++){
+            grey_pixels[i] = rgb_pixels[i * 3];
+        }
+        write = stbi_write_jpg_encode_to_func(g_jpg_encoder, append_output, output,
+                                              width, height, 1, grey_pixels);
+        pool_free(grey_pixels);
+    } else {
+        write = stbi_write_jpg_encode_to_func(g_jpg_encoder, append_output, output,
+                                              width, height, 3, rgb_pixels);
+    }
+    if (write == 0) {
+        fprintf(stderr,
+                "%sERROR%s: output file has invalid parameters\n",
+                ERR_SET, RESET);
+        exit(-1);
+    }
+    assert(write == 1);
+}
+
+void encode_png(Output *output, uint8_t *rgb_pixels, size_t width, size_t height){
+    int write = stbi_write_png_to_func(append_output, output,
+                                       width, height, 3, rgb_pixels, 3 * width);
+    if (write == 0) {
+        fprintf(stderr,
+                "%sERROR%s: could not compress the PNG\n",
+                ERR_SET, RESET);
+        exit(-1);
+    }
+    assert(write == 1);
+}
+
+/* lossless like PNG, but a single pass over
+the pixels without any deflate behind it */
+void encode_qoi(Output *output, uint8_t *rgb_pixels, size_t width, size_t height){
+    int write = stbi_write_qoi_to_func(append_output, output,
+                                       width, height, 3, rgb_pixels);
+    if (write == 0) {
+        fprintf(stderr,
+                "%sERROR%s: output file has invalid parameters\n",
+                ERR_SET, RESET);
+        exit(-1);
+    }
+    assert(write == 1);
+}
+
+/* the encoders index the pixels with int and a JPG
+stores 16-bit sizes, larger images need -tile */
+bool fits_encoder(const size_t width, const size_t height){
+    if (g_format == FORMAT_JPG && (width > 65535 || height > 65535)){ return false; }
+    return height == 0 || (width <= INT_MAX / 3 && width * 3 + 1 <= INT_MAX / height);
+}
+
+void encode_image(Output *output, uint8_t *rgb_pixels, size_t width, size_t height){
+    if (!fits_encoder(width, height)){
+        fprintf(stderr,
+                "%sERROR%s: a %zux%zu image is too large to encode at once, use \"-tile\"\n",
+                ERR_SET, RESET, width, height);
+        exit(-1);
+    }
+    output->size = 0;
+    switch (g_format){
+        case FORMAT_JPG: encode_jpg(output, rgb_pixels, width, height); break;
+        case FORMAT_PNG: encode_png(output, rgb_pixels, width, height); break;
+        case FORMAT_QOI: encode_qoi(output, rgb_pixels, width, height); break;
+    }
+}
+
+void create_image(uint8_t *rgb_pixels, size_t width, size_t height){
+    encode_image(&g_output, rgb_pixels, width, height);
+    write_output(g_file_name, &g_output);
+#if LOG
+    printf("successfully saved to \"%s\"\n", g_file_name);
+#endif
+}
+
+// LADDER
+/* with -ladder an image is written at the requested sizes instead,
+itself only when full is among them. the longest side of a preview
+is the requested size. the pixel section
+is read in strips and every strip is averaged into a pyramid of
+halves right away; a preview is then resampled from the smallest
+level that is still as large. the levels only ever grow */
+#define LADDER 8
+#define LEVELS 32
+#define STRIP 64
+#define FULL 0
+size_t g_ladder[LADDER];
+size_t g_ladder_count;
+
+typedef struct {
+    size_t width;
+    size_t height;
+    size_t rows;        // rows averaged so far
+    uint8_t *pixels;
+    size_t capacity;
+} Level;
+
+// level 0 is the image itself
+Level g_levels[LEVELS];
+size_t g_level_count;
+uint8_t *g_preview;
+size_t g_preview_capacity;
+
+uint8_t *reserve_pixels(uint8_t **pixels, size_t *capacity, const size_t size){
+    if (size > *capacity){
+        uint8_t *grown = pool_realloc(*pixels, size);
+        if (grown == NULL){
+            fprintf(stderr, "%sERROR%s: could not allocate %zu bytes for the pixels\n",
+                    ERR_SET, RESET, size);
+            exit(-1);
+        }
+        *pixels = grown;
+        *capacity = size;
+    }
+    return *pixels;
+}
+
+void ladder_start(uint8_t *pixels, const size_t width, const size_t height){
+    size_t smallest = 0;
+    for (size_t i = 0; i < g_ladder_count; ++i){
+        if (g_ladder[i] != FULL && (smallest == 0 || g_ladder[i] < smallest)){
+            smallest = g_ladder[i];
+        }
+    }
+    g_levels[0].width = width;
+    g_levels[0].height = height;
+    g_levels[0].rows = 0;
+    g_levels[0].pixels = pixels;
+    g_level_count = 1;
+    while (g_level_count < LEVELS && smallest != 0){
+        const Level *above = &g_levels[g_level_count - 1];
+        Level *level = &g_levels[g_level_count];
+        const size_t level_width = (above->width + 1) / 2;
+        const size_t level_height = (above->height + 1) / 2;
+        if ((level_width > level_height ? level_width : level_height) < smallest
+            || (above->width == 1 && above->height == 1)){ break; }
+        level->width = level_width;
+        level->height = level_height;
+        level->rows = 0;
+        reserve_pixels(&level->pixels, &level->capacity, level_width * level_height * 3);
+        ++g_level_count;
+    }
+}
+
+// each output pixel averages two by two pixels of the rows above, the last column repeats
+void halve_rows(const uint8_t *row0, const uint8_t *row1, uint8_t *out,
+                const size_t above_width, const size_t width){
+    for (size_t x = 0; x < width; ++x){
+        const size_t x0 = 2 * x * 3;
+        const size_t x1 = 2 * x + 1 < above_width ? x0 + 3 : x0;
+        for (size_t c = 0; c < 3; ++c){
+            out[x * 3 + c] = (uint8_t)((row0[x0 + c] + row0[x1 + c]
+                                      + row1[x0 + c] + row1[x1 + c] + 2) / 4);
+        }
+    }
+}
+
+// the first rows of the image are read, average what they complete
+void ladder_rows(const size_t rows){
+    g_levels[0].rows = rows;
+    for (size_t l = 1; l < g_level_count; ++l){
+        const Level *above = &g_levels[l - 1];
+        Level *level = &g_levels[l];
+        for (; level->rows < level->height; ++level->rows){
+            const size_t y0 = 2 * level->rows;
+            const size_t y1 = y0 + 1 < above->height ? y0 + 1 : y0;
+            if (above->rows <= y1){ break; }
+            const uint8_t *row0 = above->pixels + y0 * above->width * 3;
+            const uint8_t *row1 = above->pixels + y1 * above->width * 3;
+            uint8_t *out = level->pixels + level->rows * level->width * 3;
+            halve_rows(row0, row1, out, above->width, level->width);
+        }
+    }
+}
+
+/* box filter with fractional weights: an output pixel covers
+scale source pixels each way and every source pixel counts
+with the part of it that lies inside */
+void ladder_resample(const Level *level, uint8_t *out, const size_t width, const size_t height){
+    const double scale_x = (double)level->width / width;
+    const double scale_y = (double)level->height / height;
+    for (size_t y = 0; y < height; ++y){
+        const double top = y * scale_y, bottom = top + scale_y;
+        for (size_t x = 0; x < width; ++x){
+            const double left = x * scale_x, right = left + scale_x;
+            double sum[3] = { 0, 0, 0 };
+            for (size_t sy = (size_t)top; sy < level->height && sy < bottom; ++sy){
+                const double weight_y = (bottom < sy + 1 ? bottom : sy + 1)
+                                      - (top > sy ? top : sy);
+                const uint8_t *row = level->pixels + sy * level->width * 3;
+                for (size_t sx = (size_t)left; sx < level->width && sx < right; ++sx){
+                    const double weight = weight_y * ((right < sx + 1 ? right : sx + 1)
+                                                    - (left > sx ? left : sx));
+                    for (size_t c = 0; c < 3; ++c){ sum[c] += weight * row[sx * 3 + c]; }
+                }
+            }
+            for (size_t c = 0; c < 3; ++c){
+                out[(y * width + x) * 3 + c] = (uint8_t)(sum[c] / (scale_x * scale_y) + 0.5);
+            }
+        }
+    }
+}
+
+// every requested size under {name}_{size}.{format}, the full size under {name}.{format}
+void create_ladder(void){
+    const Level *full = &g_levels[0];
+    const size_t longest = full->width > full->height ? full->width : full->height;
+    const size_t capacity = strlen(g_file_name) + 24;
+    char file_name[capacity];
+    for (size_t i = 0; i < g_ladder_count; ++i){
+        const size_t size = g_ladder[i];
+        if (size == FULL){
+            create_image(full->pixels, full->width, full->height);
+            continue;
+        }
+        set_frame_file_name(file_name, capacity, size);
+        if (size >= longest){
+            // nothing to scale down
+            encode_image(&g_output, full->pixels, full->width, full->height);
+        } else {
+            size_t l = 0;
+            while (l + 1 < g_level_count
+                   && (g_levels[l + 1].width > g_levels[l + 1].height
+                       ? g_levels[l + 1].width : g_levels[l + 1].height) >= size){ ++l; }
+            size_t width = (full->width * size + longest / 2) / longest;
+            size_t height = (full->height * size + longest / 2) / longest;
+            width = width != 0 ? width : 1;
+            height = height != 0 ? height : 1;
+            uint8_t *preview = reserve_pixels(&g_preview, &g_preview_capacity, width * height * 3);
+            ladder_resample(&g_levels[l], preview, width, height);
+            encode_image(&g_output, preview, width, height);
+        }
+        write_output(file_name, &g_output);
+#if LOG
+        printf("successfully saved to \"%s\"\n", file_name);
+#endif
+    }
+}
+
+void read_ladder(FILE *file, const size_t width, const size_t height){
+    uint8_t *pixels = acquire_pixels(width * height * 3);
+    const size_t row = width * 3;
+    ladder_start(pixels, width, height);
+    for (size_t y = 0; y < height; y += STRIP){
+        const size_t rows = height - y < STRIP ? height - y : STRIP;
+        read_bytes_to_buffer(file, pixels + y * row, rows * row);
+        ladder_rows(y + rows);
+    }
+    create_ladder();
+}
+
+// PIPELINE
+/* with -all every frame of a CAFF is converted: the calling
+thread reads the blocks, workers encode the frames read
+before them and a writer stores the results in order.
+frames come from a fixed pool, so a slow stage holds back
+the stages before it instead of piling up frames */
+#define QUEUE 4
+
+typedef struct {
+    size_t index;       // order of the writes
+    size_t number;      // frame of the animation, names the output
+    size_t width;
+    size_t height;
+    // position of a tile
+    size_t level;
+    size_t column;
+    size_t row;
+    uint8_t *pixels;
+    size_t capacity;
+    Output output;
+} Frame;
+
+typedef struct {
+    const char *name;
+    Frame **items;
+    size_t capacity;
+    size_t head;
+    size_t count;
+    bool closed;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    // occupancy seen by the pushes and stalls on both ends
+    size_t pushes;
+    size_t occupancy;
+    size_t full;
+    size_t empty;
+} Queue;
+
+typedef struct {
+    bool tiled;
+    size_t threads;
+    size_t frame_count;
+    size_t next_index;
+    Frame *frames;
+    Queue free;
+    Queue encode;
+    Queue write;
+    pthread_t *workers;
+    pthread_t writer;
+} Pipeline;
+
+bool g_all;
+// the frame of a CAFF converted without -all
+size_t g_frame;
+// the frame of a CAFF being read, a frame without pixels leaves a gap
+size_t g_frame_number;
+size_t g_threads;
+Pipeline *g_pipeline;
+
+void queue_init(Queue *queue, const char *name, const size_t capacity){
+    memset(queue, 0, sizeof(*queue));
+    queue->name = name;
+    queue->capacity = capacity;
+    queue->items = calloc(capacity, sizeof(Frame *));
+    if (queue->items == NULL){
+        fprintf(stderr, "%sERROR%s: could not allocate the %s queue\n",
+                ERR_SET, RESET, name);
+        exit(-1);
+    }
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->not_empty, NULL);
+    pthread_cond_init(&queue->not_full, NULL);
+}
+
+void queue_destroy(Queue *queue){
+    pthread_mutex_destroy(&queue->lock);
+    pthread_cond_destroy(&queue->not_empty);
+    pthread_cond_destroy(&queue->not_full);
+    free(queue->items);
+}
+
+void queue_push(Queue *queue, Frame *frame){
+    pthread_mutex_lock(&queue->lock);
+    if (queue->count == queue->capacity){ ++queue->full; }
+    while (queue->count == queue->capacity){
+        pthread_cond_wait(&queue->not_full, &queue->lock);
+    }
+    queue->items[(queue->head + queue->count) % queue->capacity] = frame;
+    ++queue->count;
+    ++queue->pushes;
+    queue->occupancy += queue->count;
+    pthread_cond_signal(&queue->not_empty);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+// returns NULL once the queue is closed and drained
+Frame *queue_pop(Queue *queue){
+    pthread_mutex_lock(&queue->lock);
+    if (queue->count == 0 && !queue->closed){ ++queue->empty; }
+    while (queue->count == 0 && !queue->closed){
+        pthread_cond_wait(&queue->not_empty, &queue->lock);
+    }
+    Frame *frame = NULL;
+    if (queue->count != 0){
+        frame = queue->items[queue->head];
+        queue->head = (queue->head + 1) % queue->capacity;
+        --queue->count;
+        pthread_cond_signal(&queue->not_full);
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return frame;
+}
+
+void queue_close(Queue *queue){
+    pthread_mutex_lock(&queue->lock);
+    queue->closed = true;
+    pthread_cond_broadcast(&queue->not_empty);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+void queue_report(Queue *queue){
+    printf("%s: %.2f of %zu on average, full %zu times, empty %zu times\n",
+           queue->name,
+           queue->pushes != 0 ? (double)queue->occupancy / queue->pushes : 0.0,
+           queue->capacity, queue->full, queue->empty);
+}
+
+void *pipeline_worker(void *argument){
+    Pipeline *pipeline = argument;
+    Frame *frame;
+    while ((frame = queue_pop(&pipeline->encode)) != NULL){
+        encode_image(&frame->output, frame->pixels, frame->width, frame->height);
+        queue_push(&pipeline->write, frame);
+    }
+    return NULL;
+}
+
+void *pipeline_writer(void *argument){
+    Pipeline *pipeline = argument;
+    const size_t capacity = strlen(g_file_name) + 80;
+    char file_name[capacity];
+    // frames finished ahead of their turn
+    Frame *waiting[pipeline->frame_count];
+    size_t waiting_count = 0;
+    size_t next = 0;
+
+    Frame *frame;
+    while ((frame = queue_pop(&pipeline->write)) != NULL){
+        waiting[waiting_count++] = frame;
+        for (size_t i = 0; i < waiting_count;){
+            if (waiting[i]->index != next){
+                ++i;
+                continue;
+            }
+            Frame *ready = waiting[i];
+            if (pipeline->tiled){
+                set_tile_file_name(file_name, capacity, ready->level, ready->column, ready->row);
+            } else {
+                set_frame_file_name(file_name, capacity, ready->number);
+            }
+            write_output(file_name, &ready->output);
+#if LOG
+            printf("successfully saved to \"%s\"\n", file_name);
+#endif
+            waiting[i] = waiting[--waiting_count];
+            queue_push(&pipeline->free, ready);
+            ++next;
+            i = 0;
+        }
+    }
+    assert(waiting_count == 0);
+    return NULL;
+}
+
+void pipeline_start(Pipeline *pipeline, const bool tiled){
+    pipeline->tiled = tiled;
+    pipeline->threads = g_threads;
+    pipeline->frame_count = g_threads + QUEUE;
+    pipeline->next_index = 0;
+    pipeline->frames = calloc(pipeline->frame_count, sizeof(Frame));
+    pipeline->workers = calloc(pipeline->threads, sizeof(pthread_t));
+    if (pipeline->frames == NULL || pipeline->workers == NULL){
+        fprintf(stderr, "%sERROR%s: could not allocate the pipeline\n",
+                ERR_SET, RESET);
+        exit(-1);
+    }
+    queue_init(&pipeline->free, "free frames", pipeline->frame_count);
+    queue_init(&pipeline->encode, "encode queue", QUEUE);
+    queue_init(&pipeline->write, "write queue", QUEUE);
+    for (size_t i = 0; i < pipeline->frame_count; ++i){
+        queue_push(&pipeline->free, &pipeline->frames[i]);
+    }
+    // the initial fill is not a measurement
+    pipeline->free.pushes = 0;
+    pipeline->free.occupancy = 0;
+
+    for (size_t i = 0; i < pipeline->threads; ++i){
+        if (pthread_create(&pipeline->workers[i], NULL, pipeline_worker, pipeline) != 0){
+            fprintf(stderr, "%sERROR%s: could not start a pipeline worker\n",
+                    ERR_SET, RESET);
+            exit(-1);
+        }
+    }
+    if (pthread_create(&pipeline->writer, NULL, pipeline_writer, pipeline) != 0){
+        fprintf(stderr, "%sERROR%s: could not start the pipeline writer\n",
+                ERR_SET, RESET);
+        exit(-1);
+    }
+    g_pipeline = pipeline;
+}
+
+// a frame from the pool, waits while every frame is in flight
+Frame *pipeline_acquire(Pipeline *pipeline, const size_t pixel_size){
+    Frame *frame = queue_pop(&pipeline->free);
+    assert(frame != NULL);
+    if (pixel_size > frame->capacity){
+        uint8_t *pixels = pool_realloc(frame->pixels, pixel_size);
+        if (pixels == NULL){
+            fprintf(stderr, "%sERROR%s: could not allocate %zu bytes for the pixels\n",
+                    ERR_SET, RESET, pixel_size);
+            exit(-1);
+        }
+        frame->pixels = pixels;
+        frame->capacity = pixel_size;
+    }
+    return frame;
+}
+
+void pipeline_submit(Pipeline *pipeline, Frame *frame, size_t width, size_t height){
+    frame->index = pipeline->next_index++;
+    frame->width = width;
+    frame->height = height;
+    queue_push(&pipeline->encode, frame);
+}
+
+void pipeline_finish(Pipeline *pipeline){
+    queue_close(&pipeline->encode);
+    for (size_t i = 0; i < pipeline->threads; ++i){
+        pthread_join(pipeline->workers[i], NULL);
+    }
+    queue_close(&pipeline->write);
+    pthread_join(pipeline->writer, NULL);
+    g_pipeline = NULL;
+
+#if LOG
+    printf("pipeline: %zu frames, %zu workers, %zu frames in flight\n",
+           pipeline->next_index, pipeline->threads, pipeline->frame_count);
+    queue_report(&pipeline->free);
+    queue_report(&pipeline->encode);
+    queue_report(&pipeline->write);
+#endif
+
+    queue_destroy(&pipeline->free);
+    queue_destroy(&pipeline->encode);
+    queue_destroy(&pipeline->write);
+    for (size_t i = 0; i < pipeline->frame_count; ++i){
+        pool_free(pipeline->frames[i].pixels);
+        pool_free(pipeline->frames[i].output.data);
+    }
+    free(pipeline->frames);
+    free(pipeline->workers);
+}
+
+// TILES
+/* with -tile the image is cut into tiles that are encoded
+on the pipeline. rows are read into a strip one tile high,
+so memory follows the width and the tile size, never the
+height, and the encoders only ever see a tile. with -dzi
+every level of a deep zoom pyramid is tiled too: a level
+halves the rows of the one above as they arrive */
+#define TILE 256
+#define TILE_LEVELS 64
+
+typedef struct {
+    size_t width;
+    size_t height;
+    size_t rows;
+    uint8_t *strip;
+    size_t strip_capacity;
+    // an odd row waiting for the even one to be halved with
+    uint8_t *pending;
+    size_t pending_capacity;
+} TileLevel;
+
+size_t g_tile_size;
+// level 0 is the image itself
+TileLevel g_tile_levels[TILE_LEVELS];
+size_t g_tile_level_count;
+
+void tiles_start(const size_t width, const size_t height){
+    size_t level_width = width, level_height = height;
+    g_tile_level_count = 0;
+    while (true){
+        TileLevel *level = &g_tile_levels[g_tile_level_count++];
+        const size_t strip_rows = level_height < g_tile_size ? level_height : g_tile_size;
+        level->width = level_width;
+        level->height = level_height;
+        level->rows = 0;
+        reserve_pixels(&level->strip, &level->strip_capacity, strip_rows * level_width * 3);
+        reserve_pixels(&level->pending, &level->pending_capacity, level_width * 3);
+        if (!g_dzi || (level_width == 1 && level_height == 1)){ break; }
+        assert(g_tile_level_count < TILE_LEVELS);
+        level_width = (level_width + 1) / 2;
+        level_height = (level_height + 1) / 2;
+    }
+}
+
+// deep zoom counts from a single pixel up to the image
+size_t tile_level_number(const size_t l){
+    return g_tile_level_count - 1 - l;
+}
+
+uint8_t *tiles_next_row(const size_t l){
+    const TileLevel *level = &g_tile_levels[l];
+    return level->strip + (level->rows % g_tile_size) * level->width * 3;
+}
+
+// the strip is complete, each of its tiles goes to the pipeline
+void tiles_emit(Pipeline *pipeline, const size_t l){
+    const TileLevel *level = &g_tile_levels[l];
+    const size_t row = (level->rows - 1) / g_tile_size;
+    const size_t height = level->rows - row * g_tile_size;
+    for (size_t column = 0; column * g_tile_size < level->width; ++column){
+        const size_t left = column * g_tile_size;
+        const size_t width = level->width - left < g_tile_size ? level->width - left : g_tile_size;
+        Frame *frame = pipeline_acquire(pipeline, width * height * 3);
+        for (size_t y = 0; y < height; ++y){
+            memcpy(frame->pixels + y * width * 3,
+                   level->strip + (y * level->width + left) * 3, width * 3);
+        }
+        frame->level = tile_level_number(l);
+        frame->column = column;
+        frame->row = row;
+        pipeline_submit(pipeline, frame, width, height);
+    }
+}
+
+// the next row of a level was written, halve it into the level below
+void tiles_commit(Pipeline *pipeline, const size_t l){
+    TileLevel *level = &g_tile_levels[l];
+    const uint8_t *row = tiles_next_row(l);
+    ++level->rows;
+    if (l + 1 < g_tile_level_count){
+        if (level->rows % 2 == 1 && level->rows < level->height){
+            memcpy(level->pending, row, level->width * 3);
+        } else {
+            const uint8_t *above = level->rows % 2 == 1 ? row : level->pending;
+            halve_rows(above, row, tiles_next_row(l + 1), level->width, g_tile_levels[l + 1].width);
+            tiles_commit(pipeline, l + 1);
+        }
+    }
+    if (level->rows % g_tile_size == 0 || level->rows == level->height){
+        tiles_emit(pipeline, l);
+    }
+}
+
+// {name}.dzi next to the {name}_files directory with a directory per level
+void create_dzi(const size_t width, const size_t height){
+    const int stem = (int)(strlen(g_file_name) - strlen(formats[g_format]) - 1);
+    const size_t capacity = strlen(g_file_name) + 32;
+    char path[capacity];
+    snprintf(path, capacity, "%.*s_files", stem, g_file_name);
+    make_output_directory(path);
+    for (size_t l = 0; l < g_tile_level_count; ++l){
+        snprintf(path, capacity, "%.*s_files/%zu", stem, g_file_name, tile_level_number(l));
+        make_output_directory(path);
+    }
+
+    char manifest[512];
+    const int size = snprintf(manifest, sizeof(manifest),
+        "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+        "<Image xmlns=\"http://schemas.microsoft.com/deepzoom/2008\"\n"
+        "  Format=\"%s\" Overlap=\"0\" TileSize=\"%zu\">\n"
+        "  <Size Width=\"%zu\" Height=\"%zu\"/>\n"
+        "</Image>\n", formats[g_format], g_tile_size, width, height);
+    g_output.size = 0;
+    append_output(&g_output, manifest, size);
+    snprintf(path, capacity, "%.*s.dzi", stem, g_file_name);
+    write_output(path, &g_output);
+#if LOG
+    printf("successfully saved to \"%s\"\n", path);
+#endif
+}
+
+void read_tiles(FILE *file, const size_t width, const size_t height){
+    tiles_start(width, height);
+    if (g_dzi){ create_dzi(width, height); }
+    Pipeline pipeline;
+    pipeline_start(&pipeline, true);
+    for (size_t y = 0; y < height; ++y){
+        read_bytes_to_buffer(file, tiles_next_row(0), width * 3);
+        tiles_commit(&pipeline, 0);
+    }
+    pipeline_finish(&pipeline);
+}
+
+#define WDT 8
+#define HGT 8
+#define ESC 10
+const uint8_t magic_ciff[MGC] = {67, 73, 70, 70};
+void read_ciff(FILE *file, bool save){
+    // MAGIC
+    uint8_t magic[MGC];
+    read_bytes_to_buffer(file, magic, MGC);
+    if (memcmp(magic_ciff, magic, MGC) != 0){
+        fprintf(stderr,
+                "%sERROR%s: file has unknown magic in a block: %c %c %c %c\n",
+                ERR_SET, RESET,
+                (char)magic[0],
+                (char)magic[1],
+                (char)magic[2],
+                (char)magic[3]);
+        exit(-1);
+    }
+
+    // HEADER SIZE
+    const size_t header_size = read_bytes_to_value(file, CAP);
+
+    /* 8-byte long integer,
+    its value is the size of the image
+	pixels located at the end of the file.
+    Its value must be width*heigth*3 */
+    // CONTENT SIZE
+    size_t pixel_size = read_bytes_to_value(file, CAP);
+    // WIDTH
+    size_t width_size = read_bytes_to_value(file, WDT);
+    // HEIGHT
+    size_t height_size = read_bytes_to_value(file, HGT);
+
+    // the product must not wrap, as in read_ciff_fixed
+    if (header_size < MGC + CAP + CAP + WDT + HGT
+        || (height_size != 0 && width_size > SIZE_MAX / 3 / height_size)
+        || pixel_size != (width_size * height_size * 3)){
+        fprintf(stderr,
+                "%sERROR%s: pixel size is not equal to size defined in header\n",
+                ERR_SET, RESET);
+        exit(-1);
+    }
+    assert(pixel_size == (width_size * height_size * 3));
+
+    // bytes for caption and tags
+    const size_t caption_tags_size = header_size - MGC    // 4-byte magic
+                                                 - CAP    // 8-byte header size
+                                                 - CAP    // 8-byte content size
+                                                 - WDT    // 8-byte width of image
+                                                 - HGT;   // 8-byte height of image
+
+    // CAPTION
+    uint8_t caption_temp[caption_tags_size];
+    size_t iter = 0;
+    uint8_t buffer[1];
+    read_bytes_to_buffer(file, buffer, 1);
+    while (buffer[0] != ESC) {
+        caption_temp[iter++] = buffer[0];
+        read_bytes_to_buffer(file, buffer, 1);
+        if (iter == caption_tags_size){
+            fprintf(stderr,
+                    "%sERROR%s: file caption larger than what header defines\n",
+                    ERR_SET, RESET);
+            exit(-1);
+        }
+    }
+    // escaped caption
+    size_t caption_size = iter + 1;
+    if (iter == 0){
+        printf("%sWARNING%s: file does not define the caption\n",
+                WARN_SET, RESET);
+    } else {
+        uint8_t caption[caption_size];
+        // copy data from temp caption
+        for (unsigned int i = 0; i < caption_size; ++i){
+            caption[i] = caption_temp[i];
+        }
+#if LOG
+        printf("caption: ");
+        print_ascii(caption, caption_size);
+#endif
+    }
+
+    // TAGS
+    size_t tags_size = caption_tags_size - caption_size;
+    if (tags_size == 0){
+        printf("%sWARNING%s: file does not include any tags\n",
+                WARN_SET, RESET);
+    } else {
+        uint8_t tags[tags_size];
+        read_bytes_to_buffer(file, tags, tags_size);
+        for (size_t i = 0; i < tags_size; ++i){
+            if (tags[i] == ESC){
+                fprintf(stderr,
+                        "%sERROR%s: file contains escape ASCII in tags\n",
+                        ERR_SET, RESET);
+                exit(-1);
+            }
+        }
+#if LOG
+        printf("tags: ");
+        print_tags(tags, tags_size);
+#endif
+    }
+
+    // PIXELS
+    if (pixel_size == 0){
+        printf("%sWARNING%s: file is missing the pixel data\n",
+                WARN_SET, RESET);
+    } else if (save && g_y4m_fd != -1){
+        uint8_t *pixels = acquire_pixels(pixel_size);
+        read_bytes_to_buffer(file, pixels, pixel_size);
+        y4m_frame(pixels, width_size, height_size);
+    } else if (save && g_tile_size != 0){
+        read_tiles(file, width_size, height_size);
+    } else if (save && g_pipeline != NULL){
+        Frame *frame = pipeline_acquire(g_pipeline, pixel_size);
+        read_bytes_to_buffer(file, frame->pixels, pixel_size);
+        frame->number = g_frame_number;
+        pipeline_submit(g_pipeline, frame, width_size, height_size);
+    } else if (save && g_ladder_count != 0){
+        read_ladder(file, width_size, height_size);
+    } else {
+        uint8_t *pixels = acquire_pixels(pixel_size);
+        read_bytes_to_buffer(file, pixels, pixel_size);
+        if (save){ create_image(pixels, width_size, height_size); }
+    }
+}
+
+#define DUR 8
+// the manifest of -pread when the frames are read in order
+void extract_frame(const size_t number, const size_t duration);
+
+void read_caff_animation(FILE *file, bool save){
+    // DURATION
+    size_t duration = read_bytes_to_value(file, DUR);
+# if LOG
+    printf("duration: %zu\n", duration);
+#endif
+    g_y4m_time += duration * g_y4m_fps;
+    // CIFF
+    const size_t submitted = g_pipeline != NULL ? g_pipeline->next_index : 0;
+    read_ciff(file, save);
+    // a frame without pixels is not submitted and has no file
+    if (g_pipeline != NULL && g_pipeline->next_index != submitted){ extract_frame(g_frame_number, duration); }
+}
+
+#define ID 1
+#define SZ 8
+// INDEXED CAFF
+/* -repack turns a CAFF into an indexed one and back. the
+indexed file starts with ICAF, the number of frames and a
+table with the offset of every animation block and of the
+frame its pixels are stored against. the blocks follow in
+their original order, an animation block keeps the duration
+and the CIFF header but stores its pixels after the key
+frame index and a byte that tells how:
+    deflated with zlib at its fastest level, or raw
+    as the difference to the key frame, or whole
+every KEY-th frame is a key frame, so any frame is decoded
+from at most two blocks without touching the others */
+#define KEY 16
+#define PACK_DEFLATE 1
+#define PACK_DELTA 2
+#define ENTRY 16
+#define CIFF_FIXED (MGC + CAP + CAP + WDT + HGT)
+const uint8_t magic_icaff[MGC] = {73, 67, 65, 70};
+bool g_repack;
+
+// the last key frame read or written and the packed pixels of a frame
+size_t g_key_index;
+uint8_t *g_key_pixels;
+size_t g_key_capacity;
+size_t g_key_size;
+uint8_t *g_packed;
+size_t g_packed_capacity;
+
+void write_bytes(FILE *file, const void *buffer, const size_t size){
+    if (size != 0 && fwrite(buffer, size, 1, file) != 1){
+        fprintf(stderr,
+                "%sERROR%s: output file could not be written\n",
+                ERR_SET, RESET);
+        exit(-1);
+    }
+}
+
+void write_value(FILE *file, const size_t value, const size_t quantity){
+    uint8_t bytes[quantity];
+    for (size_t i = 0; i < quantity; ++i){
+        bytes[i] = (uint8_t)((uint64_t)value >> (i * 8));
+    }
+    write_bytes(file, bytes, quantity);
+}
+
+void copy_bytes(FILE *from, FILE *to, size_t size){
+    uint8_t buffer[1 << 16];
+    while (size != 0){
+        const size_t part = size < sizeof(buffer) ? size : sizeof(buffer);
+        read_bytes_to_buffer(from, buffer, part);
+        write_bytes(to, buffer, part);
+        size -= part;
+    }
+}
+
+// the fixed part of a CIFF header, returns the whole header size
+size_t read_ciff_fixed(const uint8_t *fixed, size_t *pixel_size){
+    if (memcmp(magic_ciff, fixed, MGC) != 0){
+        fprintf(stderr,
+                "%sERROR%s: file has unknown magic in a block: %c %c %c %c\n",
+                ERR_SET, RESET,
+                (char)fixed[0], (char)fixed[1], (char)fixed[2], (char)fixed[3]);
+        exit(-1);
+    }
+    const size_t header_size = translate_bytes((uint8_t *)fixed + MGC, CAP);
+    *pixel_size = translate_bytes((uint8_t *)fixed + MGC + CAP, CAP);
+    const size_t width = translate_bytes((uint8_t *)fixed + MGC + CAP + CAP, WDT);
+    const size_t height = translate_bytes((uint8_t *)fixed + MGC + CAP + CAP + WDT, HGT);
+    if (header_size < CIFF_FIXED || (height != 0 && width > SIZE_MAX / 3 / height)
+        || *pixel_size != width * height * 3){
+        fprintf(stderr,
+                "%sERROR%s: pixel size is not equal to size defined in header\n",
+                ERR_SET, RESET);
+        exit(-1);
+    }
+    return header_size;
+}
+
+void pack_frame(FILE *output, const uint8_t *pixels, const size_t pixel_size, const bool delta){
+    // the difference goes in front of the deflated pixels
+    const size_t difference = delta ? pixel_size : 0;
+    reserve_pixels(&g_packed, &g_packed_capacity, difference + compressBound(pixel_size));
+    uint8_t *data = (uint8_t *)pixels;
+    if (delta){
+        data = g_packed;
+        for (size_t i = 0; i < pixel_size; ++i){
+            data[i] = (uint8_t)(pixels[i] - g_key_pixels[i]);
+        }
+    }
+    uint8_t *deflated = g_packed + difference;
+    uLongf deflated_size = (uLongf)(g_packed_capacity - difference);
+    uint8_t pack = delta ? PACK_DELTA : 0;
+    if (pixel_size != 0 && compress2(deflated, &deflated_size, data, pixel_size, 1) == Z_OK
+        && deflated_size < pixel_size){
+        pack |= PACK_DEFLATE;
+        data = deflated;
+    } else {
+        deflated_size = pixel_size;
+    }
+    write_value(output, pack, 1);
+    write_bytes(output, data, deflated_size);
+}
+
+// the packed pixels of a frame back into pixels, a difference needs its key frame read before
+void unpack_frame(const uint8_t pack, const uint8_t *data, const size_t size,
+                  uint8_t *pixels, const size_t pixel_size){
+    if (pack & PACK_DEFLATE){
+        uLongf inflated_size = pixel_size;
+        if (uncompress(pixels, &inflated_size, data, size) != Z_OK || inflated_size != pixel_size){
+            fprintf(stderr,
+                    "%sERROR%s: frame pixels could not be inflated\n", ERR_SET, RESET);
+            exit(-1);
+        }
+    } else if (size == pixel_size){
+        memcpy(pixels, data, size);
+    } else {
+        fprintf(stderr,
+                "%sERROR%s: pixel size is not equal to size defined in header\n",
+                ERR_SET, RESET);
+        exit(-1);
+    }
+    if (pack & PACK_DELTA){
+        if (g_key_size != pixel_size){
+            fprintf(stderr,
+                    "%sERROR%s: frame is a difference to a key frame of another size\n",
+                    ERR_SET, RESET);
+            exit(-1);
+        }
+        for (size_t i = 0; i < pixel_size; ++i){
+            pixels[i] = (uint8_t)(pixels[i] + g_key_pixels[i]);
+        }
+    }
+}
+
+void repack_name(char *file_name, const size_t capacity, const char *extension){
+    const int stem = (int)(strlen(g_file_name) - strlen(formats[g_format]) - 1);
+    snprintf(file_name, capacity, "%.*s.%s", stem, g_file_name, extension);
+}
+
+/* the direction is taken from the magic and the name from the
+input, so an indexed CAFF named .caff would be written over itself */
+FILE *open_repack_output(FILE *input, const char *file_name){
+    char part[strlen(file_name) + sizeof(PART)];
+    snprintf(part, sizeof(part), "%s%s", file_name, g_output_root != NULL ? PART : "");
+    struct stat from, to;
+    const int fd = fileno(input);
+    if (fd != -1 && fstat(fd, &from) == 0 && stat(part, &to) == 0
+        && from.st_dev == to.st_dev && from.st_ino == to.st_ino){
+        fprintf(stderr,
+                "%sERROR%s: repacking would overwrite the input \"%s\"\n",
+                ERR_SET, RESET, part);
+        exit(-1);
+    }
+    FILE *output = fopen(part, "wb");
+    if (output == NULL){
+        fprintf(stderr,
+                "%sERROR%s: could not open output file for writing\n",
+                ERR_SET, RESET);
+        exit(-1);
+    }
+    return output;
+}
+
+void close_repack_output(FILE *output, const char *file_name){
+    if (fclose(output) != 0){
+        fprintf(stderr,
+                "%sERROR%s: output file could not be written\n",
+                ERR_SET, RESET);
+        exit(-1);
+    }
+    if (g_output_root != NULL){ rename_later(file_name); }
+#if LOG
+    printf("successfully saved to \"%s\"\n", file_name);
+#endif
+}
+
+// the header block id is read already
+void pack_caff(FILE *file){
+    uint8_t header[SZ + MGC + CAP + ANM];
+    read_bytes_to_buffer(file, header, sizeof(header));
+    if (translate_bytes(header, SZ) != MGC + CAP + ANM
+        || memcmp(header + SZ, magic_caff, MGC) != 0){
+        fprintf(stderr,
+                "%sERROR%s: file does not start with a header\n",
+                ERR_SET, RESET);
+        exit(-1);
+    }
+    const size_t frame_count = translate_bytes(header + SZ + MGC + CAP, ANM);
+    const size_t capacity = strlen(g_file_name) + 8;
+    char file_name[capacity];
+    repack_name(file_name, capacity, "icaff");
+    FILE *output = open_repack_output(file, file_name);
+
+    uint8_t *table = calloc(frame_count != 0 ? frame_count : 1, ENTRY);
+    if (table == NULL){
+        fprintf(stderr, "%sERROR%s: could not allocate the frame table\n", ERR_SET, RESET);
+        exit(-1);
+    }
+    write_bytes(output, magic_icaff, MGC);
+    write_value(output, frame_count, ANM);
+    write_bytes(output, table, frame_count * ENTRY);
+    write_value(output, 1, ID);
+    write_bytes(output, header, sizeof(header));
+
+    size_t frame = 0, key_width = 0, key_height = 0;
+    for (size_t i = 0; i < frame_count + 1; ++i){
+        const size_t block_id = read_bytes_to_value(file, ID);
+        const size_t block_size = read_bytes_to_value(file, SZ);
+        if (block_id == 2){
+            write_value(output, block_id, ID);
+            write_value(output, block_size, SZ);
+            copy_bytes(file, output, block_size);
+            continue;
+        }
+        if (block_id != 3 || frame == frame_count){
+            fprintf(stderr,
+                    "%sERROR%s: file has unknown id in a block: %zu\n",
+                    ERR_SET, RESET, block_id);
+            exit(-1);
+        }
+        uint8_t fixed[DUR + CIFF_FIXED];
+        read_bytes_to_buffer(file, fixed, sizeof(fixed));
+        size_t pixel_size;
+        const size_t header_size = read_ciff_fixed(fixed + DUR, &pixel_size);
+        // subtracted, a crafted header size would wrap a sum around
+        if (block_size < DUR || header_size > block_size - DUR
+            || pixel_size != block_size - DUR - header_size){
+            fprintf(stderr,
+                    "%sERROR%s: animation block size does not match its CIFF\n",
+                    ERR_SET, RESET);
+            exit(-1);
+        }
+        const size_t rest = header_size - CIFF_FIXED + pixel_size;
+        uint8_t *block = acquire_pixels(rest != 0 ? rest : 1);
+        if (rest != 0){ read_bytes_to_buffer(file, block, rest); }
+        const uint8_t *pixels = block + header_size - CIFF_FIXED;
+        const size_t width = translate_bytes(fixed + DUR + MGC + CAP + CAP, WDT);
+        const size_t height = translate_bytes(fixed + DUR + MGC + CAP + CAP + WDT, HGT);
+
+        // a frame of another size can not be a difference
+        const bool delta = frame % KEY != 0 && width == key_width && height == key_height;
+        if (!delta){
+            g_key_index = frame;
+            key_width = width;
+            key_height = height;
+        }
+        const long start = ftell(output);
+        write_value(output, block_id, ID);
+        write_value(output, 0, SZ);
+        write_bytes(output, fixed, sizeof(fixed));
+        write_bytes(output, block, header_size - CIFF_FIXED);
+        write_value(output, g_key_index, CAP);
+        pack_frame(output, pixels, pixel_size, delta);
+        if (!delta){
+            memcpy(reserve_pixels(&g_key_pixels, &g_key_capacity, pixel_size), pixels, pixel_size);
+            g_key_size = pixel_size;
+        }
+        // the size of the block is known now
+        const long end = ftell(output);
+        if (start < 0 || end < 0 || fseek(output, start + ID, SEEK_SET) != 0){
+            fprintf(stderr, "%sERROR%s: output file could not be written\n", ERR_SET, RESET);
+            exit(-1);
+        }
+        write_value(output, (size_t)(end - start) - ID - SZ, SZ);
+        if (fseek(output, end, SEEK_SET) != 0){
+            fprintf(stderr, "%sERROR%s: output file could not be written\n", ERR_SET, RESET);
+            exit(-1);
+        }
+        for (size_t b = 0; b < CAP; ++b){
+            table[frame * ENTRY + b] = (uint8_t)((uint64_t)start >> (b * 8));
+            table[frame * ENTRY + CAP + b] = (uint8_t)((uint64_t)g_key_index >> (b * 8));
+        }
+        ++frame;
+    }
+    if (frame != frame_count){
+        fprintf(stderr,
+                "%sERROR%s: file has %zu animations instead of %zu\n",
+                ERR_SET, RESET, frame, frame_count);
+        exit(-1);
+    }
+    if (fseek(output, MGC + ANM, SEEK_SET) != 0){
+        fprintf(stderr, "%sERROR%s: output file could not be written\n", ERR_SET, RESET);
+        exit(-1);
+    }
+    write_bytes(output, table, frame_count * ENTRY);
+    free(table);
+    close_repack_output(output, file_name);
+}
+
+/* an animation block of an indexed CAFF after its id and size,
+the CIFF is rebuilt in a buffer: its header and the pixels */
+uint8_t *g_frame_ciff;
+size_t g_frame_ciff_capacity;
+size_t read_indexed_animation(FILE *file, const size_t block_size, const size_t index, size_t *duration){
+    uint8_t fixed[DUR + CIFF_FIXED];
+    if (block_size < sizeof(fixed) + CAP + 1){
+        fprintf(stderr,
+                "%sERROR%s: animation block size does not match its CIFF\n",
+                ERR_SET, RESET);
+        exit(-1);
+    }
+    read_bytes_to_buffer(file, fixed, sizeof(fixed));
+    *duration = translate_bytes(fixed, DUR);
+    size_t pixel_size;
+    const size_t header_size = read_ciff_fixed(fixed + DUR, &pixel_size);
+    // subtracted, a crafted header size would wrap a sum around
+    if (header_size > block_size - DUR - CAP - 1 || pixel_size > SIZE_MAX - header_size){
+        fprintf(stderr,
+                "%sERROR%s: animation block size does not match its CIFF\n",
+                ERR_SET, RESET);
+        exit(-1);
+    }
+    uint8_t *ciff = reserve_pixels(&g_frame_ciff, &g_frame_ciff_capacity, header_size + pixel_size);
+    memcpy(ciff, fixed + DUR, CIFF_FIXED);
+    read_bytes_to_buffer(file, ciff + CIFF_FIXED, header_size - CIFF_FIXED);
+    const size_t key = read_bytes_to_value(file, CAP);
+    const uint8_t pack = (uint8_t)read_bytes_to_value(file, 1);
+    if ((pack & PACK_DELTA) ? key != g_key_index || key >= index : key != index){
+        fprintf(stderr,
+                "%sERROR%s: frame %zu is not stored against the key frame before it\n",
+                ERR_SET, RESET, index);
+        exit(-1);
+    }
+    const size_t packed_size = block_size - DUR - header_size - CAP - 1;
+    uint8_t *packed = reserve_pixels(&g_packed, &g_packed_capacity, packed_size != 0 ? packed_size : 1);
+    if (packed_size != 0){ read_bytes_to_buffer(file, packed, packed_size); }
+    unpack_frame(pack, packed, packed_size, ciff + header_size, pixel_size);
+    if (!(pack & PACK_DELTA)){
+        memcpy(reserve_pixels(&g_key_pixels, &g_key_capacity, pixel_size), ciff + header_size, pixel_size);
+        g_key_index = index;
+        g_key_size = pixel_size;
+    }
+    return header_size + pixel_size;
+}
+
+// the header block id is read already
+void unpack_caff(FILE *file){
+    uint8_t magic[MGC - ID];
+    read_bytes_to_buffer(file, magic, MGC - ID);
+    if (memcmp(magic, magic_icaff + ID, MGC - ID) != 0){
+        fprintf(stderr,
+                "%sERROR%s: file does not start with a header\n",
+                ERR_SET, RESET);
+        exit(-1);
+    }
+    const size_t frame_count = read_bytes_to_value(file, ANM);
+    // the blocks are in order, the table is for random access only
+    for (size_t i = 0; i < frame_count; ++i){
+        read_bytes_to_value(file, CAP);
+        read_bytes_to_value(file, CAP);
+    }
+    const size_t capacity = strlen(g_file_name) + 8;
+    char file_name[capacity];
+    repack_name(file_name, capacity, "caff");
+    FILE *output = open_repack_output(file, file_name);
+    if (read_bytes_to_value(file, ID) != 1){
+        fprintf(stderr,
+                "%sERROR%s: file does not start with a header\n",
+                ERR_SET, RESET);
+        exit(-1);
+    }
+    write_value(output, 1, ID);
+    copy_bytes(file, output, SZ + MGC + CAP + ANM);
+
+    size_t frame = 0;
+    for (size_t i = 0; i < frame_count + 1; ++i){
+        const size_t block_id = read_bytes_to_value(file, ID);
+        const size_t block_size = read_bytes_to_value(file, SZ);
+        write_value(output, block_id, ID);
+        if (block_id == 2){
+            write_value(output, block_size, SZ);
+            copy_bytes(file, output, block_size);
+            continue;
+        }
+        if (block_id != 3 || frame == frame_count){
+            fprintf(stderr,
+                    "%sERROR%s: file has unknown id in a block: %zu\n",
+                    ERR_SET, RESET, block_id);
+            exit(-1);
+        }
+        size_t duration;
+        const size_t ciff_size = read_indexed_animation(file, block_size, frame, &duration);
+        write_value(output, DUR + ciff_size, SZ);
+        write_value(output, duration, DUR);
+        write_bytes(output, g_frame_ciff, ciff_size);
+        ++frame;
+    }
+    close_repack_output(output, file_name);
+}
+
+// forward to an offset of the file, by reading when it can not seek
+void skip_to(FILE *file, size_t *position, const size_t offset){
+    if (offset < *position){
+        fprintf(stderr,
+                "%sERROR%s: frame table points before the blocks\n",
+                ERR_SET, RESET);
+        exit(-1);
+    }
+    if (offset - *position > LONG_MAX
+        || fseek(file, (long)(offset - *position), SEEK_CUR) != 0){
+        uint8_t buffer[1 << 16];
+        for (size_t left = offset - *position; left != 0;){
+            const size_t part = left < sizeof(buffer) ? left : sizeof(buffer);
+            read_bytes_to_buffer(file, buffer, part);
+            left -= part;
+        }
+    }
+    *position = offset;
+}
+
+void read_indexed_frame(FILE *file, size_t *position, const uint8_t *table,
+                        const size_t index, const bool save){
+    skip_to(file, position, translate_bytes((uint8_t *)table + index * ENTRY, CAP));
+    const size_t block_id = read_bytes_to_value(file, ID);
+    const size_t block_size = read_bytes_to_value(file, SZ);
+    if (block_id != 3){
+        fprintf(stderr,
+                "%sERROR%s: frame table does not point to an animation: %zu\n",
+                ERR_SET, RESET, block_id);
+        exit(-1);
+    }
+    size_t duration;
+    const size_t ciff_size = read_indexed_animation(file, block_size, index, &duration);
+    *position += ID + SZ + block_size;
+    if (!save){ return; }
+#if LOG
+    printf("frame: %zu\nduration: %zu\n", index, duration);
+#endif
+    g_frame_number = index;
+    g_y4m_time += duration * g_y4m_fps;
+    FILE *ciff = fmemopen(g_frame_ciff, ciff_size, "rb");
+    if (ciff == NULL){
+        fprintf(stderr, "%sERROR%s: could not open frame %zu: %s\n",
+                ERR_SET, RESET, index, strerror(errno));
+        exit(-1);
+    }
+    const size_t submitted = g_pipeline != NULL ? g_pipeline->next_index : 0;
+    read_ciff(ciff, true);
+    fclose(ciff);
+    if (g_pipeline != NULL && g_pipeline->next_index != submitted){ extract_frame(g_frame_number, duration); }
+#if LOG
+    printf("\n");
+#endif
+}
+
+/* the header block id is read already. only the requested
+frame and its key frame are read, or every frame with -all or -y4m */
+void read_indexed_caff(FILE *file){
+    uint8_t magic[MGC - ID];
+    read_bytes_to_buffer(file, magic, MGC - ID);
+    if (memcmp(magic, magic_icaff + ID, MGC - ID) != 0){
+        fprintf(stderr,
+                "%sERROR%s: file does not start with a header\n",
+                ERR_SET, RESET);
+        exit(-1);
+    }
+    const size_t frame_count = read_bytes_to_value(file, ANM);
+    if (frame_count > SIZE_MAX / ENTRY){
+        fprintf(stderr, "%sERROR%s: frame table is too large\n", ERR_SET, RESET);
+        exit(-1);
+    }
+    uint8_t *table = malloc(frame_count != 0 ? frame_count * ENTRY : 1);
+    if (table == NULL){
+        fprintf(stderr, "%sERROR%s: could not allocate the frame table\n", ERR_SET, RESET);
+        exit(-1);
+    }
+    if (frame_count != 0){ read_bytes_to_buffer(file, table, frame_count * ENTRY); }
+    if (read_bytes_to_value(file, ID) != 1 || read_bytes_to_value(file, SZ) != MGC + CAP + ANM
+        || read_caff_header(file) != frame_count){
+        fprintf(stderr,
+                "%sERROR%s: file does not start with a header\n",
+                ERR_SET, RESET);
+        exit(-1);
+    }
+#if LOG
+    printf("\n");
+#endif
+    size_t position = MGC + ANM + frame_count * ENTRY + ID + SZ + MGC + CAP + ANM;
+    // a stream takes every frame in order, like -all
+    const bool every = g_all || g_y4m_fd != -1;
+    if (!every && g_frame >= frame_count){
+        fprintf(stderr, "%sERROR%s: file has no frame %zu\n", ERR_SET, RESET, g_frame);
+        exit(-1);
+    }
+
+    g_key_index = SIZE_MAX;
+    Pipeline pipeline;
+    if (g_all){ pipeline_start(&pipeline, false); }
+    const size_t first = every ? 0 : g_frame;
+    const size_t last = every ? frame_count : g_frame + 1;
+    for (size_t i = first; i < last; ++i){
+        const size_t key = translate_bytes(table + i * ENTRY + CAP, CAP);
+        if (key != i && key != g_key_index){
+            if (key > i){
+                fprintf(stderr,
+                        "%sERROR%s: frame %zu is not stored against the key frame before it\n",
+                        ERR_SET, RESET, i);
+                exit(-1);
+            }
+            read_indexed_frame(file, &position, table, key, false);
+        }
+        read_indexed_frame(file, &position, table, i, true);
+    }
+    if (g_all){ pipeline_finish(&pipeline); }
+    free(table);
+}
+
+// CAFF to indexed CAFF and back, by the first byte
+void repack_caff(FILE *file){
+    const size_t header_id = read_bytes_to_value(file, ID);
+    g_key_index = SIZE_MAX;
+    if (header_id == 1){
+        pack_caff(file);
+    } else if (header_id == magic_icaff[0]){
+        unpack_caff(file);
+    } else {
+        fprintf(stderr,
+                "%sERROR%s: file does not start with a header\n",
+                ERR_SET, RESET);
+        exit(-1);
+    }
+}
+
+/* returns false when the file was not read to its end,
+an indexed CAFF is only read where the table points */
+bool read_caff(FILE *file){
+    // HEADER
+    size_t header_id = read_bytes_to_value(file, ID);
+    if (header_id == magic_icaff[0]){
+        read_indexed_caff(file);
+        return false;
+    }
+    if (header_id != 1){
+        fprintf(stderr,
+                "%sERROR%s: file does not start with a header\n",
+                ERR_SET, RESET);
+        exit(-1);
+    }
+    assert(header_id == 1);
+
+    /* cap is no needed for hdr
+    because all chunks lengths
+    are predefined in the format */
+    const size_t header_size = read_bytes_to_value(file, SZ);
+    assert(header_size == 20);
+
+    /* the only valuable information
+    in the header block is the
+    number of animations in the CAFF */
+    const size_t number_of_animations = read_caff_header(file);
+#if LOG
+    printf("\n");
+#endif
+
+    // ANIMATION + CREDITS blocks
+    /* read all blocks from file
+    + 1 for the credits block */
+    size_t frame = 0;
+    Pipeline pipeline;
+    if (g_all){ pipeline_start(&pipeline, false); }
+    for (size_t i = 0; i < number_of_animations + 1; ++i){
+        size_t block_id = read_bytes_to_value(file, ID);
         size_t block_size = read_bytes_to_value(file, SZ);
         if (block_id == 2){
             // CREDITS
-            read_caff_credits(file);
+            read_caff_credits(file);
+#if LOG
+            printf("\n");
+#endif
+        } else if (block_id == 3){
+            // ANIMATION
+            g_frame_number = frame;
+            read_caff_animation(file, g_all || g_y4m_fd != -1 || frame == g_frame);
+            ++frame;
+#if LOG
+            printf("\n");
+#endif
+        } else {
+            fprintf(stderr,
+                    "%sERROR%s: file has unknown id in a block: %zu\n",
+                    ERR_SET, RESET, block_id);
+            exit(-1);
+        }
+    }
+    if (g_all){ pipeline_finish(&pipeline); }
+    if (!g_all && g_frame >= frame){
+        fprintf(stderr, "%sERROR%s: file has no frame %zu\n", ERR_SET, RESET, g_frame);
+        exit(-1);
+    }
+    return true;
+}
+
+// PUSH PARSER
+/* the readers above pull exact byte counts from a FILE and block
+until they arrive. the push parser is the same grammar as a state
+machine that is fed chunks of any size, as they come from a pipe,
+a socket or an event loop, and reports what it parsed as events.
+fixed fields are gathered in a small buffer, caption, tags and
+creator in a growing one, and a pixel row is passed straight out
+of the chunk when it is whole in it, so at most one row is held.
+a handler returns false to pause: push_feed then returns what it
+consumed, and the rest of the chunk is fed again when the caller
+is ready for more */
+#define BLOCK (ID + SZ)
+#define HEADER_BLOCK (MGC + CAP + ANM)
+// longest caption, tags or creator kept for an event
+#define TEXT ((size_t)1 << 20)
+bool g_stream;
+
+typedef enum {
+    PUSH_HEADER,    // CAFF header, animations is set
+    PUSH_CREDITS,   // data is the date, text the creator
+    PUSH_FRAME,     // CIFF header, width and height are set, and duration in a CAFF
+    PUSH_CAPTION,   // text
+    PUSH_TAGS,      // text
+    PUSH_ROW,       // data is a row of pixels, width * 3 bytes
+    PUSH_FRAME_END,
+    PUSH_END        // the whole file was parsed
+} PushEvent;
+
+typedef enum {
+    STATE_HEADER_BLOCK,     // id and size of the first block
+    STATE_HEADER,
+    STATE_BLOCK,
+    STATE_DATE,
+    STATE_CREATOR_SIZE,
+    STATE_CREATOR,
+    STATE_DURATION,
+    STATE_CIFF,             // the fixed part of a CIFF header
+    STATE_CAPTION,
+    STATE_TAGS,
+    STATE_PIXELS,
+    STATE_DONE
+} PushState;
+
+typedef struct Push Push;
+typedef bool (*PushHandler)(Push *push, PushEvent event, const uint8_t *data, size_t size);
+
+struct Push {
+    bool caff;
+    PushState state;
+    PushHandler handler;
+    void *context;
+    // a fixed field that arrives in pieces
+    uint8_t field[CIFF_FIXED];
+    size_t field_size;
+    size_t field_count;
+    // caption, tags or creator
+    uint8_t *text;
+    size_t text_size;
+    size_t text_capacity;
+    size_t text_left;
+    // a row that arrives in pieces
+    uint8_t *row;
+    size_t row_capacity;
+    size_t row_count;
+    // CAFF
+    size_t animations;
+    size_t blocks_left;
+    size_t frame;           // index of the current animation
+    size_t duration;
+    uint8_t date[DTE];
+    // CIFF
+    size_t width;
+    size_t height;
+    size_t rows;            // rows passed on
+    size_t header_left;     // bytes of caption and tags
+};
+
+void push_expect(Push *push, const PushState state, const size_t field_size){
+    push->state = state;
+    push->field_size = field_size;
+    push->field_count = 0;
+}
+
+void push_init(Push *push, const bool caff, PushHandler handler, void *context){
+    memset(push, 0, sizeof(*push));
+    push->caff = caff;
+    push->handler = handler;
+    push->context = context;
+    if (caff){
+        push_expect(push, STATE_HEADER_BLOCK, BLOCK);
+    } else {
+        push_expect(push, STATE_CIFF, CIFF_FIXED);
+    }
+}
+
+void push_free(Push *push){
+    pool_free(push->text);
+    pool_free(push->row);
+}
+
+void push_text(Push *push, const uint8_t *data, const size_t size){
+    if (size == 0){ return; }
+    if (size > TEXT - push->text_size){
+        fprintf(stderr,
+                "%sERROR%s: file has a caption, tags or creator longer than %zu bytes\n",
+                ERR_SET, RESET, TEXT);
+        exit(-1);
+    }
+    reserve_pixels(&push->text, &push->text_capacity, push->text_size + size);
+    memcpy(push->text + push->text_size, data, size);
+    push->text_size += size;
+}
+
+// the next animation block or the end of the file
+void push_next_block(Push *push){
+    if (push->blocks_left-- == 0){
+        push->state = STATE_DONE;
+    } else {
+        push_expect(push, STATE_BLOCK, BLOCK);
+    }
+}
+
+// a frame is complete
+bool push_frame_end(Push *push){
+    if (push->caff){
+        ++push->frame;
+        push_next_block(push);
+    } else {
+        push->state = STATE_DONE;
+    }
+    const bool more = push->handler(push, PUSH_FRAME_END, NULL, 0);
+    if (push->state == STATE_DONE){
+        return push->handler(push, PUSH_END, NULL, 0) && more;
+    }
+    return more;
+}
+
+bool push_pixels(Push *push){
+    if (push->width * push->height == 0){
+        printf("%sWARNING%s: file is missing the pixel data\n",
+                WARN_SET, RESET);
+        return push_frame_end(push);
+    }
+    push->state = STATE_PIXELS;
+    push->rows = 0;
+    push->row_count = 0;
+    reserve_pixels(&push->row, &push->row_capacity, push->width * 3);
+    return true;
+}
+
+bool push_tags(Push *push){
+    if (push->text_size == 0){
+        printf("%sWARNING%s: file does not include any tags\n",
+                WARN_SET, RESET);
+    }
+    for (size_t i = 0; i < push->text_size; ++i){
+        if (push->text[i] == ESC){
+            fprintf(stderr,
+                    "%sERROR%s: file contains escape ASCII in tags\n",
+                    ERR_SET, RESET);
+            exit(-1);
+        }
+    }
+    const bool more = push->handler(push, PUSH_TAGS, push->text, push->text_size);
+    return push_pixels(push) && more;
+}
+
+// a fixed field is complete
+bool push_field(Push *push){
+    const uint8_t *field = push->field;
+    size_t pixel_size;
+    switch (push->state){
+        case STATE_HEADER_BLOCK:
+            if (field[0] == magic_icaff[0]){
+                fprintf(stderr,
+                        "%sERROR%s: an indexed CAFF can not be streamed, it is read by seeking\n",
+                        ERR_SET, RESET);
+                exit(-1);
+            }
+            if (field[0] != 1){
+                fprintf(stderr,
+                        "%sERROR%s: file does not start with a header\n",
+                        ERR_SET, RESET);
+                exit(-1);
+            }
+            push_expect(push, STATE_HEADER, HEADER_BLOCK);
+            return true;
+        case STATE_HEADER:
+            if (memcmp(magic_caff, field, MGC) != 0){
+                fprintf(stderr,
+                        "%sERROR%s: file has unknown magic in a block: %c %c %c %c\n",
+                        ERR_SET, RESET,
+                        (char)field[0], (char)field[1], (char)field[2], (char)field[3]);
+                exit(-1);
+            }
+            if (translate_bytes((uint8_t *)field + MGC, CAP) != HEADER_BLOCK){
+                fprintf(stderr,
+                        "%sERROR%s: file has a header of unknown size\n",
+                        ERR_SET, RESET);
+                exit(-1);
+            }
+            push->animations = translate_bytes((uint8_t *)field + MGC + CAP, ANM);
+            // and the credits block
+            push->blocks_left = push->animations + 1;
+            push_next_block(push);
+            {
+                const bool more = push->handler(push, PUSH_HEADER, NULL, 0);
+                if (push->state == STATE_DONE){
+                    return push->handler(push, PUSH_END, NULL, 0) && more;
+                }
+                return more;
+            }
+        case STATE_BLOCK:
+            if (field[0] == 2){
+                push_expect(push, STATE_DATE, DTE);
+            } else if (field[0] == 3){
+                push_expect(push, STATE_DURATION, DUR);
+            } else {
+                fprintf(stderr,
+                        "%sERROR%s: file has unknown id in a block: %u\n",
+                        ERR_SET, RESET, field[0]);
+                exit(-1);
+            }
+            return true;
+        case STATE_DATE:
+            memcpy(push->date, field, DTE);
+            push_expect(push, STATE_CREATOR_SIZE, CAP);
+            return true;
+        case STATE_CREATOR_SIZE:
+            push->text_size = 0;
+            push->text_left = translate_bytes((uint8_t *)field, CAP);
+            if (push->text_left == 0){
+                printf("%sWARNING%s: file does not define the creator\n",
+                        WARN_SET, RESET);
+                push_next_block(push);
+                return push->handler(push, PUSH_CREDITS, push->date, DTE);
+            }
+            push->state = STATE_CREATOR;
+            return true;
+        case STATE_DURATION:
+            push->duration = translate_bytes((uint8_t *)field, DUR);
+            push_expect(push, STATE_CIFF, CIFF_FIXED);
+            return true;
+        case STATE_CIFF:
+            push->header_left = read_ciff_fixed(field, &pixel_size) - CIFF_FIXED;
+            push->width = translate_bytes((uint8_t *)field + MGC + CAP + CAP, WDT);
+            push->height = translate_bytes((uint8_t *)field + MGC + CAP + CAP + WDT, HGT);
+            push->text_size = 0;
+            push->state = STATE_CAPTION;
+            return push->handler(push, PUSH_FRAME, NULL, 0);
+        default:
+            assert(0 && "unreachable");
+            return true;
+    }
+}
+
+/* parses a chunk of the file and returns the number of bytes
+consumed, less than size only when a handler asked to pause */
+size_t push_feed(Push *push, const uint8_t *data, const size_t size){
+    size_t used = 0;
+    bool more = true;
+    while (used < size && more){
+        switch (push->state){
+            case STATE_CREATOR: {
+                const size_t left = size - used;
+                const size_t part = push->text_left < left ? push->text_left : left;
+                push_text(push, data + used, part);
+                used += part;
+                push->text_left -= part;
+                if (push->text_left == 0){
+                    push_next_block(push);
+                    more = push->handler(push, PUSH_CREDITS, push->date, DTE);
+                    if (push->state == STATE_DONE){
+                        more = push->handler(push, PUSH_END, NULL, 0) && more;
+                    }
+                }
+                break;
+            }
+            case STATE_CAPTION: {
+                // ends at the first new line, which has to fit in the header
+                const size_t left = size - used;
+                const size_t part = push->header_left < left ? push->header_left : left;
+                const uint8_t *end = memchr(data + used, ESC, part);
+                const size_t length = end != NULL ? (size_t)(end - (data + used)) : part;
+                push_text(push, data + used, length);
+                used += length;
+                push->header_left -= length;
+                if (end == NULL){
+                    if (push->header_left == 0){
+                        fprintf(stderr,
+                                "%sERROR%s: file caption larger than what header defines\n",
+                                ERR_SET, RESET);
+                        exit(-1);
+                    }
+                    break;
+                }
+                ++used;
+                --push->header_left;
+                if (push->text_size == 0){
+                    printf("%sWARNING%s: file does not define the caption\n",
+                            WARN_SET, RESET);
+                }
+                more = push->handler(push, PUSH_CAPTION, push->text, push->text_size);
+                push->text_size = 0;
+                if (push->header_left == 0){
+                    more = push_tags(push) && more;
+                } else {
+                    push->state = STATE_TAGS;
+                }
+                break;
+            }
+            case STATE_TAGS: {
+                const size_t left = size - used;
+                const size_t part = push->header_left < left ? push->header_left : left;
+                push_text(push, data + used, part);
+                used += part;
+                push->header_left -= part;
+                if (push->header_left == 0){ more = push_tags(push); }
+                break;
+            }
+            case STATE_PIXELS: {
+                const size_t row_size = push->width * 3;
+                const uint8_t *row;
+                if (push->row_count == 0 && size - used >= row_size){
+                    // whole in the chunk, no copy
+                    row = data + used;
+                    used += row_size;
+                } else {
+                    const size_t left = size - used;
+                    const size_t missing = row_size - push->row_count;
+                    const size_t part = missing < left ? missing : left;
+                    memcpy(push->row + push->row_count, data + used, part);
+                    used += part;
+                    push->row_count += part;
+                    if (push->row_count < row_size){ break; }
+                    push->row_count = 0;
+                    row = push->row;
+                }
+                more = push->handler(push, PUSH_ROW, row, row_size);
+                if (++push->rows == push->height){
+                    more = push_frame_end(push) && more;
+                }
+                break;
+            }
+            case STATE_DONE:
+                fprintf(stderr, "%sERROR%s: file contains additional coded information\n",
+                        ERR_SET, RESET);
+                exit(-1);
+            default: {
+                const size_t left = size - used;
+                const size_t missing = push->field_size - push->field_count;
+                const size_t part = missing < left ? missing : left;
+                memcpy(push->field + push->field_count, data + used, part);
+                used += part;
+                push->field_count += part;
+                if (push->field_count == push->field_size){ more = push_field(push); }
+                break;
+            }
+        }
+    }
+    return used;
+}
+
+// the input ended, it has to end with the file
+void push_finish(Push *push){
+    if (push->state != STATE_DONE){
+        fprintf(stderr, "%sERROR%s: file ends before it is complete\n",
+                ERR_SET, RESET);
+        exit(-1);
+    }
+}
+
+// VALIDATE
+/* with -validate a file is checked before any of its pixels is
+read: the block chain of a CAFF is walked by the block sizes, only
+the ids and the fixed headers are read and everything else is
+seeked over, so a broken block or a short file is rejected after a
+few reads instead of after the pixels of every frame before it.
+the readers still check everything as they go */
+bool g_validate;
+
+void validate_read(FILE *file, const size_t offset, uint8_t *buffer, const size_t size){
+    if (fseeko(file, (off_t)offset, SEEK_SET) != 0){
+        fprintf(stderr, "%sERROR%s: could not seek in file: %s\n",
+                ERR_SET, RESET, strerror(errno));
+        exit(-1);
+    }
+    read_bytes_to_buffer(file, buffer, size);
+}
+
+// the size of the CIFF at the offset, which has to fit in size bytes
+size_t validate_ciff(FILE *file, const size_t offset, const size_t size){
+    if (size < CIFF_FIXED){
+        fprintf(stderr, "%sERROR%s: CIFF at byte %zu is cut off in its header\n",
+                ERR_SET, RESET, offset);
+        exit(-1);
+    }
+    uint8_t fixed[CIFF_FIXED];
+    validate_read(file, offset, fixed, CIFF_FIXED);
+    size_t pixel_size;
+    const size_t header_size = read_ciff_fixed(fixed, &pixel_size);
+    if (header_size > size || pixel_size > size - header_size){
+        fprintf(stderr, "%sERROR%s: CIFF at byte %zu holds %zu bytes of pixels, %zu are left for them\n",
+                ERR_SET, RESET, offset, pixel_size, header_size > size ? 0 : size - header_size);
+        exit(-1);
+    }
+    return header_size + pixel_size;
+}
+
+/* the walk is shared with -pread, which is told the offset
+and the size of every animation block */
+void validate_caff(FILE *file, const size_t file_size,
+                   void (*animation)(const size_t offset, const size_t size)){
+    uint8_t header[BLOCK + HEADER_BLOCK];
+    if (file_size == 0){ return; }
+    validate_read(file, 0, header, 1);
+    // the table of an indexed CAFF is checked as it is read
+    if (header[0] == magic_icaff[0]){ return; }
+    if (header[0] != 1 || file_size < sizeof(header)){
+        fprintf(stderr,
+                "%sERROR%s: file does not start with a header\n",
+                ERR_SET, RESET);
+        exit(-1);
+    }
+    validate_read(file, 0, header, sizeof(header));
+    if (translate_bytes(header + ID, SZ) != HEADER_BLOCK
+        || memcmp(magic_caff, header + BLOCK, MGC) != 0
+        || translate_bytes(header + BLOCK + MGC, CAP) != HEADER_BLOCK){
+        fprintf(stderr,
+                "%sERROR%s: file has a malformed header block\n",
+                ERR_SET, RESET);
+        exit(-1);
+    }
+    const size_t animations = translate_bytes(header + BLOCK + MGC + CAP, ANM);
+
+    size_t offset = sizeof(header), frames = 0, credits = 0;
+    for (size_t index = 1; offset < file_size; ++index){
+        uint8_t block[BLOCK + DTE + CAP];
+        if (file_size - offset < BLOCK){
+            fprintf(stderr, "%sERROR%s: file ends in the id and size of block %zu\n",
+                    ERR_SET, RESET, index);
+            exit(-1);
+        }
+        validate_read(file, offset, block, BLOCK);
+        const size_t block_size = translate_bytes(block + ID, SZ);
+        offset += BLOCK;
+        if (block_size > file_size - offset){
+            fprintf(stderr, "%sERROR%s: block %zu has %zu bytes, the file ends after %zu\n",
+                    ERR_SET, RESET, index, block_size, file_size - offset);
+            exit(-1);
+        }
+        if (block[0] == 2){
+            // CREDITS
+            if (block_size < DTE + CAP){
+                fprintf(stderr, "%sERROR%s: credits block %zu is too short\n",
+                        ERR_SET, RESET, index);
+                exit(-1);
+            }
+            validate_read(file, offset, block + BLOCK, DTE + CAP);
+            const size_t creator_size = translate_bytes(block + BLOCK + DTE, CAP);
+            if (creator_size != block_size - DTE - CAP){
+                fprintf(stderr, "%sERROR%s: credits block %zu has a creator of %zu bytes in %zu\n",
+                        ERR_SET, RESET, index, creator_size, block_size - DTE - CAP);
+                exit(-1);
+            }
+            ++credits;
+        } else if (block[0] == 3){
+            // ANIMATION
+            if (block_size < DUR
+                || validate_ciff(file, offset + DUR, block_size - DUR) != block_size - DUR){
+                fprintf(stderr, "%sERROR%s: animation block %zu is not the size of its CIFF\n",
+                        ERR_SET, RESET, index);
+                exit(-1);
+            }
+            if (animation != NULL){ animation(offset, block_size); }
+            ++frames;
+        } else {
+            fprintf(stderr,
+                    "%sERROR%s: file has unknown id in a block: %u\n",
+                    ERR_SET, RESET, block[0]);
+            exit(-1);
+        }
+        offset += block_size;
+    }
+    if (frames != animations || credits != 1){
+        fprintf(stderr,
+                "%sERROR%s: file has %zu animation and %zu credits blocks for %zu animations\n",
+                ERR_SET, RESET, frames, credits, animations);
+        exit(-1);
+    }
+    if (!g_all && !g_repack && g_frame >= frames){
+        fprintf(stderr, "%sERROR%s: file has no frame %zu\n", ERR_SET, RESET, g_frame);
+        exit(-1);
+    }
+}
+
+/* only a file that can seek is validated, a stream is
+left to the readers, then it is read from the start */
+void validate_input(FILE *file, const bool caff){
+    const int fd = fileno(file);
+    struct stat status;
+    off_t file_size;
+    if ((fd != -1 && (fstat(fd, &status) != 0 || !S_ISREG(status.st_mode)))
+        || fseeko(file, 0, SEEK_END) != 0 || (file_size = ftello(file)) < 0){
+        printf("%sWARNING%s: file can not seek, it is validated while it is read\n",
+                WARN_SET, RESET);
+        return;
+    }
+    if (caff){
+        validate_caff(file, (size_t)file_size, NULL);
+    } else if (validate_ciff(file, 0, (size_t)file_size) != (size_t)file_size){
+        fprintf(stderr, "%sERROR%s: file contains additional coded information\n",
+                ERR_SET, RESET);
+        exit(-1);
+    }
+    if (fseeko(file, 0, SEEK_SET) != 0){
+        fprintf(stderr, "%sERROR%s: could not seek in file: %s\n",
+                ERR_SET, RESET, strerror(errno));
+        exit(-1);
+    }
+}
+
+// EXTRACT
+/* with -pread every frame of a CAFF is converted as with -all,
+but the block chain is walked first, as by -validate, and the
+offset of every animation block is kept. the threads then take
+the frames in turn, read a whole block with a single pread at
+its offset and encode it, so no thread waits for a reader in
+front of it. the frames are listed with their durations in
+{name}.json next to them */
+bool g_pread;
+
+typedef struct {
+    size_t offset;
+    size_t size;
+    size_t duration;
+    bool written;
+} Extract;
+
+typedef struct {
+    int fd;
+    size_t next;
+    pthread_mutex_t lock;
+} Extraction;
+
+Extract *g_extracts;
+size_t g_extract_count;
+size_t g_extract_capacity;
+
+void extract_add(const size_t offset, const size_t size){
+    if (g_extract_count == g_extract_capacity){
+        const size_t capacity = g_extract_capacity != 0 ? 2 * g_extract_capacity : 64;
+        Extract *grown = pool_realloc(g_extracts, capacity * sizeof(Extract));
+        if (grown == NULL){
+            fprintf(stderr, "%sERROR%s: could not allocate the offsets of %zu frames\n",
+                    ERR_SET, RESET, capacity);
+            exit(-1);
+        }
+        g_extracts = grown;
+        g_extract_capacity = capacity;
+    }
+    g_extracts[g_extract_count++] = (Extract){offset, size, 0, false};
+}
+
+/* a frame the pipeline took when the file is read in order, at
+its place in the animation as on the pread path, the frames
+before it without pixels stay in the list unwritten */
+void extract_frame(const size_t number, const size_t duration){
+    if (!g_pread){ return; }
+    while (g_extract_count <= number){ extract_add(0, 0); }
+    g_extracts[number].duration = duration;
+    g_extracts[number].written = true;
+}
+
+void extract_read(const int fd, uint8_t *buffer, size_t size, off_t offset){
+    while (size != 0){
+        const ssize_t got = pread(fd, buffer, size, offset);
+        if (got <= 0){
+            fprintf(stderr, "%sERROR%s: could not read file at byte %lld: %s\n",
+                    ERR_SET, RESET, (long long)offset,
+                    got == 0 ? "file ended" : strerror(errno));
+            exit(-1);
+        }
+        buffer += got;
+        size -= (size_t)got;
+        offset += got;
+    }
+}
+
+// the caption ends within the header and the tags hold no escape
+void extract_text(const uint8_t *text, const size_t size){
+    const uint8_t *end = memchr(text, ESC, size);
+    if (end == NULL){
+        fprintf(stderr,
+                "%sERROR%s: file caption larger than what header defines\n",
+                ERR_SET, RESET);
+        exit(-1);
+    }
+    if (end == text){
+        printf("%sWARNING%s: file does not define the caption\n",
+                WARN_SET, RESET);
+    }
+    const size_t caption_size = (size_t)(end - text) + 1;
+    if (caption_size == size){
+        printf("%sWARNING%s: file does not include any tags\n",
+                WARN_SET, RESET);
+    } else if (memchr(end + 1, ESC, size - caption_size) != NULL){
+        fprintf(stderr,
+                "%sERROR%s: file contains escape ASCII in tags\n",
+                ERR_SET, RESET);
+        exit(-1);
+    }
+}
+
+void *extract_worker(void *argument){
+    Extraction *extraction = argument;
+    const size_t capacity = strlen(g_file_name) + 80;
+    char file_name[capacity];
+    uint8_t *block = NULL;
+    size_t block_capacity = 0;
+    Output output = {0};
+
+    for (;;){
+        pthread_mutex_lock(&extraction->lock);
+        const size_t index = extraction->next++;
+        pthread_mutex_unlock(&extraction->lock);
+        if (index >= g_extract_count){ break; }
+
+        Extract *frame = &g_extracts[index];
+        reserve_pixels(&block, &block_capacity, frame->size);
+        extract_read(extraction->fd, block, frame->size, (off_t)frame->offset);
+        frame->duration = translate_bytes(block, DUR);
+        uint8_t *ciff = block + DUR;
+        size_t pixel_size;
+        const size_t header_size = read_ciff_fixed(ciff, &pixel_size);
+        const size_t width = translate_bytes(ciff + MGC + CAP + CAP, WDT);
+        const size_t height = translate_bytes(ciff + MGC + CAP + CAP + WDT, HGT);
+        extract_text(ciff + CIFF_FIXED, header_size - CIFF_FIXED);
+        if (pixel_size == 0){
+            printf("%sWARNING%s: file is missing the pixel data\n",
+                    WARN_SET, RESET);
+            continue;
+        }
+        encode_image(&output, ciff + header_size, width, height);
+
+        // the outputs share the tar, the renames and the log
+        set_frame_file_name(file_name, capacity, index);
+        pthread_mutex_lock(&extraction->lock);
+        write_output(file_name, &output);
+        frame->written = true;
 #if LOG
-            printf("\n");
+        printf("successfully saved to \"%s\"\n", file_name);
 #endif
-        } else if (block_id == 3){
-            // ANIMATION
-            read_caff_animation(file, save_first);
-            save_first = false;
+        pthread_mutex_unlock(&extraction->lock);
+    }
+    pool_free(block);
+    pool_free(output.data);
+    return NULL;
+}
+
+// a string of the manifest, quoted for JSON
+void append_json(Output *output, const char *text){
+    append_output(output, "\"", 1);
+    for (; *text != '\0'; ++text){
+        if (*text == '"' || *text == '\\'){
+            append_output(output, "\\", 1);
+            append_output(output, (void *)text, 1);
+        } else if ((unsigned char)*text < 0x20){
+            char escaped[8];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", (unsigned char)*text);
+            append_output(output, escaped, 6);
+        } else {
+            append_output(output, (void *)text, 1);
+        }
+    }
+    append_output(output, "\"", 1);
+}
+
+// {name}.json with every frame written and its duration
+void create_manifest(void){
+    const int stem = (int)(strlen(g_file_name) - strlen(formats[g_format]) - 1);
+    const size_t capacity = strlen(g_file_name) + 80;
+    char file_name[capacity];
+    char line[64];
+    g_output.size = 0;
+    append_output(&g_output, "{\n  \"frames\": [", 15);
+    bool first = true;
+    for (size_t i = 0; i < g_extract_count; ++i){
+        // a frame without pixels has no file
+        if (!g_extracts[i].written){ continue; }
+        set_frame_file_name(file_name, capacity, i);
+        const char *base = strrchr(file_name, '/');
+        append_output(&g_output, first ? "\n    {\"file\": " : ",\n    {\"file\": ",
+                      first ? 14 : 15);
+        append_json(&g_output, base != NULL ? base + 1 : file_name);
+        const int size = snprintf(line, sizeof(line), ", \"duration\": %zu}",
+                                  g_extracts[i].duration);
+        append_output(&g_output, line, size);
+        first = false;
+    }
+    append_output(&g_output, "\n  ]\n}\n", 7);
+    snprintf(file_name, capacity, "%.*s.json", stem, g_file_name);
+    write_output(file_name, &g_output);
 #if LOG
-            printf("\n");
+    printf("successfully saved to \"%s\"\n", file_name);
+#endif
+}
+
+/* returns false when the file can not be read at offsets,
+it is then read in order as with -all and its frames are
+collected by extract_frame for the manifest */
+bool extract_caff(FILE *file){
+    const int fd = fileno(file);
+    struct stat status;
+    if (fd == -1 || fstat(fd, &status) != 0 || !S_ISREG(status.st_mode)){
+        printf("%sWARNING%s: file can not be read at offsets, its frames are read in order\n",
+                WARN_SET, RESET);
+        return false;
+    }
+    if (status.st_size == 0){ return false; }
+    uint8_t id;
+    extract_read(fd, &id, ID, 0);
+    if (id == magic_icaff[0]){
+        printf("%sWARNING%s: an indexed CAFF is read through its table\n",
+                WARN_SET, RESET);
+        return false;
+    }
+
+    g_extract_count = 0;
+    validate_caff(file, (size_t)status.st_size, extract_add);
+    Extraction extraction = {.fd = fd, .next = 0};
+    pthread_mutex_init(&extraction.lock, NULL);
+    const size_t threads = g_threads < g_extract_count ? g_threads : g_extract_count;
+    pthread_t workers[threads + 1];
+    for (size_t i = 0; i < threads; ++i){
+        if (pthread_create(&workers[i], NULL, extract_worker, &extraction) != 0){
+            fprintf(stderr, "%sERROR%s: could not start an extraction worker\n",
+                    ERR_SET, RESET);
+            exit(-1);
+        }
+    }
+    for (size_t i = 0; i < threads; ++i){ pthread_join(workers[i], NULL); }
+    pthread_mutex_destroy(&extraction.lock);
+#if LOG
+    printf("pread: %zu frames, %zu workers\n", g_extract_count, threads);
 #endif
+    create_manifest();
+    return true;
+}
+
+const char *g_program;
+const char *g_flag;
+const char *g_file_path;
+const char **g_file_paths;
+size_t g_file_count;
+const char *g_daemon_socket;
+#define WORKERS 4
+size_t g_daemon_workers = WORKERS;
+
+size_t read_option_value(const char *option, const char *value,
+                         const size_t min, const size_t max){
+    if (value == NULL){
+        fprintf(stderr,
+            "%sERROR%s: no value provided for \"%s\"\n", ERR_SET, RESET, option);
+        usage(stderr, g_program);
+        exit(-1);
+    }
+    char *end;
+    errno = 0;
+    const unsigned long long number = strtoull(value, &end, 10);
+    if (errno != 0 || end == value || *end != '\0' || number < min || number > max){
+        fprintf(stderr,
+            "%sERROR%s: invalid value \"%s\" for \"%s\"\n", ERR_SET, RESET, value, option);
+        usage(stderr, g_program);
+        exit(-1);
+    }
+    return (size_t)number;
+}
+
+// sizes separated by commas, "full" for the image itself
+void read_ladder_sizes(const char *option, const char *value){
+    if (value == NULL){
+        fprintf(stderr,
+            "%sERROR%s: no value provided for \"%s\"\n", ERR_SET, RESET, option);
+        usage(stderr, g_program);
+        exit(-1);
+    }
+    g_ladder_count = 0;
+    const char *size = value;
+    while (true){
+        const size_t length = strcspn(size, ",");
+        char *end = (char *)size;
+        unsigned long long number = FULL;
+        if (length == 4 && strncmp(size, "full", 4) == 0){
+            end += length;
+        } else {
+            errno = 0;
+            number = strtoull(size, &end, 10);
+            if (errno != 0 || number == 0 || number > 65535){ end = (char *)size; }
+        }
+        if (length == 0 || end != size + length || g_ladder_count == LADDER){
+            fprintf(stderr,
+                "%sERROR%s: invalid value \"%s\" for \"%s\"\n", ERR_SET, RESET, value, option);
+            usage(stderr, g_program);
+            exit(-1);
+        }
+        g_ladder[g_ladder_count++] = (size_t)number;
+        if (size[length] == '\0'){ break; }
+        size += length + 1;
+    }
+}
+
+/* the same arguments are parsed from the command line
+and from daemon requests, a request can not start
+another daemon or write outside the working directory
+of the daemon, so those options are foreign there */
+void parse_arguments(const char **argv, bool request){
+    g_quality = QUALITY;
+    g_format = FORMAT_JPG;
+    g_uring = false;
+    g_all = false;
+    g_frame = 0;
+    g_repack = false;
+    g_stream = false;
+    g_validate = false;
+    g_pread = false;
+    g_y4m_fps = 0;
+    g_output_root = NULL;
+    g_tar_path = NULL;
+    memset(g_shards_made, 0, sizeof(g_shards_made));
+    g_ladder_count = 0;
+    g_tile_size = 0;
+    g_dzi = false;
+    stbi_write_jpg_progressive = 0;
+    stbi_write_jpg_optimize = 0;
+    stbi_write_png_filter_sample = 1;
+    stbi_write_png_compression_level = LEVEL;
+    const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    g_threads = cpus > 0 ? (size_t)cpus : 1;
+
+    // check the options
+    while (*argv != NULL && **argv == '-'
+           && strcmp(*argv, "-ciff") != 0 && strcmp(*argv, "-caff") != 0
+           && strcmp(*argv, "-bundle") != 0){
+        const char *option = *argv++;
+        if (strcmp(option, "-quality") == 0){
+            g_quality = (int)read_option_value(option, *argv, 1, 100);
+            ++argv;
+        } else if (strcmp(option, "-format") == 0){
+            size_t format = 0;
+            while (*argv != NULL && format < sizeof(formats) / sizeof(*formats)
+                   && strcmp(*argv, formats[format]) != 0){ ++format; }
+            if (*argv == NULL || format == sizeof(formats) / sizeof(*formats)){
+                fprintf(stderr,
+                    "%sERROR%s: unknown format \"%s\"\n", ERR_SET, RESET,
+                    *argv != NULL ? *argv : "");
+                usage(stderr, g_program);
+                exit(-1);
+            }
+            g_format = (Format)format;
+            ++argv;
+        } else if (strcmp(option, "-progressive") == 0){
+            stbi_write_jpg_progressive = 1;
+        } else if (strcmp(option, "-optimize") == 0){
+            stbi_write_jpg_optimize = 1;
+        } else if (strcmp(option, "-uring") == 0){
+            g_uring = true;
+        } else if (strcmp(option, "-all") == 0){
+            g_all = true;
+        } else if (strcmp(option, "-frame") == 0){
+            g_frame = read_option_value(option, *argv, 0, SIZE_MAX);
+            ++argv;
+        } else if (strcmp(option, "-repack") == 0){
+            g_repack = true;
+        } else if (strcmp(option, "-stream") == 0){
+            g_stream = true;
+        } else if (strcmp(option, "-validate") == 0){
+            g_validate = true;
+        } else if (strcmp(option, "-pread") == 0){
+            g_pread = true;
+        } else if (!request && strcmp(option, "-y4m") == 0){
+            g_y4m_fps = read_option_value(option, *argv, 1, 1000);
+            ++argv;
+        } else if (!request && strcmp(option, "-output") == 0){
+            if (*argv == NULL || **argv == '\0'){
+                fprintf(stderr,
+                    "%sERROR%s: no value provided for \"%s\"\n", ERR_SET, RESET, option);
+                usage(stderr, g_program);
+                exit(-1);
+            }
+            g_output_root = *argv++;
+        } else if (!request && strcmp(option, "-tar") == 0){
+            if (*argv == NULL || **argv == '\0'){
+                fprintf(stderr,
+                    "%sERROR%s: invalid value \"%s\" for \"%s\"\n", ERR_SET, RESET,
+                    *argv != NULL ? *argv : "", option);
+                usage(stderr, g_program);
+                exit(-1);
+            }
+            g_tar_path = *argv++;
+        } else if (strcmp(option, "-threads") == 0){
+            g_threads = read_option_value(option, *argv, 1, 256);
+            ++argv;
+        } else if (strcmp(option, "-ladder") == 0){
+            read_ladder_sizes(option, *argv);
+            ++argv;
+        } else if (strcmp(option, "-tile") == 0){
+            g_tile_size = read_option_value(option, *argv, 16, 65535);
+            ++argv;
+        } else if (strcmp(option, "-dzi") == 0){
+            g_dzi = true;
+        } else if (strcmp(option, "-level") == 0){
+            stbi_write_png_compression_level = (int)read_option_value(option, *argv, 1, 9);
+            ++argv;
+        } else if (strcmp(option, "-sample") == 0){
+            stbi_write_png_filter_sample = (int)read_option_value(option, *argv, 1, 1 << 16);
+            ++argv;
+        } else if (!request && strcmp(option, "-daemon") == 0){
+            if (*argv == NULL){
+                fprintf(stderr,
+                    "%sERROR%s: no socket provided\n", ERR_SET, RESET);
+                usage(stderr, g_program);
+                exit(-1);
+            }
+            g_daemon_socket = *argv++;
+        } else if (!request && strcmp(option, "-workers") == 0){
+            g_daemon_workers = read_option_value(option, *argv, 1, 256);
+            ++argv;
         } else {
             fprintf(stderr,
-                    "%sERROR%s: file has unknown id in a block: %zu\n",
-                    ERR_SET, RESET, block_id);
+                "%sERROR%s: foreign flag \"%s\"\n", ERR_SET, RESET, option);
+            usage(stderr, g_program);
+            exit(-1);
+        }
+    }
+
+    if (g_pread){ g_all = true; }
+    if (g_pread && (g_stream || g_uring || g_repack)){
+        fprintf(stderr,
+            "%sERROR%s: \"-pread\" can not be combined with \"-stream\", \"-uring\" or \"-repack\"\n", ERR_SET, RESET);
+        usage(stderr, g_program);
+        exit(-1);
+    }
+    if (g_all && g_ladder_count != 0){
+        fprintf(stderr,
+            "%sERROR%s: \"-ladder\" can not be combined with \"-all\"\n", ERR_SET, RESET);
+        usage(stderr, g_program);
+        exit(-1);
+    }
+    if (g_all && g_frame != 0){
+        fprintf(stderr,
+            "%sERROR%s: \"-frame\" can not be combined with \"-all\"\n", ERR_SET, RESET);
+        usage(stderr, g_program);
+        exit(-1);
+    }
+    if (g_stream && (g_uring || g_repack || g_validate)){
+        fprintf(stderr,
+            "%sERROR%s: \"-stream\" can not be combined with \"-uring\", \"-repack\" or \"-validate\"\n", ERR_SET, RESET);
+        usage(stderr, g_program);
+        exit(-1);
+    }
+    if (g_tar_path != NULL && (g_output_root != NULL || g_repack)){
+        fprintf(stderr,
+            "%sERROR%s: \"-tar\" can not be combined with \"-output\" or \"-repack\"\n", ERR_SET, RESET);
+        usage(stderr, g_program);
+        exit(-1);
+    }
+    if (g_y4m_fps != 0 && (g_all || g_frame != 0 || g_repack || g_stream || g_ladder_count != 0
+                           || g_tile_size != 0 || g_dzi || g_tar_path != NULL || g_output_root != NULL)){
+        fprintf(stderr,
+            "%sERROR%s: \"-y4m\" writes every frame as it is and goes with none of the other outputs\n", ERR_SET, RESET);
+        usage(stderr, g_program);
+        exit(-1);
+    }
+    if (g_dzi && g_tile_size == 0){ g_tile_size = TILE; }
+    if (g_tile_size != 0 && (g_all || g_ladder_count != 0)){
+        fprintf(stderr,
+            "%sERROR%s: \"-tile\" can not be combined with \"-all\" or \"-ladder\"\n", ERR_SET, RESET);
+        usage(stderr, g_program);
+        exit(-1);
+    }
+
+    if (!request && g_daemon_socket != NULL){
+        // input files come with the requests
+        if (*argv != NULL){
+            fprintf(stderr,
+                "%sERROR%s: too many argumetns\n", ERR_SET, RESET);
+            usage(stderr, g_program);
             exit(-1);
         }
+        return;
     }
-}
-
-int main(int argc, char const *argv[])
-{
-    // check all arguments
-    (void) argc;
-    assert(*argv != NULL);
-    const char *program = *argv++;
 
     // check the flag
     if (*argv == NULL){
         fprintf(stderr,
             "%sERROR%s: no arguments provided\n", ERR_SET, RESET);
-        usage(stderr, program);
+        usage(stderr, g_program);
+        exit(-1);
+    }
+    g_flag = *argv++;
+    if (g_repack && strcmp(g_flag, "-caff") != 0){
+        fprintf(stderr,
+            "%sERROR%s: \"-repack\" takes {.caff} files\n", ERR_SET, RESET);
+        usage(stderr, g_program);
         exit(-1);
     }
-    const char *flag = *argv++;
-    if (!(strcmp(flag, "-ciff") == 0 || strcmp(flag, "-caff") == 0)){
+    const bool bundle = strcmp(g_flag, "-bundle") == 0;
+    if (bundle && g_stream){
         fprintf(stderr,
-            "%sERROR%s: foreign flag \"%s\"\n", ERR_SET, RESET, flag);
-        usage(stderr, program);
+            "%sERROR%s: \"-stream\" can not read a bundle\n", ERR_SET, RESET);
+        usage(stderr, g_program);
         exit(-1);
     }
 
@@ -438,54 +3613,937 @@ int main(int argc, char const *argv[])
     if (*argv == NULL){
         fprintf(stderr,
             "%sERROR%s: no input file provided\n", ERR_SET, RESET);
-        usage(stderr, program);
+        usage(stderr, g_program);
         exit(-1);
     }
-    const char *file_path = *argv++;
-    if (!check_extension(file_path)){
-        fprintf(stderr,
-            "%sERROR%s: equivocal extension in \"%s\"\n", ERR_SET, RESET, file_path);
-        usage(stderr, program);
+    g_file_paths = argv;
+
+    /* with -all the frames and with -tile the tiles already keep
+    the threads busy, otherwise a single PNG is deflated on all of them */
+    stbi_write_png_threads = g_all || g_tile_size != 0 ? 1 : (int)g_threads;
+
+    for (g_file_count = 0; *argv != NULL; ++argv, ++g_file_count){
+        const size_t length = strlen(*argv);
+        if (bundle ? !((length > 4 && strcmp(*argv + length - 4, ".tar") == 0)
+                       || (length > 7 && strcmp(*argv + length - 7, ".tar.gz") == 0))
+                   : !check_extension(*argv)){
+            fprintf(stderr,
+                "%sERROR%s: equivocal extension in \"%s\"\n", ERR_SET, RESET, *argv);
+            usage(stderr, g_program);
+            exit(-1);
+        }
+    }
+    assert(g_file_count != 0);
+}
+
+// GZIP
+/* a gzip-compressed {.ciff} or {.caff} is recognised by its
+magic byte, no CIFF or CAFF starts with it, and inflated as
+it is read through a stream the readers take for the file.
+only the input buffer and the 32K window are held, so the
+archive is never inflated to a temporary file */
+#define GZIP_MAGIC 0x1f
+#define GZIP_INPUT ((size_t)1 << 16)
+
+typedef struct {
+    FILE *source;
+    z_stream stream;
+    // a member is complete, another one may follow it
+    bool ended;
+    uint8_t input[GZIP_INPUT];
+} Gzip;
+
+ssize_t gzip_read(void *cookie, char *buffer, size_t size){
+    Gzip *gzip = cookie;
+    gzip->stream.next_out = (Bytef *)buffer;
+    gzip->stream.avail_out = size < UINT_MAX ? (uInt)size : UINT_MAX;
+    const uInt capacity = gzip->stream.avail_out;
+    while (gzip->stream.avail_out != 0){
+        if (gzip->stream.avail_in == 0){
+            gzip->stream.next_in = gzip->input;
+            gzip->stream.avail_in = (uInt)fread(gzip->input, 1, GZIP_INPUT, gzip->source);
+            if (gzip->stream.avail_in == 0){
+                if (ferror(gzip->source)){ return -1; }
+                if (!gzip->ended){
+                    fprintf(stderr, "%sERROR%s: gzip stream ends early\n", ERR_SET, RESET);
+                    exit(-1);
+                }
+                break;
+            }
+        }
+        if (gzip->ended){
+            inflateReset(&gzip->stream);
+            gzip->ended = false;
+        }
+        const int status = inflate(&gzip->stream, Z_NO_FLUSH);
+        if (status == Z_STREAM_END){
+            gzip->ended = true;
+        } else if (status != Z_OK){
+            fprintf(stderr, "%sERROR%s: gzip stream is corrupt: %s\n", ERR_SET, RESET,
+                    gzip->stream.msg != NULL ? gzip->stream.msg : "unknown error");
+            exit(-1);
+        }
+    }
+    return (ssize_t)(capacity - gzip->stream.avail_out);
+}
+
+int gzip_close(void *cookie){
+    Gzip *gzip = cookie;
+    inflateEnd(&gzip->stream);
+    const int status = fclose(gzip->source);
+    free(gzip);
+    return status;
+}
+
+// the file itself, or the inflated stream when it is gzip-compressed
+FILE *open_input(FILE *file){
+    const int first = fgetc(file);
+    if (first == EOF){ return file; }
+    ungetc(first, file);
+    if (first != GZIP_MAGIC){ return file; }
+
+    Gzip *gzip = malloc(sizeof(Gzip));
+    if (gzip == NULL){
+        fprintf(stderr, "%sERROR%s: could not allocate the gzip stream\n", ERR_SET, RESET);
+        exit(-1);
+    }
+    memset(&gzip->stream, 0, sizeof(gzip->stream));
+    gzip->source = file;
+    gzip->ended = false;
+    // 16 + the window bits reads a gzip header instead of a zlib one
+    if (inflateInit2(&gzip->stream, 16 + 15) != Z_OK){
+        fprintf(stderr, "%sERROR%s: could not start inflating\n", ERR_SET, RESET);
+        exit(-1);
+    }
+    const cookie_io_functions_t functions = { gzip_read, NULL, NULL, gzip_close };
+    FILE *inflated = fopencookie(gzip, "rb", functions);
+    if (inflated == NULL){
+        fprintf(stderr, "%sERROR%s: could not open the gzip stream: %s\n",
+                ERR_SET, RESET, strerror(errno));
+        exit(-1);
+    }
+    return inflated;
+}
+
+// STREAM
+/* with -stream the input is read in whatever pieces read()
+returns and pushed through the parser, so a file that is still
+arriving on a pipe or a socket is converted as it comes in:
+rows go where the readers above would have read them, straight
+into the tiles, the ladder or a frame of the pipeline, and a
+frame is encoded as soon as its last row is in. a gzip-compressed
+input is inflated piece by piece on the way */
+#define STREAM_INPUT ((size_t)1 << 16)
+
+typedef struct {
+    bool save;          // the frame is converted
+    uint8_t *pixels;    // where its rows go, unless tiled
+    Frame *frame;       // with -all
+    Pipeline frames;    // with -all
+    Pipeline tiles;     // with -tile
+} Stream;
+
+bool stream_event(Push *push, PushEvent event, const uint8_t *data, size_t size){
+    Stream *stream = push->context;
+    const size_t row_size = push->width * 3;
+    switch (event){
+        case PUSH_HEADER:
+#if LOG
+            printf("number of animations: %zu\n\n", push->animations);
+#endif
+            if (g_all){ pipeline_start(&stream->frames, false); }
+            break;
+        case PUSH_CREDITS:
+#if LOG
+            printf("date: ");
+            print_date((uint8_t *)data, size);
+            if (push->text_size != 0){
+                printf("creator: ");
+                print_ascii(push->text, push->text_size);
+            }
+            printf("\n");
+#endif
+            break;
+        case PUSH_FRAME:
+#if LOG
+            if (push->caff){ printf("duration: %zu\n", push->duration); }
+#endif
+            stream->save = !push->caff || g_all || push->frame == g_frame;
+            break;
+        case PUSH_CAPTION:
+#if LOG
+            if (size != 0){
+                printf("caption: ");
+                print_ascii((uint8_t *)data, size);
+            }
+#endif
+            break;
+        case PUSH_TAGS:
+#if LOG
+            if (size != 0){
+                printf("tags: ");
+                print_tags((uint8_t *)data, size);
+            }
+#endif
+            if (!stream->save || push->width * push->height == 0){ break; }
+            if (g_tile_size != 0){
+                tiles_start(push->width, push->height);
+                if (g_dzi){ create_dzi(push->width, push->height); }
+                pipeline_start(&stream->tiles, true);
+            } else if (g_all){
+                stream->frame = pipeline_acquire(&stream->frames, row_size * push->height);
+                stream->frame->number = push->frame;
+                stream->pixels = stream->frame->pixels;
+            } else {
+                stream->pixels = acquire_pixels(row_size * push->height);
+                if (g_ladder_count != 0){ ladder_start(stream->pixels, push->width, push->height); }
+            }
+            break;
+        case PUSH_ROW:
+            if (!stream->save){ break; }
+            if (g_tile_size != 0){
+                memcpy(tiles_next_row(0), data, size);
+                tiles_commit(&stream->tiles, 0);
+            } else {
+                memcpy(stream->pixels + push->rows * row_size, data, size);
+                if (g_ladder_count != 0){ ladder_rows(push->rows + 1); }
+            }
+            break;
+        case PUSH_FRAME_END:
+            if (stream->save && push->width * push->height != 0){
+                if (g_tile_size != 0){
+                    pipeline_finish(&stream->tiles);
+                } else if (g_all){
+                    pipeline_submit(&stream->frames, stream->frame, push->width, push->height);
+                } else if (g_ladder_count != 0){
+                    create_ladder();
+                } else {
+                    create_image(stream->pixels, push->width, push->height);
+                }
+            }
+            stream->save = false;
+#if LOG
+            if (push->caff){ printf("\n"); }
+#endif
+            break;
+        case PUSH_END:
+            if (!push->caff){ break; }
+            if (g_all){ pipeline_finish(&stream->frames); }
+            if (!g_all && g_frame >= push->frame){
+                fprintf(stderr, "%sERROR%s: file has no frame %zu\n", ERR_SET, RESET, g_frame);
+                exit(-1);
+            }
+            break;
+    }
+    return true;
+}
+
+void stream_feed(Push *push, const uint8_t *data, const size_t size){
+    size_t used = 0;
+    while (used < size){ used += push_feed(push, data + used, size - used); }
+}
+
+void stream_file(const int fd){
+    Stream stream;
+    memset(&stream, 0, sizeof(stream));
+    Push push;
+    push_init(&push, strcmp(g_flag, "-caff") == 0, stream_event, &stream);
+    uint8_t input[STREAM_INPUT];
+    bool first = true;
+    // gzip
+    uint8_t *inflated = NULL;
+    z_stream gzip;
+    bool ended = false;
+    while (true){
+        const ssize_t got = read(fd, input, sizeof(input));
+        if (got < 0){
+            if (errno == EINTR){ continue; }
+            fprintf(stderr, "%sERROR%s: could not read from file: %s\n",
+                    ERR_SET, RESET, strerror(errno));
+            exit(-1);
+        }
+        if (got == 0){ break; }
+        if (first && input[0] == GZIP_MAGIC){
+            inflated = pool_malloc(STREAM_INPUT);
+            memset(&gzip, 0, sizeof(gzip));
+            if (inflated == NULL || inflateInit2(&gzip, 16 + 15) != Z_OK){
+                fprintf(stderr, "%sERROR%s: could not start inflating\n", ERR_SET, RESET);
+                exit(-1);
+            }
+        }
+        first = false;
+        if (inflated == NULL){
+            stream_feed(&push, input, (size_t)got);
+            continue;
+        }
+        gzip.next_in = input;
+        gzip.avail_in = (uInt)got;
+        // a full output may leave more inflated bytes behind in zlib
+        do {
+            if (ended){
+                inflateReset(&gzip);
+                ended = false;
+            }
+            gzip.next_out = inflated;
+            gzip.avail_out = STREAM_INPUT;
+            const int status = inflate(&gzip, Z_NO_FLUSH);
+            if (status == Z_STREAM_END){
+                ended = true;
+            } else if (status != Z_OK && status != Z_BUF_ERROR){
+                fprintf(stderr, "%sERROR%s: gzip stream is corrupt: %s\n", ERR_SET, RESET,
+                        gzip.msg != NULL ? gzip.msg : "unknown error");
+                exit(-1);
+            }
+            stream_feed(&push, inflated, STREAM_INPUT - gzip.avail_out);
+        } while (gzip.avail_in != 0 || (gzip.avail_out == 0 && !ended));
+    }
+    if (inflated != NULL){
+        if (!ended){
+            fprintf(stderr, "%sERROR%s: gzip stream ends early\n", ERR_SET, RESET);
+            exit(-1);
+        }
+        inflateEnd(&gzip);
+        pool_free(inflated);
+    }
+    push_finish(&push);
+    push_free(&push);
+    close(fd);
+}
+
+// BUNDLE
+/* with -bundle the input is a tar of {.ciff} and {.caff} files.
+its members are converted one after the other straight out of
+the archive, each named after its own path, and everything else
+is skipped by its size, so a bundle is read once from start to
+end and never unpacked. long names come from pax or GNU headers */
+#define TAR_SIZE 12
+// longest pax record or GNU long name read for the name of a member
+#define TAR_LONG_NAME ((size_t)64 << 10)
+
+typedef struct {
+    FILE *archive;
+    off_t start;
+    size_t size;
+    size_t left;
+} Member;
+
+void convert_file(FILE *file);
+
+ssize_t member_read(void *cookie, char *buffer, size_t size){
+    Member *member = cookie;
+    if (size > member->left){ size = member->left; }
+    if (size == 0){ return 0; }
+    const size_t got = fread(buffer, 1, size, member->archive);
+    member->left -= got;
+    if (got == 0 && ferror(member->archive)){ return -1; }
+    return (ssize_t)got;
+}
+
+// only within the member, and only when the archive can seek
+int member_seek(void *cookie, off64_t *offset, int whence){
+    Member *member = cookie;
+    const off64_t base = whence == SEEK_SET ? 0
+                       : whence == SEEK_CUR ? (off64_t)(member->size - member->left)
+                       : (off64_t)member->size;
+    const off64_t target = base + *offset;
+    if (member->start < 0 || target < 0 || target > (off64_t)member->size
+        || fseeko(member->archive, member->start + target, SEEK_SET) != 0){ return -1; }
+    member->left = member->size - (size_t)target;
+    *offset = target;
+    return 0;
+}
+
+int member_close(void *cookie){
+    (void) cookie;
+    return 0;
+}
+
+// octal, or base-256 for sizes over 8 GB
+size_t tar_number(const char *field, const size_t size){
+    size_t value = 0;
+    if ((uint8_t)field[0] & 0x80){
+        for (size_t i = 1; i < size; ++i){ value = value << 8 | (uint8_t)field[i]; }
+        return value;
+    }
+    for (size_t i = 0; i < size && field[i] >= '0' && field[i] <= '7'; ++i){
+        value = value << 3 | (size_t)(field[i] - '0');
+    }
+    return value;
+}
+
+// the flag a member is read with, NULL when it is no image
+const char *member_flag(const char *name){
+    if (!check_extension(name)){ return NULL; }
+    size_t length = strlen(name);
+    if (length > 3 && strcmp(name + length - 3, ".gz") == 0){ length -= 3; }
+    return strncmp(name + length - 5, ".ciff", 5) == 0 ? "-ciff" : "-caff";
+}
+
+/* a member keeps its directories under the output, so a/x.caff
+and b/x.caff of one bundle do not write the same x.jpg. the
+directories are made as on any run, in a tar the parents of an
+entry are made by tar -x itself */
+void set_member_file_name(const char *member_name){
+    bool inside = member_name[0] != '/';
+    for (const char *part = member_name; inside;){
+        const char *end = strchrnul(part, '/');
+        inside = end - part != 2 || strncmp(part, "..", 2) != 0;
+        if (*end == '\0'){ break; }
+        part = end + 1;
+    }
+    if (!inside){
+        fprintf(stderr, "%sERROR%s: tar member \"%s\" points outside of the output\n",
+                ERR_SET, RESET, member_name);
         exit(-1);
     }
+    set_output_name(member_name);
+    if (g_tar_fd != -1){ return; }
+    const size_t prefix = g_output_root != NULL ? strlen(g_output_root) + SHARD_PREFIX : 0;
+    for (char *slash = g_file_name + prefix; (slash = strchr(slash, '/')) != NULL; ++slash){
+        *slash = '\0';
+        make_directory(g_file_name);
+        *slash = '/';
+    }
+}
+
+void convert_bundle(FILE *archive){
+    TarHeader header;
+    size_t position = 0;
+    char *long_name = NULL;
+    size_t long_name_capacity = 0;
+    bool has_long_name = false;
+    while (true){
+        read_bytes_to_buffer(archive, &header, sizeof(header));
+        position += sizeof(header);
+        const uint8_t *bytes = (const uint8_t *)&header;
+        unsigned checksum = 0;
+        bool empty = true;
+        for (size_t i = 0; i < sizeof(header); ++i){
+            const bool in_checksum = i >= offsetof(TarHeader, checksum)
+                                  && i < offsetof(TarHeader, checksum) + sizeof(header.checksum);
+            checksum += in_checksum ? ' ' : bytes[i];
+            empty = empty && bytes[i] == 0;
+        }
+        // the archive ends with empty blocks
+        if (empty){ break; }
+        if (checksum != tar_number(header.checksum, sizeof(header.checksum))){
+            fprintf(stderr, "%sERROR%s: tar header at byte %zu has a wrong checksum\n",
+                    ERR_SET, RESET, position - sizeof(header));
+            exit(-1);
+        }
+        const size_t size = tar_number(header.size, TAR_SIZE);
+        if (size > SIZE_MAX - TAR_BLOCK - position){
+            fprintf(stderr, "%sERROR%s: tar member at byte %zu claims %zu bytes\n",
+                    ERR_SET, RESET, position - sizeof(header), size);
+            exit(-1);
+        }
+        const size_t end = position + size + (TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK;
+
+        if (header.type == 'x' || header.type == 'L'){
+            // the name of the next member, in a pax record or as it is
+            if (size > TAR_LONG_NAME){
+                fprintf(stderr, "%sERROR%s: tar header at byte %zu has a name record of %zu bytes\n",
+                        ERR_SET, RESET, position - sizeof(header), size);
+                exit(-1);
+            }
+            uint8_t *data = reserve_pixels((uint8_t **)&long_name, &long_name_capacity, size + 1);
+            if (size != 0){ read_bytes_to_buffer(archive, data, size); }
+            position += size;
+            data[size] = '\0';
+            if (header.type == 'L'){
+                has_long_name = true;
+            } else {
+                for (size_t at = 0; at < size;){
+                    char *record = (char *)data + at;
+                    const size_t length = strtoull(record, NULL, 10);
+                    char *key = strchr(record, ' ');
+                    if (length == 0 || length > size - at || key == NULL){ break; }
+                    if (strncmp(key + 1, "path=", 5) == 0){
+                        record[length - 1] = '\0';
+                        memmove(data, key + 6, strlen(key + 6) + 1);
+                        has_long_name = true;
+                        break;
+                    }
+                    at += length;
+                }
+            }
+        } else if (header.type == '0' || header.type == '\0'){
+            char name[TAR_PREFIX + 1 + TAR_NAME + 1];
+            if (memcmp(header.magic, "ustar", 5) == 0 && header.prefix[0] != '\0'){
+                snprintf(name, sizeof(name), "%.*s/%.*s", TAR_PREFIX, header.prefix,
+                         TAR_NAME, header.name);
+            } else {
+                snprintf(name, sizeof(name), "%.*s", TAR_NAME, header.name);
+            }
+            const char *member_name = has_long_name ? long_name : name;
+            has_long_name = false;
+            const char *flag = member_flag(member_name);
+            if (flag != NULL){
+#if LOG
+                printf("member: %s\n", member_name);
+#endif
+                Member member = { archive, ftello(archive), size, size };
+                const cookie_io_functions_t functions = { member_read, NULL, member_seek, member_close };
+                FILE *file = fopencookie(&member, "rb", functions);
+                if (file == NULL){
+                    fprintf(stderr, "%sERROR%s: could not open the member: %s\n",
+                            ERR_SET, RESET, strerror(errno));
+                    exit(-1);
+                }
+                set_member_file_name(member_name);
+                g_flag = flag;
+                convert_file(file);
+                g_flag = "-bundle";
+                position += size - member.left;
+#if LOG
+                printf("\n");
+#endif
+            }
+        } else {
+            has_long_name = false;
+        }
+        skip_to(archive, &position, end);
+    }
+    pool_free(long_name);
+}
+
+void convert_file(FILE *file){
+    file = open_input(file);
+    if (strcmp(g_flag, "-bundle") == 0){
+        convert_bundle(file);
+        fclose(file);
+        return;
+    }
+    if (g_validate){ validate_input(file, strcmp(g_flag, "-caff") == 0); }
+    bool complete = true;
+    if (g_repack){
+        repack_caff(file);
+    } else if (g_pread && strcmp(g_flag, "-caff") == 0 && extract_caff(file)){
+        // the blocks were walked to the end of the file
+        complete = false;
+    } else if (strcmp(g_flag, "-caff") == 0){
+        g_extract_count = 0;
+        complete = read_caff(file);
+        if (g_pread){ create_manifest(); }
+    } else if (strcmp(g_flag, "-ciff") == 0){
+        // a single image is a single frame of the stream
+        if (g_y4m_fd != -1){ g_y4m_time += 1000; }
+        read_ciff(file, true);
+    }
+
+    if (complete){ check_end_of_file(file); }
+    fclose(file);
+}
 
+/* converts the input file, or the already
+opened descriptor when it is not -1 */
+void convert(const char *file_path, int fd){
+    g_file_path = file_path;
     set_g_file_name(file_path);
-    if (g_file_name == NULL){
+
+    if (g_stream){
+        if (fd == -1){ fd = open(file_path, O_RDONLY); }
+        if (fd == -1){
+            fprintf(stderr,
+                "%sERROR%s: could not open file %s: %s\n",
+                    ERR_SET, RESET, file_path, strerror(errno));
+            exit(-1);
+        }
+        stream_file(fd);
+        return;
+    }
+
+    // open file
+    FILE *file = fd == -1 ? fopen(file_path, "rb") : fdopen(fd, "rb");
+    if (file == NULL){
         fprintf(stderr,
-            "%sERROR%s: filename was not provided\n", ERR_SET, RESET);
-        usage(stderr, program);
+            "%sERROR%s: could not open file %s: %s\n",
+                ERR_SET, RESET, file_path, strerror(errno));
         exit(-1);
     }
-    assert(g_file_name != NULL);
+    convert_file(file);
+}
 
-    // check for overflow
-    if (*argv != NULL){
+void ring_start_read(size_t index, const char *file_path, const size_t capacity){
+    Slot *slot = &g_slots[index];
+    struct stat status;
+    slot->path = file_path;
+    slot->fd = open(file_path, O_RDONLY);
+    if (slot->fd == -1 || fstat(slot->fd, &status) == -1){
         fprintf(stderr,
-            "%sERROR%s: too many argumetns\n", ERR_SET, RESET);
-        usage(stderr, program);
+            "%sERROR%s: could not open file %s: %s\n",
+                ERR_SET, RESET, file_path, strerror(errno));
+        exit(-1);
+    }
+    if ((size_t)status.st_size > capacity){
+        fprintf(stderr,
+            "%sERROR%s: file %s has grown while converting\n",
+                ERR_SET, RESET, file_path);
         exit(-1);
     }
-    assert(*argv == NULL);
+    slot->size = status.st_size;
+    slot->done = 0;
+    slot->ready = false;
+    if (slot->size == 0){
+        close(slot->fd);
+        slot->fd = -1;
+        slot->ready = true;
+        return;
+    }
+    ring_read(index);
+}
 
-#if 1
-    // open file
-    FILE *file = fopen(file_path, "rb");
+void convert_slot(Slot *slot){
+    g_file_path = slot->path;
+    set_g_file_name(slot->path);
+    FILE *file = slot->size != 0 ? fmemopen(slot->buffer, slot->size, "rb")
+                                 : fopen(slot->path, "rb");
     if (file == NULL){
         fprintf(stderr,
             "%sERROR%s: could not open file %s: %s\n",
-                ERR_SET, RESET, file_path, strerror(errno));
+                ERR_SET, RESET, slot->path, strerror(errno));
         exit(-1);
     }
+    convert_file(file);
+}
 
-    if (strcmp(flag, "-caff") == 0){
-        read_caff(file);
-    } else if (strcmp(flag, "-ciff") == 0){
-        read_ciff(file, true);
+void convert_batch_uring(void){
+    Ring ring;
+    if (!ring_setup(&ring, 2 * SLOTS)){
+        printf("%sWARNING%s: io_uring is not available, falling back to stdio\n",
+                WARN_SET, RESET);
+        for (size_t i = 0; i < g_file_count; ++i){ convert(g_file_paths[i], -1); }
+        return;
     }
-    
-    check_end_of_file(file);
-    fclose(file);
+
+    /* every slot can hold the largest input, the
+    buffers are registered once for the whole batch */
+    size_t capacity = 1;
+    for (size_t i = 0; i < g_file_count; ++i){
+        struct stat status;
+        if (stat(g_file_paths[i], &status) == -1){
+            fprintf(stderr,
+                "%sERROR%s: could not open file %s: %s\n",
+                    ERR_SET, RESET, g_file_paths[i], strerror(errno));
+            exit(-1);
+        }
+        if ((size_t)status.st_size > capacity){ capacity = status.st_size; }
+    }
+    g_slot_count = SLOTS_BUDGET / capacity;
+    if (g_slot_count > SLOTS){ g_slot_count = SLOTS; }
+    if (g_slot_count > g_file_count){ g_slot_count = g_file_count; }
+    if (g_slot_count == 0){ g_slot_count = 1; }
+
+    uint8_t *buffers = malloc(g_slot_count * capacity);
+    if (buffers == NULL){
+        fprintf(stderr, "%sERROR%s: could not allocate %zu bytes for the inputs\n",
+                ERR_SET, RESET, g_slot_count * capacity);
+        exit(-1);
+    }
+    struct iovec registered[SLOTS];
+    for (size_t i = 0; i < g_slot_count; ++i){
+        g_slots[i].path = NULL;
+        g_slots[i].fd = -1;
+        g_slots[i].buffer = buffers + i * capacity;
+        registered[i].iov_base = g_slots[i].buffer;
+        registered[i].iov_len = capacity;
+    }
+    // plain reads still work when the memlock limit is too low
+    g_slots_registered = syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_BUFFERS,
+                                 registered, g_slot_count) == 0;
+    for (size_t i = 0; i < SLOTS; ++i){ g_pending[i].fd = -1; }
+    g_ring = &ring;
+#if LOG
+    printf("io_uring: %zu slots of %zu bytes%s\n\n", g_slot_count, capacity,
+           g_slots_registered ? ", registered" : "");
+#endif
+
+    size_t next_read = 0;
+    size_t next_convert = 0;
+    while (next_convert < g_file_count){
+        for (size_t i = 0; i < g_slot_count && next_read < g_file_count; ++i){
+            if (g_slots[i].path == NULL){
+                ring_start_read(i, g_file_paths[next_read++], capacity);
+            }
+        }
+        ring_submit(&ring, 0);
+
+        // files are converted in order, later ones keep reading
+        Slot *slot = NULL;
+        for (size_t i = 0; i < g_slot_count; ++i){
+            if (g_slots[i].path == g_file_paths[next_convert]){ slot = &g_slots[i]; }
+        }
+        if (slot != NULL && slot->ready){
+            convert_slot(slot);
+            slot->path = NULL;
+            ++next_convert;
+        } else {
+            ring_submit(&ring, 1);
+            ring_reap(&ring);
+        }
+    }
+
+    // wait for the last outputs
+    ring_drain(&ring);
+    g_ring = NULL;
+    ring_teardown(&ring);
+    free(buffers);
+}
+
+void convert_batch(void){
+    if (g_uring){
+        convert_batch_uring();
+        return;
+    }
+    for (size_t i = 0; i < g_file_count; ++i){
+        convert(g_file_paths[i], -1);
+    }
+}
+
+// DAEMON
+/* a request is a single line with the same arguments
+as the command line, e.g. "-quality 90 -caff image.caff\n",
+separated by spaces. A descriptor sent along with the
+request (SCM_RIGHTS) is read instead of the path, the path
+then only names the output. The worker answers with the
+log of the conversion followed by a "status: <code>" line.
+the socket is only open to the user of the daemon, and a
+client has TIMEOUT seconds to send its line.
+
+workers are forked once and keep their buffers warm between
+requests, a failing conversion still ends with exit(-1),
+so the worker reports the status on its way out and the
+daemon forks a fresh one in its place */
+#define REQ 4096
+#define ARGS 64
+#define PREALLOC (1920 * 1080 * 3)
+#define TIMEOUT 10
+int g_connection = -1;
+volatile sig_atomic_t g_daemon_stop;
+
+void report_failed_request(void){
+    if (g_connection != -1){
+        fflush(stdout);
+        dprintf(g_connection, "status: -1\n");
+    }
+}
+
+void stop_daemon(int signum){
+    (void) signum;
+    g_daemon_stop = 1;
+}
+
+/* reads up to the first newline of the request,
+returns false if the client left before sending one */
+bool receive_request(int connection, char *request, int *fd){
+    size_t length = 0;
+    *fd = -1;
+    while (length < REQ - 1){
+        char control[CMSG_SPACE(sizeof(int))];
+        struct iovec iov = { request + length, REQ - 1 - length };
+        struct msghdr message = {0};
+        message.msg_iov = &iov;
+        message.msg_iovlen = 1;
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+
+        ssize_t received = recvmsg(connection, &message, 0);
+        if (received <= 0){ break; }
+        struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+        if (header != NULL && header->cmsg_level == SOL_SOCKET
+                           && header->cmsg_type == SCM_RIGHTS){
+            if (*fd != -1){ close(*fd); }
+            memcpy(fd, CMSG_DATA(header), sizeof(int));
+        }
+
+        char *newline = memchr(request + length, '\n', received);
+        length += received;
+        if (newline != NULL){
+            *newline = '\0';
+            return true;
+        }
+    }
+    if (*fd != -1){ close(*fd); }
+    return false;
+}
+
+// a client of another user is refused even if it reached the socket
+bool accept_peer(int connection){
+    struct ucred peer;
+    socklen_t size = sizeof(peer);
+    const struct timeval timeout = { TIMEOUT, 0 };
+    return getsockopt(connection, SOL_SOCKET, SO_PEERCRED, &peer, &size) == 0
+        && (peer.uid == geteuid() || peer.uid == 0)
+        && setsockopt(connection, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) == 0;
+}
+
+void serve_request(int connection){
+    char request[REQ];
+    int fd;
+    if (!accept_peer(connection) || !receive_request(connection, request, &fd)){
+        dprintf(connection, "status: -1\n");
+        close(connection);
+        return;
+    }
+
+    const char *args[ARGS + 1];
+    size_t count = 0;
+    for (char *arg = strtok(request, " \t\r"); arg != NULL; arg = strtok(NULL, " \t\r")){
+        if (count == ARGS){ break; }
+        args[count++] = arg;
+    }
+    args[count] = NULL;
+
+    // the conversion logs straight to the client
+    fflush(stdout);
+    const int out = dup(STDOUT_FILENO);
+    const int err = dup(STDERR_FILENO);
+    dup2(connection, STDOUT_FILENO);
+    dup2(connection, STDERR_FILENO);
+    g_connection = connection;
+
+    parse_arguments(args, true);
+    prepare_jpg_encoder();
+    start_outputs();
+    if (fd != -1){
+        if (g_file_count != 1){
+            fprintf(stderr,
+                "%sERROR%s: a descriptor stands for exactly one file\n", ERR_SET, RESET);
+            exit(-1);
+        }
+        convert(g_file_paths[0], fd);
+    } else {
+        convert_batch();
+    }
+    finish_outputs();
+
+    fflush(stdout);
+    dprintf(connection, "status: 0\n");
+    g_connection = -1;
+    dup2(out, STDOUT_FILENO);
+    dup2(err, STDERR_FILENO);
+    close(out);
+    close(err);
+    close(connection);
+}
+
+pid_t spawn_worker(int listener){
+    /* the worker must not inherit the stop
+    handler of the daemon, so the signals
+    wait until it has restored the defaults */
+    sigset_t signals, previous;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigprocmask(SIG_BLOCK, &signals, &previous);
+
+    pid_t pid = fork();
+    if (pid == -1){
+        fprintf(stderr, "%sERROR%s: could not fork a worker: %s\n",
+                ERR_SET, RESET, strerror(errno));
+        exit(-1);
+    } else if (pid != 0){
+        sigprocmask(SIG_SETMASK, &previous, NULL);
+        return pid;
+    }
+
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGPIPE, SIG_IGN);
+    sigprocmask(SIG_SETMASK, &previous, NULL);
+    atexit(report_failed_request);
+
+    // touch the pages now, not on the first request
+    memset(acquire_pixels(PREALLOC), 0, PREALLOC);
+    set_g_file_name("preallocated.caff");
+
+    for (;;){
+        int connection = accept(listener, NULL, NULL);
+        if (connection == -1){ continue; }
+        serve_request(connection);
+    }
+}
+
+void run_daemon(void){
+    struct sockaddr_un address = {0};
+    address.sun_family = AF_UNIX;
+    if (strlen(g_daemon_socket) >= sizeof(address.sun_path)){
+        fprintf(stderr, "%sERROR%s: socket path is too long: %s\n",
+                ERR_SET, RESET, g_daemon_socket);
+        exit(-1);
+    }
+    strcpy(address.sun_path, g_daemon_socket);
+
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener == -1){
+        fprintf(stderr, "%sERROR%s: could not create socket: %s\n",
+                ERR_SET, RESET, strerror(errno));
+        exit(-1);
+    }
+    unlink(g_daemon_socket);
+    // created as 0600, there is no moment it is open to others
+    const mode_t mask = umask(0177);
+    const int bound = bind(listener, (struct sockaddr *)&address, sizeof(address));
+    umask(mask);
+    if (bound == -1 || listen(listener, SOMAXCONN) == -1){
+        fprintf(stderr, "%sERROR%s: could not listen on %s: %s\n",
+                ERR_SET, RESET, g_daemon_socket, strerror(errno));
+        exit(-1);
+    }
+
+    /* no SA_RESTART, so a signal
+    interrupts the wait below */
+    struct sigaction action = {0};
+    action.sa_handler = stop_daemon;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    fflush(stdout);
+    pid_t workers[g_daemon_workers];
+    for (size_t i = 0; i < g_daemon_workers; ++i){
+        workers[i] = spawn_worker(listener);
+    }
+#if LOG
+    printf("listening on \"%s\" with %zu workers\n", g_daemon_socket, g_daemon_workers);
+    fflush(stdout);
 #endif
 
+    while (!g_daemon_stop){
+        pid_t pid = waitpid(-1, NULL, 0);
+        if (pid == -1){
+            if (errno == EINTR){ continue; }
+            break;
+        }
+        // a failed request took its worker down
+        for (size_t i = 0; i < g_daemon_workers && !g_daemon_stop; ++i){
+            if (workers[i] == pid){ workers[i] = spawn_worker(listener); }
+        }
+    }
+
+    for (size_t i = 0; i < g_daemon_workers; ++i){
+        kill(workers[i], SIGTERM);
+    }
+    while (waitpid(-1, NULL, 0) != -1 || errno == EINTR);
+    close(listener);
+    unlink(g_daemon_socket);
+}
+
+int main(int argc, char const *argv[])
+{
+    // check all arguments
+    (void) argc;
+    assert(*argv != NULL);
+    g_program = *argv++;
+    parse_arguments(argv, false);
+
+    if (g_daemon_socket != NULL){
+        run_daemon();
+    } else {
+        prepare_jpg_encoder();
+        start_outputs();
+        convert_batch();
+        finish_outputs();
+    }
+
     return 0;
 }
@@ -26,6 +26,11 @@ BUILDING:
    You can #define STBIW_MALLOC(), STBIW_REALLOC(), and STBIW_FREE() to replace
    malloc,realloc,free.
    You can #define STBIW_MEMMOVE() to replace memmove()
+   You can #define STBIW_USE_PTHREADS to let the PNG writer split the work over
+   several threads, see 'stbi_write_png_threads' below.
+   You can #define STBIW_NO_SIMD to keep the PNG filters off SSE2 and the CRC of
+   PNG chunks off PCLMULQDQ even when the CPU has it, the CRC is computed by
+   slicing-by-8 then.
    You can #define STBIW_ZLIB_COMPRESS to use a custom zlib-style compress function
    for PNG compression (instead of the builtin one), it must have the following signature:
    unsigned char * my_compress(unsigned char *data, int data_len, int *out_len, int quality);
@@ -42,17 +47,18 @@ UNICODE:
 
 USAGE:
 
-   There are five functions, one for each image file format:
+   There are six functions, one for each image file format:
 
      int stbi_write_png(char const *filename, int w, int h, int comp, const void *data, int stride_in_bytes);
      int stbi_write_bmp(char const *filename, int w, int h, int comp, const void *data);
      int stbi_write_tga(char const *filename, int w, int h, int comp, const void *data);
      int stbi_write_jpg(char const *filename, int w, int h, int comp, const void *data, int quality);
      int stbi_write_hdr(char const *filename, int w, int h, int comp, const float *data);
+     int stbi_write_qoi(char const *filename, int w, int h, int comp, const void *data);
 
      void stbi_flip_vertically_on_write(int flag); // flag is non-zero to flip data vertically
 
-   There are also five equivalent functions that use an arbitrary write function. You are
+   There are also six equivalent functions that use an arbitrary write function. You are
    expected to open/close your file-equivalent before and after calling these:
 
      int stbi_write_png_to_func(stbi_write_func *func, void *context, int w, int h, int comp, const void  *data, int stride_in_bytes);
@@ -60,14 +66,27 @@ USAGE:
      int stbi_write_tga_to_func(stbi_write_func *func, void *context, int w, int h, int comp, const void  *data);
      int stbi_write_hdr_to_func(stbi_write_func *func, void *context, int w, int h, int comp, const float *data);
      int stbi_write_jpg_to_func(stbi_write_func *func, void *context, int x, int y, int comp, const void *data, int quality);
+     int stbi_write_qoi_to_func(stbi_write_func *func, void *context, int w, int h, int comp, const void *data);
+
+   Many JPEGs of one quality can share an encoder, which builds the quantization
+   tables and the baseline headers once. It is only read while encoding, so
+   threads can share it too:
+
+     stbi_write_jpg_encoder *stbi_write_jpg_encoder_create(int quality);
+     int stbi_write_jpg_encode_to_func(const stbi_write_jpg_encoder *encoder, stbi_write_func *func, void *context, int x, int y, int comp, const void *data);
+     void stbi_write_jpg_encoder_free(stbi_write_jpg_encoder *encoder);
 
    where the callback is:
       void stbi_write_func(void *context, void *data, int size);
 
    You can configure it with these global variables:
       int stbi_write_tga_with_rle;             // defaults to true; set to 0 to disable RLE
-      int stbi_write_png_compression_level;    // defaults to 8; set to higher for more compression
+      int stbi_write_jpg_progressive;          // defaults to false; set to 1 for progressive JPEG
+      int stbi_write_jpg_optimize;             // defaults to false; set to 1 for per-image Huffman tables
+      int stbi_write_png_compression_level;    // defaults to 8; 1 is fastest, 9 compresses most
       int stbi_write_force_png_filter;         // defaults to -1; set to 0..5 to force a filter mode
+      int stbi_write_png_threads;              // defaults to 1; set to higher to deflate in parallel
+      int stbi_write_png_filter_sample;        // defaults to 1; set to n to pick the filter every n rows
 
 
    You can define STBI_WRITE_NO_STDIO to disable the file variant of these
@@ -97,7 +116,25 @@ USAGE:
    at the end of the line.)
 
    PNG allows you to set the deflate compression level by setting the global
-   variable 'stbi_write_png_compression_level' (it defaults to 8).
+   variable 'stbi_write_png_compression_level' (it defaults to 8). The levels
+   are presets for the match finder, from 1 (fast: short hash chains, no lazy
+   matching) to 9 (max ratio: chains of up to 1024 candidates); the same
+   levels apply to the 'quality' of stbi_zlib_compress.
+
+   With STBIW_USE_PTHREADS defined and 'stbi_write_png_threads' above 1, large
+   PNGs are filtered and deflated in independent row ranges, one per thread,
+   pigz style. Every range ends on a byte-aligned sync flush and may still
+   refer back into the 32K before it, so the pieces join into one zlib stream;
+   each piece goes into its own IDAT chunk with its own CRC and the Adler-32
+   values of the pieces are combined. The output is a little larger than the
+   serial one. Not available with a custom STBIW_ZLIB_COMPRESS.
+
+   Unless a filter is forced, PNG tries all five filters on every row and
+   keeps the one with the smallest sum of absolute values. With
+   'stbi_write_png_filter_sample' set to n only every n-th row is scored
+   that way and the rows up to the next sample reuse its filter, which
+   trades a little size for most of the filtering time. On SSE2 targets the
+   filters and the scoring run 16 bytes at a time.
 
    HDR expects linear float data. Since the format is always 32-bit rgb(e)
    data, alpha (if provided) is discarded, and for monochrome data it is
@@ -108,7 +145,23 @@ USAGE:
 
    JPEG does ignore alpha channels in input data; quality is between 1 and 100.
    Higher quality looks better but results in a bigger image.
-   JPEG baseline (no JPEG progressive).
+   JPEG is baseline unless the global variable 'stbi_write_jpg_progressive' is
+   set. Progressive JPEG computes the coefficients of all blocks once and
+   sends them in ten scans (the simple progression of libjpeg): the DC terms
+   and the lowest luma frequencies at reduced precision first, so a viewer
+   can show the whole image blurred after a small part of the file, then
+   the remaining frequencies, then the dropped bits of precision.
+
+   JPEG uses the example Huffman tables of the standard unless the global
+   variable 'stbi_write_jpg_optimize' is set. Then the coefficients are kept
+   as for progressive output, the scans are run once only to count symbols,
+   and the tables built from those counts are what the file is coded with.
+   This is usually 5-10% smaller at the same quality, progressive files gain
+   more because the tables can code long runs of empty blocks.
+
+   QOI is lossless like PNG but encodes in a single pass without deflate,
+   so it is many times faster at a comparable size. RGB input writes a
+   3-channel file, RGBA a 4-channel one; Y and YA are expanded to RGB(A).
 
 CREDITS:
 
@@ -168,8 +221,12 @@ LICENSE
 
 #ifndef STB_IMAGE_WRITE_STATIC  // C++ forbids static forward declarations
 STBIWDEF int stbi_write_tga_with_rle;
+STBIWDEF int stbi_write_jpg_progressive;
+STBIWDEF int stbi_write_jpg_optimize;
 STBIWDEF int stbi_write_png_compression_level;
 STBIWDEF int stbi_write_force_png_filter;
+STBIWDEF int stbi_write_png_threads;
+STBIWDEF int stbi_write_png_filter_sample;
 #endif
 
 #ifndef STBI_WRITE_NO_STDIO
@@ -178,6 +235,7 @@ STBIWDEF int stbi_write_bmp(char const *filename, int w, int h, int comp, const
 STBIWDEF int stbi_write_tga(char const *filename, int w, int h, int comp, const void  *data);
 STBIWDEF int stbi_write_hdr(char const *filename, int w, int h, int comp, const float *data);
 STBIWDEF int stbi_write_jpg(char const *filename, int x, int y, int comp, const void  *data, int quality);
+STBIWDEF int stbi_write_qoi(char const *filename, int w, int h, int comp, const void  *data);
 
 #ifdef STBIW_WINDOWS_UTF8
 STBIWDEF int stbiw_convert_wchar_to_utf8(char *buffer, size_t bufferlen, const wchar_t* input);
@@ -191,6 +249,12 @@ STBIWDEF int stbi_write_bmp_to_func(stbi_write_func *func, void *context, int w,
 STBIWDEF int stbi_write_tga_to_func(stbi_write_func *func, void *context, int w, int h, int comp, const void  *data);
 STBIWDEF int stbi_write_hdr_to_func(stbi_write_func *func, void *context, int w, int h, int comp, const float *data);
 STBIWDEF int stbi_write_jpg_to_func(stbi_write_func *func, void *context, int x, int y, int comp, const void  *data, int quality);
+STBIWDEF int stbi_write_qoi_to_func(stbi_write_func *func, void *context, int w, int h, int comp, const void  *data);
+
+typedef struct stbi_write_jpg_encoder stbi_write_jpg_encoder;
+STBIWDEF stbi_write_jpg_encoder *stbi_write_jpg_encoder_create(int quality);
+STBIWDEF int stbi_write_jpg_encode_to_func(const stbi_write_jpg_encoder *encoder, stbi_write_func *func, void *context, int x, int y, int comp, const void  *data);
+STBIWDEF void stbi_write_jpg_encoder_free(stbi_write_jpg_encoder *encoder);
 
 STBIWDEF void stbi_flip_vertically_on_write(int flip_boolean);
 
@@ -216,6 +280,38 @@ STBIWDEF void stbi_flip_vertically_on_write(int flip_boolean);
 #include <string.h>
 #include <math.h>
 
+#ifdef STBIW_USE_PTHREADS
+#include <pthread.h>
+#ifndef STBIW_ZLIB_COMPRESS
+#define STBIW__PNG_THREADS
+#endif
+#endif
+
+#ifndef STBIW_THREAD_LOCAL
+   #if defined(__cplusplus) && __cplusplus >= 201103L
+      #define STBIW_THREAD_LOCAL       thread_local
+   #elif defined(__GNUC__) && __GNUC__ < 5
+      #define STBIW_THREAD_LOCAL       __thread
+   #elif defined(_MSC_VER)
+      #define STBIW_THREAD_LOCAL       __declspec(thread)
+   #elif defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L && !defined(__STDC_NO_THREADS__)
+      #define STBIW_THREAD_LOCAL       _Thread_local
+   #elif defined(__GNUC__)
+      #define STBIW_THREAD_LOCAL       __thread
+   #endif
+#endif
+
+// carry-less multiply CRC, picked at runtime when the CPU has PCLMULQDQ
+#if !defined(STBIW_NO_SIMD) && !defined(STBIW_CRC32) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define STBIW__CRC32_CLMUL
+#include <immintrin.h>
+#endif
+
+#if !defined(STBIW_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define STBIW__SSE2
+#include <emmintrin.h>
+#endif
+
 #if defined(STBIW_MALLOC) && defined(STBIW_FREE) && (defined(STBIW_REALLOC) || defined(STBIW_REALLOC_SIZED))
 // ok
 #elif !defined(STBIW_MALLOC) && !defined(STBIW_FREE) && !defined(STBIW_REALLOC) && !defined(STBIW_REALLOC_SIZED)
@@ -251,10 +347,18 @@ STBIWDEF void stbi_flip_vertically_on_write(int flip_boolean);
 static int stbi_write_png_compression_level = 8;
 static int stbi_write_tga_with_rle = 1;
 static int stbi_write_force_png_filter = -1;
+static int stbi_write_png_threads = 1;
+static int stbi_write_png_filter_sample = 1;
+static int stbi_write_jpg_progressive = 0;
+static int stbi_write_jpg_optimize = 0;
 #else
 int stbi_write_png_compression_level = 8;
 int stbi_write_tga_with_rle = 1;
 int stbi_write_force_png_filter = -1;
+int stbi_write_png_threads = 1;
+int stbi_write_png_filter_sample = 1;
+int stbi_write_jpg_progressive = 0;
+int stbi_write_jpg_optimize = 0;
 #endif
 
 static int stbi__flip_vertically_on_write = 0;
@@ -856,24 +960,117 @@ static int stbiw__zlib_bitrev(int code, int codebits)
    return res;
 }
 
-static unsigned int stbiw__zlib_countm(unsigned char *a, unsigned char *b, int limit)
+static int stbiw__zlib_countm(unsigned char *a, unsigned char *b, int limit)
 {
-   int i;
-   for (i=0; i < limit && i < 258; ++i)
+   int i=0;
+   if (limit > 258) limit = 258;
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+   // eight bytes at a time, the lowest differing bit gives the first differing byte
+   for (; i+8 <= limit; i += 8) {
+      unsigned long long wa, wb;
+      memcpy(&wa, a+i, 8);
+      memcpy(&wb, b+i, 8);
+      if (wa != wb) return i + (__builtin_ctzll(wa ^ wb) >> 3);
+   }
+#endif
+   for (; i < limit; ++i)
       if (a[i] != b[i]) break;
    return i;
 }
 
+#define stbiw__ZHASH_BITS  15
+#define stbiw__ZHASH       (1 << stbiw__ZHASH_BITS)
+#define stbiw__ZWINDOW     32768
+
 static unsigned int stbiw__zhash(unsigned char *data)
 {
    stbiw_uint32 hash = data[0] + (data[1] << 8) + (data[2] << 16);
-   hash ^= hash << 3;
-   hash += hash >> 5;
-   hash ^= hash << 4;
-   hash += hash >> 17;
-   hash ^= hash << 25;
-   hash += hash >> 6;
-   return hash;
+   return (hash * 2654435761u) >> (32 - stbiw__ZHASH_BITS);
+}
+
+// the match finder keeps the latest position of every hash and, for every
+// position in the window, the one before it with the same hash. its tables
+// have a fixed size and are kept for the next image
+typedef struct stbiw__zmatch
+{
+   int head[stbiw__ZHASH];
+   int prev[stbiw__ZWINDOW];
+   struct stbiw__zmatch *next;
+} stbiw__zmatch;
+
+// how hard to look for matches at every compression level: the longest chain
+// to walk, the length that is good enough to stop, and whether to check for a
+// longer match at the next byte before taking one (which also puts the
+// positions inside matches into the chains)
+static struct { unsigned short chain, nice; unsigned char lazy; } stbiw__zlevels[10] =
+{
+   {    2,   8, 0 },
+   {    2,   8, 0 }, // 1: fast
+   {    4,  16, 0 },
+   {    8,  32, 0 },
+   {    4,  16, 1 },
+   {    8,  32, 1 },
+   {    8,  64, 1 },
+   {   12, 128, 1 },
+   {   16, 258, 1 }, // 8: default
+   { 1024, 258, 1 }  // 9: max ratio
+};
+
+#ifdef STBIW_USE_PTHREADS
+static stbiw__zmatch *stbiw__zmatch_free;
+static pthread_mutex_t stbiw__zmatch_lock = PTHREAD_MUTEX_INITIALIZER;
+#define stbiw__zmatch_take(m)  (pthread_mutex_lock(&stbiw__zmatch_lock), (m) = stbiw__zmatch_free, (m) ? (stbiw__zmatch_free = (m)->next) : 0, pthread_mutex_unlock(&stbiw__zmatch_lock))
+#define stbiw__zmatch_give(m)  (pthread_mutex_lock(&stbiw__zmatch_lock), (m)->next = stbiw__zmatch_free, stbiw__zmatch_free = (m), pthread_mutex_unlock(&stbiw__zmatch_lock))
+#elif defined(STBIW_THREAD_LOCAL)
+static STBIW_THREAD_LOCAL stbiw__zmatch *stbiw__zmatch_free;
+#define stbiw__zmatch_take(m)  ((m) = stbiw__zmatch_free, stbiw__zmatch_free = NULL)
+#define stbiw__zmatch_give(m)  (stbiw__zmatch_free ? STBIW_FREE(m) : (void) (stbiw__zmatch_free = (m)))
+#else
+#define stbiw__zmatch_take(m)  ((m) = NULL)
+#define stbiw__zmatch_give(m)  STBIW_FREE(m)
+#endif
+
+static stbiw__zmatch *stbiw__zmatch_get(void)
+{
+   stbiw__zmatch *m;
+   int i;
+   stbiw__zmatch_take(m);
+   if (m == NULL)
+      m = (stbiw__zmatch *) STBIW_MALLOC(sizeof(stbiw__zmatch));
+   if (m != NULL)
+      for (i=0; i < stbiw__ZHASH; ++i)
+         m->head[i] = -1;
+   return m;
+}
+
+// puts position i into its chain and returns the previous head of it
+static int stbiw__zmatch_insert(stbiw__zmatch *m, unsigned char *data, int i)
+{
+   unsigned int h = stbiw__zhash(data+i);
+   int cand = m->head[h];
+   m->prev[i & (stbiw__ZWINDOW-1)] = cand;
+   m->head[h] = i;
+   return cand;
+}
+
+// walks the chain from cand for the longest match of data+i, closer ones win ties
+static int stbiw__zmatch_longest(stbiw__zmatch *m, unsigned char *data, int i, int cand, int limit, int chain, int nice, int *dist)
+{
+   int best = 0;
+   if (limit > 258) limit = 258;
+   while (cand >= 0 && i - cand < stbiw__ZWINDOW && chain-- > 0 && best < limit) {
+      // a longer match has to agree at data[i+best] first
+      if (data[cand+best] == data[i+best]) {
+         int len = stbiw__zlib_countm(data+cand, data+i, limit);
+         if (len > best) {
+            best = len;
+            *dist = i - cand;
+            if (len >= nice) break;
+         }
+      }
+      cand = m->prev[cand & (stbiw__ZWINDOW-1)];
+   }
+   return best;
 }
 
 #define stbiw__zlib_flush() (out = stbiw__zlib_flushf(out, &bitbuf, &bitcount))
@@ -888,74 +1085,53 @@ static unsigned int stbiw__zhash(unsigned char *data)
 #define stbiw__zlib_huff(n)  ((n) <= 143 ? stbiw__zlib_huff1(n) : (n) <= 255 ? stbiw__zlib_huff2(n) : (n) <= 279 ? stbiw__zlib_huff3(n) : stbiw__zlib_huff4(n))
 #define stbiw__zlib_huffb(n) ((n) <= 143 ? stbiw__zlib_huff1(n) : stbiw__zlib_huff2(n))
 
-#define stbiw__ZHASH   16384
-
 #endif // STBIW_ZLIB_COMPRESS
 
-STBIWDEF unsigned char * stbi_zlib_compress(unsigned char *data, int data_len, int *out_len, int quality)
+#ifndef STBIW_ZLIB_COMPRESS
+// deflates data[start..end) as fixed huffman blocks appended to 'out'; up to
+// 32K before 'start' serve as the dictionary. a 'last' range ends with BFINAL,
+// any other one with a sync flush that leaves the stream byte-aligned
+static unsigned char *stbiw__zlib_deflate_range(unsigned char *out, unsigned char *data, int start, int end, int quality, int last)
 {
-#ifdef STBIW_ZLIB_COMPRESS
-   // user provided a zlib compress implementation, use that
-   return STBIW_ZLIB_COMPRESS(data, data_len, out_len, quality);
-#else // use builtin
    static unsigned short lengthc[] = { 3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,35,43,51,59,67,83,99,115,131,163,195,227,258, 259 };
    static unsigned char  lengtheb[]= { 0,0,0,0,0,0,0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4,  4,  5,  5,  5,  5,  0 };
    static unsigned short distc[]   = { 1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577, 32768 };
    static unsigned char  disteb[]  = { 0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13 };
    unsigned int bitbuf=0;
    int i,j, bitcount=0;
-   unsigned char *out = NULL;
-   unsigned char ***hash_table = (unsigned char***) STBIW_MALLOC(stbiw__ZHASH * sizeof(unsigned char**));
-   if (hash_table == NULL)
+   int out_start = stbiw__sbcount(out);
+   int chain, nice, lazy;
+   stbiw__zmatch *m = stbiw__zmatch_get();
+   if (m == NULL) {
+      (void) stbiw__sbfree(out);
       return NULL;
-   if (quality < 5) quality = 5;
+   }
+   if (quality < 1) quality = 1;
+   if (quality > 9) quality = 9;
+   chain = stbiw__zlevels[quality].chain;
+   nice = stbiw__zlevels[quality].nice;
+   lazy = stbiw__zlevels[quality].lazy;
 
-   stbiw__sbpush(out, 0x78);   // DEFLATE 32K window
-   stbiw__sbpush(out, 0x5e);   // FLEVEL = 1
-   stbiw__zlib_add(1,1);  // BFINAL = 1
+   stbiw__zlib_add(last ? 1 : 0,1);  // BFINAL
    stbiw__zlib_add(1,2);  // BTYPE = 1 -- fixed huffman
 
-   for (i=0; i < stbiw__ZHASH; ++i)
-      hash_table[i] = NULL;
-
-   i=0;
-   while (i < data_len-3) {
-      // hash next 3 bytes of data to be compressed
-      int h = stbiw__zhash(data+i)&(stbiw__ZHASH-1), best=3;
-      unsigned char *bestloc = 0;
-      unsigned char **hlist = hash_table[h];
-      int n = stbiw__sbcount(hlist);
-      for (j=0; j < n; ++j) {
-         if (hlist[j]-data > i-32768) { // if entry lies within window
-            int d = stbiw__zlib_countm(hlist[j], data+i, data_len-i);
-            if (d >= best) { best=d; bestloc=hlist[j]; }
-         }
-      }
-      // when hash table entry is too long, delete half the entries
-      if (hash_table[h] && stbiw__sbn(hash_table[h]) == 2*quality) {
-         STBIW_MEMMOVE(hash_table[h], hash_table[h]+quality, sizeof(hash_table[h][0])*quality);
-         stbiw__sbn(hash_table[h]) = quality;
-      }
-      stbiw__sbpush(hash_table[h],data+i);
+   // prime the chains with the window before the range
+   for (i = start > stbiw__ZWINDOW ? start-stbiw__ZWINDOW : 0; i < start && i < end-3; ++i)
+      stbiw__zmatch_insert(m, data, i);
+
+   i=start;
+   while (i < end-3) {
+      int d = 0, best;
+      best = stbiw__zmatch_longest(m, data, i, stbiw__zmatch_insert(m, data, i), end-i, chain, nice, &d);
 
-      if (bestloc) {
+      if (best >= 3 && lazy && best < nice) {
          // "lazy matching" - check match at *next* byte, and if it's better, do cur byte as literal
-         h = stbiw__zhash(data+i+1)&(stbiw__ZHASH-1);
-         hlist = hash_table[h];
-         n = stbiw__sbcount(hlist);
-         for (j=0; j < n; ++j) {
-            if (hlist[j]-data > i-32767) {
-               int e = stbiw__zlib_countm(hlist[j], data+i+1, data_len-i-1);
-               if (e > best) { // if next match is better, bail on current match
-                  bestloc = NULL;
-                  break;
-               }
-            }
-         }
+         int e = 0;
+         if (stbiw__zmatch_longest(m, data, i+1, m->head[stbiw__zhash(data+i+1)], end-i-1, chain, best+1, &e) > best)
+            best = 0;
       }
 
-      if (bestloc) {
-         int d = (int) (data+i - bestloc); // distance back
+      if (best >= 3) {
          STBIW_ASSERT(d <= 32767 && best <= 258);
          for (j=0; best > lengthc[j+1]-1; ++j);
          stbiw__zlib_huff(j+257);
@@ -963,6 +1139,9 @@ STBIWDEF unsigned char * stbi_zlib_compress(unsigned char *data, int data_len, i
          for (j=0; d > distc[j+1]-1; ++j);
          stbiw__zlib_add(stbiw__zlib_bitrev(j,5),5);
          if (disteb[j]) stbiw__zlib_add(d - distc[j], disteb[j]);
+         if (lazy)
+            for (j=1; j < best && i+j < end-3; ++j)
+               stbiw__zmatch_insert(m, data, i+j);
          i += best;
       } else {
          stbiw__zlib_huffb(data[i]);
@@ -970,50 +1149,80 @@ STBIWDEF unsigned char * stbi_zlib_compress(unsigned char *data, int data_len, i
       }
    }
    // write out final bytes
-   for (;i < data_len; ++i)
+   for (;i < end; ++i)
       stbiw__zlib_huffb(data[i]);
    stbiw__zlib_huff(256); // end of block
+   if (!last) {
+      // sync flush: an empty stored block
+      stbiw__zlib_add(0,3);
+   }
    // pad with 0 bits to byte boundary
    while (bitcount)
       stbiw__zlib_add(0,1);
+   if (!last) {
+      stbiw__sbpush(out, 0x00);
+      stbiw__sbpush(out, 0x00);
+      stbiw__sbpush(out, 0xff);
+      stbiw__sbpush(out, 0xff);
+   }
 
-   for (i=0; i < stbiw__ZHASH; ++i)
-      (void) stbiw__sbfree(hash_table[i]);
-   STBIW_FREE(hash_table);
+   stbiw__zmatch_give(m);
 
    // store uncompressed instead if compression was worse
-   if (stbiw__sbn(out) > data_len + 2 + ((data_len+32766)/32767)*5) {
-      stbiw__sbn(out) = 2;  // truncate to DEFLATE 32K window and FLEVEL = 1
-      for (j = 0; j < data_len;) {
-         int blocklen = data_len - j;
+   if (end > start && stbiw__sbn(out) - out_start > (end-start) + ((end-start+32766)/32767)*5) {
+      stbiw__sbn(out) = out_start;
+      for (j = start; j < end;) {
+         int blocklen = end - j;
          if (blocklen > 32767) blocklen = 32767;
-         stbiw__sbpush(out, data_len - j == blocklen); // BFINAL = ?, BTYPE = 0 -- no compression
+         stbiw__sbpush(out, last && end - j == blocklen); // BFINAL = ?, BTYPE = 0 -- no compression
          stbiw__sbpush(out, STBIW_UCHAR(blocklen)); // LEN
          stbiw__sbpush(out, STBIW_UCHAR(blocklen >> 8));
          stbiw__sbpush(out, STBIW_UCHAR(~blocklen)); // NLEN
          stbiw__sbpush(out, STBIW_UCHAR(~blocklen >> 8));
+         stbiw__sbmaybegrow(out, blocklen);
          memcpy(out+stbiw__sbn(out), data+j, blocklen);
          stbiw__sbn(out) += blocklen;
          j += blocklen;
       }
    }
+   return out;
+}
 
-   {
-      // compute adler32 on input
-      unsigned int s1=1, s2=0;
-      int blocklen = (int) (data_len % 5552);
-      j=0;
-      while (j < data_len) {
-         for (i=0; i < blocklen; ++i) { s1 += data[j+i]; s2 += s1; }
-         s1 %= 65521; s2 %= 65521;
-         j += blocklen;
-         blocklen = 5552;
-      }
-      stbiw__sbpush(out, STBIW_UCHAR(s2 >> 8));
-      stbiw__sbpush(out, STBIW_UCHAR(s2));
-      stbiw__sbpush(out, STBIW_UCHAR(s1 >> 8));
-      stbiw__sbpush(out, STBIW_UCHAR(s1));
+static unsigned int stbiw__adler32(unsigned char *data, int data_len)
+{
+   unsigned int s1=1, s2=0;
+   int i, j=0, blocklen = (int) (data_len % 5552);
+   while (j < data_len) {
+      for (i=0; i < blocklen; ++i) { s1 += data[j+i]; s2 += s1; }
+      s1 %= 65521; s2 %= 65521;
+      j += blocklen;
+      blocklen = 5552;
    }
+   return s2 << 16 | s1;
+}
+#endif // STBIW_ZLIB_COMPRESS
+
+STBIWDEF unsigned char * stbi_zlib_compress(unsigned char *data, int data_len, int *out_len, int quality)
+{
+#ifdef STBIW_ZLIB_COMPRESS
+   // user provided a zlib compress implementation, use that
+   return STBIW_ZLIB_COMPRESS(data, data_len, out_len, quality);
+#else // use builtin
+   unsigned char *out = NULL;
+   unsigned int adler;
+
+   stbiw__sbpush(out, 0x78);   // DEFLATE 32K window
+   stbiw__sbpush(out, 0x5e);   // FLEVEL = 1
+   out = stbiw__zlib_deflate_range(out, data, 0, data_len, quality, 1);
+   if (out == NULL)
+      return NULL;
+
+   // compute adler32 on input
+   adler = stbiw__adler32(data, data_len);
+   stbiw__sbpush(out, STBIW_UCHAR(adler >> 24));
+   stbiw__sbpush(out, STBIW_UCHAR(adler >> 16));
+   stbiw__sbpush(out, STBIW_UCHAR(adler >> 8));
+   stbiw__sbpush(out, STBIW_UCHAR(adler));
    *out_len = stbiw__sbn(out);
    // make returned pointer freeable
    STBIW_MEMMOVE(stbiw__sbraw(out), out, *out_len);
@@ -1021,12 +1230,11 @@ STBIWDEF unsigned char * stbi_zlib_compress(unsigned char *data, int data_len, i
 #endif // STBIW_ZLIB_COMPRESS
 }
 
-static unsigned int stbiw__crc32(unsigned char *buffer, int len)
+#ifndef STBIW_CRC32
+// slicing-by-8: row 0 is the classic byte table, row k advances a byte by k
+// more zero bytes, so eight bytes are folded in with eight lookups
+static unsigned int stbiw__crc_table[8][256] =
 {
-#ifdef STBIW_CRC32
-    return STBIW_CRC32(buffer, len);
-#else
-   static unsigned int crc_table[256] =
    {
       0x00000000, 0x77073096, 0xEE0E612C, 0x990951BA, 0x076DC419, 0x706AF48F, 0xE963A535, 0x9E6495A3,
       0x0eDB8832, 0x79DCB8A4, 0xE0D5E91E, 0x97D2D988, 0x09B64C2B, 0x7EB17CBD, 0xE7B82D07, 0x90BF1D91,
@@ -1060,13 +1268,155 @@ static unsigned int stbiw__crc32(unsigned char *buffer, int len)
       0xAED16A4A, 0xD9D65ADC, 0x40DF0B66, 0x37D83BF0, 0xA9BCAE53, 0xDEBB9EC5, 0x47B2CF7F, 0x30B5FFE9,
       0xBDBDF21C, 0xCABAC28A, 0x53B39330, 0x24B4A3A6, 0xBAD03605, 0xCDD70693, 0x54DE5729, 0x23D967BF,
       0xB3667A2E, 0xC4614AB8, 0x5D681B02, 0x2A6F2B94, 0xB40BBE37, 0xC30C8EA1, 0x5A05DF1B, 0x2D02EF8D
-   };
+   }
+};
+
+#ifdef STBIW__CRC32_CLMUL
+static int stbiw__crc_clmul;
+#endif
+
+static void stbiw__crc32_init(void)
+{
+   int i, k;
+   for (k=1; k < 8; ++k)
+      for (i=0; i < 256; ++i) {
+         unsigned int c = stbiw__crc_table[k-1][i];
+         stbiw__crc_table[k][i] = (c >> 8) ^ stbiw__crc_table[0][c & 0xff];
+      }
+#ifdef STBIW__CRC32_CLMUL
+   __builtin_cpu_init();
+   stbiw__crc_clmul = __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1");
+#endif
+}
+
+#ifdef STBIW_USE_PTHREADS
+static pthread_once_t stbiw__crc_once = PTHREAD_ONCE_INIT;
+#define stbiw__crc32_setup()  pthread_once(&stbiw__crc_once, stbiw__crc32_init)
+#else
+static int stbiw__crc_ready;
+#define stbiw__crc32_setup()  (stbiw__crc_ready ? 0 : (stbiw__crc32_init(), stbiw__crc_ready = 1))
+#endif
 
+// crc is kept inverted, as between the ~ at the start and the end
+static unsigned int stbiw__crc32_slice8(unsigned int crc, unsigned char *buffer, int len)
+{
+   unsigned int (*t)[256] = stbiw__crc_table;
+   while (len >= 8) {
+      crc ^= buffer[0] | (buffer[1] << 8) | (buffer[2] << 16) | ((unsigned int) buffer[3] << 24);
+      crc = t[7][crc & 0xff] ^ t[6][(crc >> 8) & 0xff] ^ t[5][(crc >> 16) & 0xff] ^ t[4][crc >> 24]
+          ^ t[3][buffer[4]] ^ t[2][buffer[5]] ^ t[1][buffer[6]] ^ t[0][buffer[7]];
+      buffer += 8;
+      len -= 8;
+   }
+   while (len--)
+      crc = (crc >> 8) ^ t[0][*buffer++ ^ (crc & 0xff)];
+   return crc;
+}
+
+#ifdef STBIW__CRC32_CLMUL
+// folds 64 bytes per round with carry-less multiplies and reduces the last
+// 128 bits by Barrett, after "Fast CRC Computation for Generic Polynomials
+// Using PCLMULQDQ" (Gopal et al., Intel). len is a multiple of 16, >= 64
+__attribute__((target("pclmul,sse4.1")))
+static unsigned int stbiw__crc32_clmul(unsigned int crc, unsigned char *buffer, int len)
+{
+   __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+   const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596, 0x0154442bd4);
+   const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009e, 0x01751997d0);
+   const __m128i k5k0 = _mm_set_epi64x(0x0000000000, 0x0163cd6124);
+   const __m128i poly = _mm_set_epi64x(0x01f7011641, 0x01db710641);
+
+   x1 = _mm_loadu_si128((__m128i *) (buffer + 0x00));
+   x2 = _mm_loadu_si128((__m128i *) (buffer + 0x10));
+   x3 = _mm_loadu_si128((__m128i *) (buffer + 0x20));
+   x4 = _mm_loadu_si128((__m128i *) (buffer + 0x30));
+   x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int) crc));
+   x0 = k1k2;
+   buffer += 64;
+   len -= 64;
+
+   // fold four lanes in parallel
+   while (len >= 64) {
+      x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+      x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+      x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+      x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+      x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+      x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+      x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+      x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+      y5 = _mm_loadu_si128((__m128i *) (buffer + 0x00));
+      y6 = _mm_loadu_si128((__m128i *) (buffer + 0x10));
+      y7 = _mm_loadu_si128((__m128i *) (buffer + 0x20));
+      y8 = _mm_loadu_si128((__m128i *) (buffer + 0x30));
+      x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+      x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+      x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+      x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+      buffer += 64;
+      len -= 64;
+   }
+
+   // fold the lanes into one
+   x0 = k3k4;
+   x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+   x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+   x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+   x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+   x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+   x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+   x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+   x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+   x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+   while (len >= 16) {
+      x2 = _mm_loadu_si128((__m128i *) buffer);
+      x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+      x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+      x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+      buffer += 16;
+      len -= 16;
+   }
+
+   // 128 bits to 64
+   x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+   x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+   x1 = _mm_srli_si128(x1, 8);
+   x1 = _mm_xor_si128(x1, x2);
+   x0 = k5k0;
+   x2 = _mm_srli_si128(x1, 4);
+   x1 = _mm_and_si128(x1, x3);
+   x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+   x1 = _mm_xor_si128(x1, x2);
+
+   // Barrett reduction to 32 bits
+   x0 = poly;
+   x2 = _mm_and_si128(x1, x3);
+   x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+   x2 = _mm_and_si128(x2, x3);
+   x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+   x1 = _mm_xor_si128(x1, x2);
+   return (unsigned int) _mm_extract_epi32(x1, 1);
+}
+#endif // STBIW__CRC32_CLMUL
+#endif // STBIW_CRC32
+
+static unsigned int stbiw__crc32(unsigned char *buffer, int len)
+{
+#ifdef STBIW_CRC32
+    return STBIW_CRC32(buffer, len);
+#else
    unsigned int crc = ~0u;
-   int i;
-   for (i=0; i < len; ++i)
-      crc = (crc >> 8) ^ crc_table[buffer[i] ^ (crc & 0xff)];
-   return ~crc;
+   stbiw__crc32_setup();
+#ifdef STBIW__CRC32_CLMUL
+   if (stbiw__crc_clmul && len >= 64) {
+      int fold = len & ~15;
+      crc = stbiw__crc32_clmul(crc, buffer, fold);
+      buffer += fold;
+      len -= fold;
+   }
+#endif
+   return ~stbiw__crc32_slice8(crc, buffer, len);
 #endif
 }
 
@@ -1088,6 +1438,82 @@ static unsigned char stbiw__paeth(int a, int b, int c)
    return STBIW_UCHAR(c);
 }
 
+#ifdef STBIW__SSE2
+static __m128i stbiw__abs16_sse2(__m128i v)
+{
+   return _mm_max_epi16(v, _mm_sub_epi16(_mm_setzero_si128(), v));
+}
+
+// the same choice as stbiw__paeth on eight 16-bit lanes
+static __m128i stbiw__paeth_sse2(__m128i a, __m128i b, __m128i c)
+{
+   __m128i pa = _mm_sub_epi16(b, c), pb = _mm_sub_epi16(a, c);
+   __m128i pc = stbiw__abs16_sse2(_mm_add_epi16(pa, pb));
+   __m128i not_a, not_b, bc;
+   pa = stbiw__abs16_sse2(pa);
+   pb = stbiw__abs16_sse2(pb);
+   not_a = _mm_or_si128(_mm_cmpgt_epi16(pa, pb), _mm_cmpgt_epi16(pa, pc));
+   not_b = _mm_cmpgt_epi16(pb, pc);
+   bc = _mm_or_si128(_mm_and_si128(not_b, c), _mm_andnot_si128(not_b, b));
+   return _mm_or_si128(_mm_and_si128(not_a, bc), _mm_andnot_si128(not_a, a));
+}
+
+// filters 16 bytes at a time from i = n on and returns where the scalar
+// loop has to go on; the filters only read the unfiltered rows
+static int stbiw__encode_png_line_sse2(unsigned char *z, int signed_stride, int len, int n, int type, signed char *line_buffer)
+{
+   __m128i zero = _mm_setzero_si128(), one = _mm_set1_epi8(1);
+   int i = n;
+   if (type < 1 || type > 4) return i;
+   for (; i+16 <= len; i += 16) {
+      __m128i x = _mm_loadu_si128((__m128i *) (z+i)), a, b, c, pred;
+      switch (type) {
+         case 1:
+            pred = _mm_loadu_si128((__m128i *) (z+i-n));
+            break;
+         case 2:
+            pred = _mm_loadu_si128((__m128i *) (z+i-signed_stride));
+            break;
+         case 3:
+            a = _mm_loadu_si128((__m128i *) (z+i-n));
+            b = _mm_loadu_si128((__m128i *) (z+i-signed_stride));
+            // avg_epu8 rounds up, the filter rounds down
+            pred = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), one));
+            break;
+         default:
+            a = _mm_loadu_si128((__m128i *) (z+i-n));
+            b = _mm_loadu_si128((__m128i *) (z+i-signed_stride));
+            c = _mm_loadu_si128((__m128i *) (z+i-signed_stride-n));
+            pred = _mm_packus_epi16(
+               stbiw__paeth_sse2(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero), _mm_unpacklo_epi8(c, zero)),
+               stbiw__paeth_sse2(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero), _mm_unpackhi_epi8(c, zero)));
+            break;
+      }
+      _mm_storeu_si128((__m128i *) (line_buffer+i), _mm_sub_epi8(x, pred));
+   }
+   return i;
+}
+#endif // STBIW__SSE2
+
+// sum of absolute values of the filtered line; the less, the better
+static int stbiw__png_line_cost(signed char *line_buffer, int len)
+{
+   int i = 0, est = 0;
+#ifdef STBIW__SSE2
+   __m128i zero = _mm_setzero_si128(), sum = zero;
+   for (; i+16 <= len; i += 16) {
+      __m128i v = _mm_loadu_si128((__m128i *) (line_buffer+i));
+      // |v| of a signed byte is the smaller of v and -v seen unsigned
+      v = _mm_min_epu8(v, _mm_sub_epi8(zero, v));
+      sum = _mm_add_epi64(sum, _mm_sad_epu8(v, zero));
+   }
+   est = _mm_cvtsi128_si32(sum) + _mm_cvtsi128_si32(_mm_srli_si128(sum, 8));
+#endif
+   for (; i < len; ++i)
+      est += abs((signed char) line_buffer[i]);
+   return est;
+}
+
 // @OPTIMIZE: provide an option that always forces left-predict or paeth predict
 static void stbiw__encode_png_line(unsigned char *pixels, int stride_bytes, int width, int height, int y, int n, int filter_type, signed char *line_buffer)
 {
@@ -1115,49 +1541,43 @@ static void stbiw__encode_png_line(unsigned char *pixels, int stride_bytes, int
          case 6: line_buffer[i] = z[i]; break;
       }
    }
+#ifdef STBIW__SSE2
+   i = stbiw__encode_png_line_sse2(z, signed_stride, width*n, n, type, line_buffer);
+#else
+   i = n;
+#endif
    switch (type) {
-      case 1: for (i=n; i < width*n; ++i) line_buffer[i] = z[i] - z[i-n]; break;
-      case 2: for (i=n; i < width*n; ++i) line_buffer[i] = z[i] - z[i-signed_stride]; break;
-      case 3: for (i=n; i < width*n; ++i) line_buffer[i] = z[i] - ((z[i-n] + z[i-signed_stride])>>1); break;
-      case 4: for (i=n; i < width*n; ++i) line_buffer[i] = z[i] - stbiw__paeth(z[i-n], z[i-signed_stride], z[i-signed_stride-n]); break;
-      case 5: for (i=n; i < width*n; ++i) line_buffer[i] = z[i] - (z[i-n]>>1); break;
-      case 6: for (i=n; i < width*n; ++i) line_buffer[i] = z[i] - stbiw__paeth(z[i-n], 0,0); break;
+      case 1: for (; i < width*n; ++i) line_buffer[i] = z[i] - z[i-n]; break;
+      case 2: for (; i < width*n; ++i) line_buffer[i] = z[i] - z[i-signed_stride]; break;
+      case 3: for (; i < width*n; ++i) line_buffer[i] = z[i] - ((z[i-n] + z[i-signed_stride])>>1); break;
+      case 4: for (; i < width*n; ++i) line_buffer[i] = z[i] - stbiw__paeth(z[i-n], z[i-signed_stride], z[i-signed_stride-n]); break;
+      case 5: for (; i < width*n; ++i) line_buffer[i] = z[i] - (z[i-n]>>1); break;
+      case 6: for (; i < width*n; ++i) line_buffer[i] = z[i] - stbiw__paeth(z[i-n], 0,0); break;
    }
 }
 
-STBIWDEF unsigned char *stbi_write_png_to_mem(const unsigned char *pixels, int stride_bytes, int x, int y, int n, int *out_len)
+// filters rows start..end into filt. unless a filter is forced, every
+// stbi_write_png_filter_sample-th row from start on picks the filter with
+// the lowest cost and the rows in between reuse it
+static void stbiw__filter_png_rows(const unsigned char *pixels, int stride_bytes, int x, int y, int n, int force_filter, int start, int end, signed char *line_buffer, unsigned char *filt)
 {
-   int force_filter = stbi_write_force_png_filter;
-   int ctype[5] = { -1, 0, 4, 2, 6 };
-   unsigned char sig[8] = { 137,80,78,71,13,10,26,10 };
-   unsigned char *out,*o, *filt, *zlib;
-   signed char *line_buffer;
-   int j,zlen;
-
-   if (stride_bytes == 0)
-      stride_bytes = x * n;
-
-   if (force_filter >= 5) {
-      force_filter = -1;
-   }
-
-   filt = (unsigned char *) STBIW_MALLOC((x*n+1) * y); if (!filt) return 0;
-   line_buffer = (signed char *) STBIW_MALLOC(x * n); if (!line_buffer) { STBIW_FREE(filt); return 0; }
-   for (j=0; j < y; ++j) {
+   int sample = stbi_write_png_filter_sample > 1 ? stbi_write_png_filter_sample : 1;
+   int picked = 0, j;
+   for (j=start; j < end; ++j) {
       int filter_type;
       if (force_filter > -1) {
          filter_type = force_filter;
          stbiw__encode_png_line((unsigned char*)(pixels), stride_bytes, x, y, j, n, force_filter, line_buffer);
+      } else if ((j - start) % sample) {
+         filter_type = picked;
+         stbiw__encode_png_line((unsigned char*)(pixels), stride_bytes, x, y, j, n, filter_type, line_buffer);
       } else { // Estimate the best filter by running through all of them:
-         int best_filter = 0, best_filter_val = 0x7fffffff, est, i;
+         int best_filter = 0, best_filter_val = 0x7fffffff, est;
          for (filter_type = 0; filter_type < 5; filter_type++) {
             stbiw__encode_png_line((unsigned char*)(pixels), stride_bytes, x, y, j, n, filter_type, line_buffer);
 
             // Estimate the entropy of the line using this filter; the less, the better.
-            est = 0;
-            for (i = 0; i < x*n; ++i) {
-               est += abs((signed char) line_buffer[i]);
-            }
+            est = stbiw__png_line_cost(line_buffer, x*n);
             if (est < best_filter_val) {
                best_filter_val = est;
                best_filter = filter_type;
@@ -1167,11 +1587,218 @@ STBIWDEF unsigned char *stbi_write_png_to_mem(const unsigned char *pixels, int s
             stbiw__encode_png_line((unsigned char*)(pixels), stride_bytes, x, y, j, n, best_filter, line_buffer);
             filter_type = best_filter;
          }
+         picked = filter_type;
       }
       // when we get here, filter_type contains the filter type, and line_buffer contains the data
       filt[j*(x*n+1)] = (unsigned char) filter_type;
       STBIW_MEMMOVE(filt+j*(x*n+1)+1, line_buffer, x*n);
    }
+}
+
+#ifdef STBIW__PNG_THREADS
+// smallest amount of filtered bytes worth a piece of its own, the sync flush
+// and the chunk around every piece cost a few bytes and the lost matches more
+#define stbiw__PNG_PIECE  (128*1024)
+
+typedef struct
+{
+   const unsigned char *pixels;
+   unsigned char *filt;
+   int stride_bytes, x, y, n, force_filter;
+   int row_start, row_end, first, last, filtered;
+   unsigned char *idat;  // length, tag, zlib data and crc of this piece
+   unsigned int adler;
+} stbiw__png_piece;
+
+static void *stbiw__png_filter_piece(void *arg)
+{
+   stbiw__png_piece *p = (stbiw__png_piece *) arg;
+   signed char *line_buffer = (signed char *) STBIW_MALLOC(p->x * p->n);
+   if (!line_buffer) return NULL;
+   stbiw__filter_png_rows(p->pixels, p->stride_bytes, p->x, p->y, p->n, p->force_filter, p->row_start, p->row_end, line_buffer, p->filt);
+   STBIW_FREE(line_buffer);
+   p->filtered = 1;
+   return p;
+}
+
+static void *stbiw__png_deflate_piece(void *arg)
+{
+   stbiw__png_piece *p = (stbiw__png_piece *) arg;
+   int line = p->x * p->n + 1, len;
+   unsigned char *out = NULL;
+   unsigned int crc;
+
+   // the chunk length is patched in once the data is known
+   stbiw__sbpush(out, 0); stbiw__sbpush(out, 0); stbiw__sbpush(out, 0); stbiw__sbpush(out, 0);
+   stbiw__sbpush(out, 'I'); stbiw__sbpush(out, 'D'); stbiw__sbpush(out, 'A'); stbiw__sbpush(out, 'T');
+   if (p->first) {
+      stbiw__sbpush(out, 0x78);   // DEFLATE 32K window
+      stbiw__sbpush(out, 0x5e);   // FLEVEL = 1
+   }
+   out = stbiw__zlib_deflate_range(out, p->filt, p->row_start*line, p->row_end*line, stbi_write_png_compression_level, p->last);
+   if (!out) return NULL;
+   len = stbiw__sbn(out) - 8;
+   out[0] = STBIW_UCHAR(len >> 24); out[1] = STBIW_UCHAR(len >> 16);
+   out[2] = STBIW_UCHAR(len >> 8);  out[3] = STBIW_UCHAR(len);
+   crc = stbiw__crc32(out+4, len+4);
+   stbiw__sbpush(out, STBIW_UCHAR(crc >> 24)); stbiw__sbpush(out, STBIW_UCHAR(crc >> 16));
+   stbiw__sbpush(out, STBIW_UCHAR(crc >> 8));  stbiw__sbpush(out, STBIW_UCHAR(crc));
+   p->adler = stbiw__adler32(p->filt + p->row_start*line, (p->row_end - p->row_start)*line);
+   p->idat = out;
+   return p;
+}
+
+// runs fn on every piece, piece 0 on the calling thread and the others on
+// threads of their own; a piece whose thread can not be started runs here too
+static void stbiw__png_run(stbiw__png_piece *pieces, int count, void *(*fn)(void *))
+{
+   pthread_t threads[64];
+   int started[64];
+   int i;
+   for (i=1; i < count; ++i)
+      started[i] = pthread_create(&threads[i], NULL, fn, &pieces[i]) == 0;
+   fn(&pieces[0]);
+   for (i=1; i < count; ++i) {
+      if (started[i])
+         pthread_join(threads[i], NULL);
+      else
+         fn(&pieces[i]);
+   }
+}
+
+// same as adler32_combine() of zlib: the adler of a..b from those of a and b
+static unsigned int stbiw__adler32_combine(unsigned int adler1, unsigned int adler2, unsigned int len2)
+{
+   unsigned int rem = len2 % 65521;
+   unsigned int sum1 = adler1 & 0xffff;
+   unsigned int sum2 = (rem * sum1) % 65521;
+   sum1 += (adler2 & 0xffff) + 65521 - 1;
+   sum2 += (adler1 >> 16) + (adler2 >> 16) + 65521 - rem;
+   if (sum1 >= 65521) sum1 -= 65521;
+   if (sum1 >= 65521) sum1 -= 65521;
+   if (sum2 >= (65521 << 1)) sum2 -= (65521 << 1);
+   if (sum2 >= 65521) sum2 -= 65521;
+   return sum1 | (sum2 << 16);
+}
+
+// pigz style: every piece of rows is filtered, deflated and put into an IDAT
+// chunk on its own thread. the pieces end on a sync flush so they join into
+// one zlib stream, which the adler in the last chunk closes
+static unsigned char *stbiw__write_png_threaded(const unsigned char *pixels, int stride_bytes, int x, int y, int n, int force_filter, int count, unsigned char **idat_out, int *idat_len)
+{
+   stbiw__png_piece pieces[64];
+   unsigned char *filt, *idat, *o;
+   unsigned int adler;
+   int i, len, line = x*n+1, failed = 0;
+
+   filt = (unsigned char *) STBIW_MALLOC((size_t) line * y); if (!filt) return 0;
+   for (i=0; i < count; ++i) {
+      stbiw__png_piece *p = &pieces[i];
+      p->pixels = pixels;
+      p->filt = filt;
+      p->stride_bytes = stride_bytes;
+      p->x = x; p->y = y; p->n = n;
+      p->force_filter = force_filter;
+      p->row_start = (int) ((long long) y * i / count);
+      p->row_end = (int) ((long long) y * (i+1) / count);
+      p->first = i == 0;
+      p->last = i == count-1;
+      p->filtered = 0;
+      p->idat = NULL;
+   }
+   // a piece refers back into the rows of the one before, so every row has
+   // to be filtered before any piece is deflated
+   stbiw__png_run(pieces, count, stbiw__png_filter_piece);
+   for (i=0; i < count; ++i)
+      if (!pieces[i].filtered) failed = 1;
+   if (!failed)
+      stbiw__png_run(pieces, count, stbiw__png_deflate_piece);
+
+   len = 4+4+4+4; // the chunk with the adler
+   for (i=0; i < count; ++i) {
+      if (!pieces[i].idat) failed = 1;
+      else len += stbiw__sbn(pieces[i].idat);
+   }
+   idat = failed ? NULL : (unsigned char *) STBIW_MALLOC(len);
+   if (idat) {
+      adler = pieces[0].adler;
+      o = idat;
+      for (i=0; i < count; ++i) {
+         STBIW_MEMMOVE(o, pieces[i].idat, stbiw__sbn(pieces[i].idat));
+         o += stbiw__sbn(pieces[i].idat);
+         if (i)
+            adler = stbiw__adler32_combine(adler, pieces[i].adler, (pieces[i].row_end - pieces[i].row_start)*line);
+      }
+      stbiw__wp32(o, 4);
+      stbiw__wptag(o, "IDAT");
+      stbiw__wp32(o, adler);
+      stbiw__wpcrc(&o, 4);
+      *idat_out = idat;
+      *idat_len = len;
+   }
+   for (i=0; i < count; ++i)
+      (void) stbiw__sbfree(pieces[i].idat);
+   STBIW_FREE(filt);
+   return idat;
+}
+#endif // STBIW__PNG_THREADS
+
+STBIWDEF unsigned char *stbi_write_png_to_mem(const unsigned char *pixels, int stride_bytes, int x, int y, int n, int *out_len)
+{
+   int force_filter = stbi_write_force_png_filter;
+   int ctype[5] = { -1, 0, 4, 2, 6 };
+   unsigned char sig[8] = { 137,80,78,71,13,10,26,10 };
+   unsigned char *out,*o, *filt, *zlib;
+   signed char *line_buffer;
+   int zlen;
+
+   if (stride_bytes == 0)
+      stride_bytes = x * n;
+
+   if (force_filter >= 5) {
+      force_filter = -1;
+   }
+
+#ifdef STBIW__PNG_THREADS
+   {
+      int count = stbi_write_png_threads;
+      long long size = (long long) (x*n+1) * y;
+      if (count > 64) count = 64;
+      if (count > y) count = y;
+      if (count > size / stbiw__PNG_PIECE) count = (int) (size / stbiw__PNG_PIECE);
+      if (count > 1) {
+         unsigned char *idat;
+         int idat_len;
+         if (!stbiw__write_png_threaded(pixels, stride_bytes, x, y, n, force_filter, count, &idat, &idat_len)) return 0;
+         out = (unsigned char *) STBIW_MALLOC(8 + 12+13 + idat_len + 12);
+         if (!out) { STBIW_FREE(idat); return 0; }
+         *out_len = 8 + 12+13 + idat_len + 12;
+         o=out;
+         STBIW_MEMMOVE(o,sig,8); o+= 8;
+         stbiw__wp32(o, 13); // header length
+         stbiw__wptag(o, "IHDR");
+         stbiw__wp32(o, x);
+         stbiw__wp32(o, y);
+         *o++ = 8;
+         *o++ = STBIW_UCHAR(ctype[n]);
+         *o++ = 0;
+         *o++ = 0;
+         *o++ = 0;
+         stbiw__wpcrc(&o,13);
+         STBIW_MEMMOVE(o, idat, idat_len); o += idat_len;
+         STBIW_FREE(idat);
+         stbiw__wp32(o,0);
+         stbiw__wptag(o, "IEND");
+         stbiw__wpcrc(&o,0);
+         STBIW_ASSERT(o == out + *out_len);
+         return out;
+      }
+   }
+#endif
+
+   filt = (unsigned char *) STBIW_MALLOC((x*n+1) * y); if (!filt) return 0;
+   line_buffer = (signed char *) STBIW_MALLOC(x * n); if (!line_buffer) { STBIW_FREE(filt); return 0; }
+   stbiw__filter_png_rows(pixels, stride_bytes, x, y, n, force_filter, 0, y, line_buffer, filt);
    STBIW_FREE(line_buffer);
    zlib = stbi_zlib_compress(filt, y*( x*n+1), &zlen, stbi_write_png_compression_level);
    STBIW_FREE(filt);
@@ -1325,33 +1952,97 @@ static void stbiw__jpg_calcBits(int val, unsigned short bits[2]) {
    bits[0] = val & ((1<<bits[1])-1);
 }
 
-static int stbiw__jpg_processDU(stbi__write_context *s, int *bitBuf, int *bitCnt, float *CDU, int du_stride, float *fdtbl, int DC, const unsigned short HTDC[256][2], const unsigned short HTAC[256][2]) {
+// every pixel the same as the first one
+static int stbiw__jpg_isUniform(const unsigned char *data, int pixels, int comp) {
+   return pixels <= 1 || memcmp(data, data + comp, (size_t) (pixels-1) * comp) == 0;
+}
+
+// a block with the same value everywhere has no AC terms, and the DCT adds
+// the value to itself into a DC term of exactly 64 times it
+static int stbiw__jpg_isFlat(const float *CDU, int du_stride) {
+   float v = CDU[0];
+   int x, y;
+   for(y = 0; y < 8; ++y) {
+      for(x = 0; x < 8; ++x) {
+         if (CDU[y*du_stride+x] != v) return 0;
+      }
+   }
+   return 1;
+}
+
+static int stbiw__jpg_flatDC(float value, const float *fdtbl) {
+   float dc = value * 64;
+   float v = dc*fdtbl[0];
+   return (int)(v < 0 ? v - 0.5f : v + 0.5f);
+}
+
+// the codes of a flat block: its DC difference and the EOB, packed as far as
+// they fit into the 16 bits writeBits takes at a time
+static int stbiw__jpg_flatCodes(unsigned short codes[][2], int n, int diff, const unsigned short HTDC[256][2], const unsigned short HTAC[256][2]) {
+   unsigned short all[3][2];
+   int i, m = 0;
+   if (diff == 0) {
+      all[m][0] = HTDC[0][0]; all[m][1] = HTDC[0][1]; ++m;
+   } else {
+      unsigned short bits[2];
+      stbiw__jpg_calcBits(diff, bits);
+      all[m][0] = HTDC[bits[1]][0]; all[m][1] = HTDC[bits[1]][1]; ++m;
+      all[m][0] = bits[0]; all[m][1] = bits[1]; ++m;
+   }
+   all[m][0] = HTAC[0x00][0]; all[m][1] = HTAC[0x00][1]; ++m;
+   for (i = 0; i < m; ++i) {
+      if (n > 0 && codes[n-1][1] + all[i][1] <= 16) {
+         codes[n-1][0] = (unsigned short) ((codes[n-1][0] << all[i][1]) | all[i][0]);
+         codes[n-1][1] = (unsigned short) (codes[n-1][1] + all[i][1]);
+      } else {
+         codes[n][0] = all[i][0];
+         codes[n][1] = all[i][1];
+         ++n;
+      }
+   }
+   return n;
+}
+
+// keep != NULL stores the quantized block in zigzag order instead of encoding it
+static int stbiw__jpg_processDU(stbi__write_context *s, int *bitBuf, int *bitCnt, float *CDU, int du_stride, const float *fdtbl, int DC, const unsigned short HTDC[256][2], const unsigned short HTAC[256][2], short *keep) {
    const unsigned short EOB[2] = { HTAC[0x00][0], HTAC[0x00][1] };
    const unsigned short M16zeroes[2] = { HTAC[0xF0][0], HTAC[0xF0][1] };
    int dataOff, i, j, n, diff, end0pos, x, y;
    int DU[64];
 
-   // DCT rows
-   for(dataOff=0, n=du_stride*8; dataOff<n; dataOff+=du_stride) {
-      stbiw__jpg_DCT(&CDU[dataOff], &CDU[dataOff+1], &CDU[dataOff+2], &CDU[dataOff+3], &CDU[dataOff+4], &CDU[dataOff+5], &CDU[dataOff+6], &CDU[dataOff+7]);
-   }
-   // DCT columns
-   for(dataOff=0; dataOff<8; ++dataOff) {
-      stbiw__jpg_DCT(&CDU[dataOff], &CDU[dataOff+du_stride], &CDU[dataOff+du_stride*2], &CDU[dataOff+du_stride*3], &CDU[dataOff+du_stride*4],
-                     &CDU[dataOff+du_stride*5], &CDU[dataOff+du_stride*6], &CDU[dataOff+du_stride*7]);
-   }
-   // Quantize/descale/zigzag the coefficients
-   for(y = 0, j=0; y < 8; ++y) {
-      for(x = 0; x < 8; ++x,++j) {
-         float v;
-         i = y*du_stride+x;
-         v = CDU[i]*fdtbl[j];
-         // DU[stbiw__jpg_ZigZag[j]] = (int)(v < 0 ? ceilf(v - 0.5f) : floorf(v + 0.5f));
-         // ceilf() and floorf() are C99, not C89, but I /think/ they're not needed here anyway?
-         DU[stbiw__jpg_ZigZag[j]] = (int)(v < 0 ? v - 0.5f : v + 0.5f);
+   if (stbiw__jpg_isFlat(CDU, du_stride)) {
+      // same result as the DCT below, without it
+      memset(DU, 0, sizeof(DU));
+      DU[0] = stbiw__jpg_flatDC(CDU[0], fdtbl);
+   } else {
+      // DCT rows
+      for(dataOff=0, n=du_stride*8; dataOff<n; dataOff+=du_stride) {
+         stbiw__jpg_DCT(&CDU[dataOff], &CDU[dataOff+1], &CDU[dataOff+2], &CDU[dataOff+3], &CDU[dataOff+4], &CDU[dataOff+5], &CDU[dataOff+6], &CDU[dataOff+7]);
+      }
+      // DCT columns
+      for(dataOff=0; dataOff<8; ++dataOff) {
+         stbiw__jpg_DCT(&CDU[dataOff], &CDU[dataOff+du_stride], &CDU[dataOff+du_stride*2], &CDU[dataOff+du_stride*3], &CDU[dataOff+du_stride*4],
+                        &CDU[dataOff+du_stride*5], &CDU[dataOff+du_stride*6], &CDU[dataOff+du_stride*7]);
+      }
+      // Quantize/descale/zigzag the coefficients
+      for(y = 0, j=0; y < 8; ++y) {
+         for(x = 0; x < 8; ++x,++j) {
+            float v;
+            i = y*du_stride+x;
+            v = CDU[i]*fdtbl[j];
+            // DU[stbiw__jpg_ZigZag[j]] = (int)(v < 0 ? ceilf(v - 0.5f) : floorf(v + 0.5f));
+            // ceilf() and floorf() are C99, not C89, but I /think/ they're not needed here anyway?
+            DU[stbiw__jpg_ZigZag[j]] = (int)(v < 0 ? v - 0.5f : v + 0.5f);
+         }
       }
    }
 
+   if (keep) {
+      for (i = 0; i < 64; ++i)
+         keep[i] = (short) DU[i];
+      return DU[0];
+   }
+
    // Encode DC
    diff = DU[0] - DC;
    if (diff == 0) {
@@ -1395,32 +2086,452 @@ static int stbiw__jpg_processDU(stbi__write_context *s, int *bitBuf, int *bitCnt
    return DU[0];
 }
 
-static int stbi_write_jpg_core(stbi__write_context *s, int width, int height, int comp, const void* data, int quality) {
-   // Constants that don't pollute global namespace
-   static const unsigned char std_dc_luminance_nrcodes[] = {0,0,1,5,1,1,1,1,1,1,0,0,0,0,0,0,0};
-   static const unsigned char std_dc_luminance_values[] = {0,1,2,3,4,5,6,7,8,9,10,11};
-   static const unsigned char std_ac_luminance_nrcodes[] = {0,0,2,1,3,3,2,4,3,5,5,4,4,0,0,1,0x7d};
-   static const unsigned char std_ac_luminance_values[] = {
-      0x01,0x02,0x03,0x00,0x04,0x11,0x05,0x12,0x21,0x31,0x41,0x06,0x13,0x51,0x61,0x07,0x22,0x71,0x14,0x32,0x81,0x91,0xa1,0x08,
-      0x23,0x42,0xb1,0xc1,0x15,0x52,0xd1,0xf0,0x24,0x33,0x62,0x72,0x82,0x09,0x0a,0x16,0x17,0x18,0x19,0x1a,0x25,0x26,0x27,0x28,
-      0x29,0x2a,0x34,0x35,0x36,0x37,0x38,0x39,0x3a,0x43,0x44,0x45,0x46,0x47,0x48,0x49,0x4a,0x53,0x54,0x55,0x56,0x57,0x58,0x59,
-      0x5a,0x63,0x64,0x65,0x66,0x67,0x68,0x69,0x6a,0x73,0x74,0x75,0x76,0x77,0x78,0x79,0x7a,0x83,0x84,0x85,0x86,0x87,0x88,0x89,
-      0x8a,0x92,0x93,0x94,0x95,0x96,0x97,0x98,0x99,0x9a,0xa2,0xa3,0xa4,0xa5,0xa6,0xa7,0xa8,0xa9,0xaa,0xb2,0xb3,0xb4,0xb5,0xb6,
-      0xb7,0xb8,0xb9,0xba,0xc2,0xc3,0xc4,0xc5,0xc6,0xc7,0xc8,0xc9,0xca,0xd2,0xd3,0xd4,0xd5,0xd6,0xd7,0xd8,0xd9,0xda,0xe1,0xe2,
-      0xe3,0xe4,0xe5,0xe6,0xe7,0xe8,0xe9,0xea,0xf1,0xf2,0xf3,0xf4,0xf5,0xf6,0xf7,0xf8,0xf9,0xfa
-   };
-   static const unsigned char std_dc_chrominance_nrcodes[] = {0,0,3,1,1,1,1,1,1,1,1,1,0,0,0,0,0};
-   static const unsigned char std_dc_chrominance_values[] = {0,1,2,3,4,5,6,7,8,9,10,11};
-   static const unsigned char std_ac_chrominance_nrcodes[] = {0,0,2,1,2,4,4,3,4,7,5,4,4,0,1,2,0x77};
-   static const unsigned char std_ac_chrominance_values[] = {
-      0x00,0x01,0x02,0x03,0x11,0x04,0x05,0x21,0x31,0x06,0x12,0x41,0x51,0x07,0x61,0x71,0x13,0x22,0x32,0x81,0x08,0x14,0x42,0x91,
-      0xa1,0xb1,0xc1,0x09,0x23,0x33,0x52,0xf0,0x15,0x62,0x72,0xd1,0x0a,0x16,0x24,0x34,0xe1,0x25,0xf1,0x17,0x18,0x19,0x1a,0x26,
-      0x27,0x28,0x29,0x2a,0x35,0x36,0x37,0x38,0x39,0x3a,0x43,0x44,0x45,0x46,0x47,0x48,0x49,0x4a,0x53,0x54,0x55,0x56,0x57,0x58,
-      0x59,0x5a,0x63,0x64,0x65,0x66,0x67,0x68,0x69,0x6a,0x73,0x74,0x75,0x76,0x77,0x78,0x79,0x7a,0x82,0x83,0x84,0x85,0x86,0x87,
-      0x88,0x89,0x8a,0x92,0x93,0x94,0x95,0x96,0x97,0x98,0x99,0x9a,0xa2,0xa3,0xa4,0xa5,0xa6,0xa7,0xa8,0xa9,0xaa,0xb2,0xb3,0xb4,
-      0xb5,0xb6,0xb7,0xb8,0xb9,0xba,0xc2,0xc3,0xc4,0xc5,0xc6,0xc7,0xc8,0xc9,0xca,0xd2,0xd3,0xd4,0xd5,0xd6,0xd7,0xd8,0xd9,0xda,
-      0xe2,0xe3,0xe4,0xe5,0xe6,0xe7,0xe8,0xe9,0xea,0xf2,0xf3,0xf4,0xf5,0xf6,0xf7,0xf8,0xf9,0xfa
-   };
+// stored coefficients are entropy coded in scans, after the progressive
+// Huffman encoder of libjpeg (jcphuff.c). a scan can also just count the
+// symbols it would write, which is what optimized tables are built from
+typedef struct
+{
+   short *coefs;     // 64 per block in zigzag order, rows include the MCU padding
+   int stride;       // blocks per row of coefs
+   int bw, bh;       // blocks of the component itself, what non-interleaved scans cover
+   int h, v;         // blocks per MCU
+   const unsigned short (*HTDC)[2], (*HTAC)[2];
+   unsigned int *freqDC, *freqAC;
+} stbiw__jpg_comp;
+
+typedef struct
+{
+   stbi__write_context *s;
+   int bitBuf, bitCnt;
+   const unsigned short (*HTDC)[2], (*HTAC)[2];
+   unsigned int *freqDC, *freqAC;  // counted instead of written when not NULL
+   int eobrun, eobmax;     // blocks ending in zeros that are not announced yet
+   int nbe;
+   unsigned char be[1024]; // correction bits that go out after the EOB run
+} stbiw__jpg_scan;
+
+static void stbiw__jpg_scanBits(stbiw__jpg_scan *sc, int value, int n) {
+   unsigned short bits[2];
+   if (sc->freqAC) return;
+   bits[0] = (unsigned short) (value & ((1 << n) - 1));
+   bits[1] = (unsigned short) n;
+   stbiw__jpg_writeBits(sc->s, &sc->bitBuf, &sc->bitCnt, bits);
+}
+
+static void stbiw__jpg_scanDC(stbiw__jpg_scan *sc, int symbol) {
+   if (sc->freqDC) ++sc->freqDC[symbol];
+   else stbiw__jpg_writeBits(sc->s, &sc->bitBuf, &sc->bitCnt, sc->HTDC[symbol]);
+}
+
+static void stbiw__jpg_scanAC(stbiw__jpg_scan *sc, int symbol) {
+   if (sc->freqAC) ++sc->freqAC[symbol];
+   else stbiw__jpg_writeBits(sc->s, &sc->bitBuf, &sc->bitCnt, sc->HTAC[symbol]);
+}
+
+// floor(v / 2^al), the point transform of DC terms
+static int stbiw__jpg_shift(int v, int al) {
+   return v < 0 ? -((-v + (1 << al) - 1) >> al) : v >> al;
+}
+
+static void stbiw__jpg_emitEOBRun(stbiw__jpg_scan *sc) {
+   int nbits = 0, i;
+   if (sc->eobrun == 0) return;
+   while (sc->eobrun >> (nbits+1)) ++nbits;
+   stbiw__jpg_scanAC(sc, nbits << 4);
+   if (nbits) stbiw__jpg_scanBits(sc, sc->eobrun, nbits);
+   sc->eobrun = 0;
+   for (i = 0; i < sc->nbe; ++i)
+      stbiw__jpg_scanBits(sc, sc->be[i], 1);
+   sc->nbe = 0;
+}
+
+static void stbiw__jpg_endEOBRun(stbiw__jpg_scan *sc) {
+   ++sc->eobrun;
+   if (sc->eobrun == sc->eobmax || sc->nbe > (int) sizeof(sc->be) - 64)
+      stbiw__jpg_emitEOBRun(sc);
+}
+
+static int stbiw__jpg_DCfirst(stbiw__jpg_scan *sc, short *du, int DC, int al) {
+   int v = stbiw__jpg_shift(du[0], al), diff = v - DC;
+   if (diff == 0) {
+      stbiw__jpg_scanDC(sc, 0);
+   } else {
+      unsigned short bits[2];
+      stbiw__jpg_calcBits(diff, bits);
+      stbiw__jpg_scanDC(sc, bits[1]);
+      stbiw__jpg_scanBits(sc, bits[0], bits[1]);
+   }
+   return v;
+}
+
+static void stbiw__jpg_ACfirst(stbiw__jpg_scan *sc, short *du, int ss, int se, int al) {
+   int k, r = 0;
+   for (k = ss; k <= se; ++k) {
+      int v = du[k] < 0 ? -(-du[k] >> al) : du[k] >> al;
+      unsigned short bits[2];
+      if (v == 0) {
+         ++r;
+         continue;
+      }
+      stbiw__jpg_emitEOBRun(sc);
+      for (; r > 15; r -= 16)
+         stbiw__jpg_scanAC(sc, 0xF0);
+      stbiw__jpg_calcBits(v, bits);
+      stbiw__jpg_scanAC(sc, (r << 4) + bits[1]);
+      stbiw__jpg_scanBits(sc, bits[0], bits[1]);
+      r = 0;
+   }
+   if (r > 0)
+      stbiw__jpg_endEOBRun(sc);
+}
+
+// coefficients that were already nonzero get one more bit of their value,
+// those that become nonzero (magnitude 1 now) are coded like in a first scan
+static void stbiw__jpg_ACrefine(stbiw__jpg_scan *sc, short *du, int ss, int se, int al) {
+   int absv[64], k, eob = 0, r = 0, brs = sc->nbe, br = 0, i;
+   for (k = ss; k <= se; ++k) {
+      absv[k] = (du[k] < 0 ? -du[k] : du[k]) >> al;
+      if (absv[k] == 1) eob = k;
+   }
+   for (k = ss; k <= se; ++k) {
+      if (absv[k] == 0) {
+         ++r;
+         continue;
+      }
+      // zero runs after the last new coefficient are folded into the EOB
+      while (r > 15 && k <= eob) {
+         stbiw__jpg_emitEOBRun(sc);
+         stbiw__jpg_scanAC(sc, 0xF0);
+         r -= 16;
+         for (i = 0; i < br; ++i)
+            stbiw__jpg_scanBits(sc, sc->be[brs+i], 1);
+         brs = br = 0;
+      }
+      if (absv[k] > 1) {
+         sc->be[brs + br++] = (unsigned char) (absv[k] & 1);
+         continue;
+      }
+      stbiw__jpg_emitEOBRun(sc);
+      stbiw__jpg_scanAC(sc, (r << 4) + 1);
+      stbiw__jpg_scanBits(sc, du[k] < 0 ? 0 : 1, 1);
+      for (i = 0; i < br; ++i)
+         stbiw__jpg_scanBits(sc, sc->be[brs+i], 1);
+      brs = br = 0;
+      r = 0;
+   }
+   sc->nbe = brs + br;
+   if (r > 0 || br > 0)
+      stbiw__jpg_endEOBRun(sc);
+}
+
+// component (3 = all interleaved), first and last coefficient, previous and new point transform
+static const unsigned char stbiw__jpg_sequential[1][5] = {
+   { 3, 0, 63, 0, 0 }
+};
+
+// the simple progression of libjpeg
+static const unsigned char stbiw__jpg_progression[10][5] = {
+   { 3, 0,  0, 0, 1 },
+   { 0, 1,  5, 0, 2 },
+   { 2, 1, 63, 0, 1 },
+   { 1, 1, 63, 0, 1 },
+   { 0, 6, 63, 0, 2 },
+   { 0, 1, 63, 2, 1 },
+   { 3, 0,  0, 1, 0 },
+   { 2, 1, 63, 1, 0 },
+   { 1, 1, 63, 1, 0 },
+   { 0, 1, 63, 1, 0 }
+};
+
+// the same for a grey image, which has only the luma scans
+static const unsigned char stbiw__jpg_greyProgression[6][5] = {
+   { 3, 0,  0, 0, 1 },
+   { 0, 1,  5, 0, 2 },
+   { 0, 6, 63, 0, 2 },
+   { 0, 1, 63, 2, 1 },
+   { 3, 0,  0, 1, 0 },
+   { 0, 1, 63, 1, 0 }
+};
+
+static void stbiw__jpg_writeScans(stbi__write_context *s, stbiw__jpg_comp *comps, int ncomp, int mcux, int mcuy, const unsigned char (*script)[5], int nscans, int eobmax, int count) {
+   static const unsigned short fillBits[] = {0x7F, 7};
+   int n, c, x, y, bx, by;
+   for (n = 0; n < nscans; ++n) {
+      int cs = script[n][0], ss = script[n][1], se = script[n][2], ah = script[n][3], al = script[n][4];
+      stbiw__jpg_scan sc;
+      sc.s = s;
+      sc.bitBuf = sc.bitCnt = 0;
+      sc.eobrun = sc.nbe = 0;
+      sc.eobmax = eobmax;
+
+      if (!count) {
+         stbiw__putc(s, 0xFF);
+         stbiw__putc(s, 0xDA);
+         stbiw__putc(s, 0);
+         if (cs == 3) {
+            stbiw__putc(s, STBIW_UCHAR(6 + 2*ncomp));
+            stbiw__putc(s, STBIW_UCHAR(ncomp));
+            for (c = 0; c < ncomp; ++c) {
+               stbiw__putc(s, STBIW_UCHAR(c+1));
+               stbiw__putc(s, c ? 0x11 : 0);
+            }
+         } else {
+            stbiw__putc(s, 8);
+            stbiw__putc(s, 1);
+            stbiw__putc(s, STBIW_UCHAR(cs+1));
+            stbiw__putc(s, cs ? 0x11 : 0);
+         }
+         stbiw__putc(s, STBIW_UCHAR(ss));
+         stbiw__putc(s, STBIW_UCHAR(se));
+         stbiw__putc(s, STBIW_UCHAR((ah << 4) | al));
+      }
+
+      if (cs == 3) {
+         // interleaved scans go MCU by MCU; a sequential one codes whole blocks
+         int DC[3] = { 0, 0, 0 };
+         for (y = 0; y < mcuy; ++y) {
+            for (x = 0; x < mcux; ++x) {
+               for (c = 0; c < ncomp; ++c) {
+                  stbiw__jpg_comp *p = &comps[c];
+                  sc.HTDC = p->HTDC;
+                  sc.HTAC = p->HTAC;
+                  sc.freqDC = count ? p->freqDC : NULL;
+                  sc.freqAC = count ? p->freqAC : NULL;
+                  for (by = 0; by < p->v; ++by) {
+                     for (bx = 0; bx < p->h; ++bx) {
+                        short *du = p->coefs + 64*((y*p->v+by)*p->stride + x*p->h+bx);
+                        if (ah != 0) {
+                           stbiw__jpg_scanBits(&sc, stbiw__jpg_shift(du[0], al), 1);
+                           continue;
+                        }
+                        DC[c] = stbiw__jpg_DCfirst(&sc, du, DC[c], al);
+                        if (se > 0)
+                           stbiw__jpg_ACfirst(&sc, du, 1, se, al);
+                     }
+                  }
+               }
+            }
+         }
+      } else {
+         stbiw__jpg_comp *p = &comps[cs];
+         sc.HTDC = p->HTDC;
+         sc.HTAC = p->HTAC;
+         sc.freqDC = count ? p->freqDC : NULL;
+         sc.freqAC = count ? p->freqAC : NULL;
+         for (by = 0; by < p->bh; ++by) {
+            for (bx = 0; bx < p->bw; ++bx) {
+               short *du = p->coefs + 64*(by*p->stride + bx);
+               if (ah == 0)
+                  stbiw__jpg_ACfirst(&sc, du, ss, se, al);
+               else
+                  stbiw__jpg_ACrefine(&sc, du, ss, se, al);
+            }
+         }
+         stbiw__jpg_emitEOBRun(&sc);
+      }
+      // every scan ends on a byte boundary
+      if (!count)
+         stbiw__jpg_writeBits(s, &sc.bitBuf, &sc.bitCnt, fillBits);
+   }
+}
+
+// optimal code lengths limited to 16 bits from the symbol counts (Annex K.2 of
+// the JPEG standard, as in libjpeg), as the counts per length and the symbols
+// in code order of a DHT, and the codes themselves
+static int stbiw__jpg_optimalTable(unsigned int freq[257], unsigned char bits[17], unsigned char values[256], unsigned short HT[256][2]) {
+   int codesize[257], others[257], counts[33];
+   int i, j, k, code, used = 0;
+   for (i = 0; i < 257; ++i) {
+      codesize[i] = 0;
+      others[i] = -1;
+      used += freq[i] != 0;
+   }
+   for (i = 0; i < 33; ++i)
+      counts[i] = 0;
+   if (!used) freq[0] = 1;  // a table nobody uses still has to be valid
+   freq[256] = 1;           // reserved, so no code is all ones
+   for (;;) {
+      int c1 = -1, c2 = -1;
+      unsigned int v = 0xffffffff;
+      for (i = 0; i <= 256; ++i)
+         if (freq[i] && freq[i] <= v) { v = freq[i]; c1 = i; }
+      v = 0xffffffff;
+      for (i = 0; i <= 256; ++i)
+         if (freq[i] && freq[i] <= v && i != c1) { v = freq[i]; c2 = i; }
+      if (c2 < 0) break;
+      freq[c1] += freq[c2];
+      freq[c2] = 0;
+      ++codesize[c1];
+      while (others[c1] >= 0) { c1 = others[c1]; ++codesize[c1]; }
+      others[c1] = c2;
+      ++codesize[c2];
+      while (others[c2] >= 0) { c2 = others[c2]; ++codesize[c2]; }
+   }
+   for (i = 0; i <= 256; ++i)
+      if (codesize[i]) ++counts[codesize[i] > 32 ? 32 : codesize[i]];
+   for (i = 32; i > 16; --i) {
+      while (counts[i] > 0) {
+         j = i - 2;
+         while (counts[j] == 0) --j;
+         counts[i] -= 2;
+         counts[i-1]++;
+         counts[j+1] += 2;
+         counts[j]--;
+      }
+   }
+   for (i = 16; counts[i] == 0; --i);
+   counts[i]--;   // drop the reserved code
+   for (i = 0, k = 0; i <= 32; ++i)
+      for (j = 0; j < 256; ++j)
+         if (codesize[j] == i && i) values[k++] = (unsigned char) j;
+   bits[0] = 0;
+   for (i = 1; i <= 16; ++i)
+      bits[i] = (unsigned char) counts[i];
+   for (i = 1, k = 0, code = 0; i <= 16; ++i, code <<= 1) {
+      for (j = 0; j < bits[i]; ++j, ++k, ++code) {
+         HT[values[k]][0] = (unsigned short) code;
+         HT[values[k]][1] = (unsigned short) i;
+      }
+   }
+   return k;
+}
+
+// SOI, JFIF, DQT, SOF and the Huffman tables, a grey image (ncomp 1) has only the luma ones
+static void stbiw__jpg_writeHeaders(stbi__write_context *s, int width, int height, int ncomp, int subsample, int progressive,
+                                    const unsigned char *YTable, const unsigned char *UVTable,
+                                    const unsigned char *bits[4], const unsigned char *values[4], const int nvalues[4]) {
+   static const unsigned char tableIds[4] = { 0x00, 0x10, 0x01, 0x11 };
+   const unsigned char head0[] = { 0xFF,0xD8,0xFF,0xE0,0,0x10,'J','F','I','F',0,1,1,0,0,1,0,1,0,0,0xFF,0xDB,0,(unsigned char)(ncomp==3?0x84:0x43),0 };
+   const unsigned char head1[] = { 0xFF,(unsigned char)(progressive?0xC2:0xC0),0,STBIW_UCHAR(8+3*ncomp),8,(unsigned char)(height>>8),STBIW_UCHAR(height),(unsigned char)(width>>8),STBIW_UCHAR(width),
+                                   STBIW_UCHAR(ncomp),1,(unsigned char)(subsample?0x22:0x11),0,2,0x11,1,3,0x11,1 };
+   int i, ntables = ncomp == 3 ? 4 : 2, length = 2;
+   for (i = 0; i < ntables; ++i)
+      length += 1 + 16 + nvalues[i];
+   s->func(s->context, (void*)head0, sizeof(head0));
+   s->func(s->context, (void*)YTable, 64);
+   if (ncomp == 3) {
+      stbiw__putc(s, 1);
+      s->func(s->context, (void*)UVTable, 64);
+   }
+   s->func(s->context, (void*)head1, 10 + 3*ncomp);
+   stbiw__putc(s, 0xFF);
+   stbiw__putc(s, 0xC4);
+   stbiw__putc(s, STBIW_UCHAR(length >> 8));
+   stbiw__putc(s, STBIW_UCHAR(length));
+   for (i = 0; i < ntables; ++i) {
+      stbiw__putc(s, tableIds[i]);
+      s->func(s->context, (void*)(bits[i]+1), 16);
+      s->func(s->context, (void*)values[i], nvalues[i]);
+   }
+}
+
+static const unsigned char stbiw__jpg_std_dc_luminance_nrcodes[] = {0,0,1,5,1,1,1,1,1,1,0,0,0,0,0,0,0};
+static const unsigned char stbiw__jpg_std_dc_luminance_values[] = {0,1,2,3,4,5,6,7,8,9,10,11};
+static const unsigned char stbiw__jpg_std_ac_luminance_nrcodes[] = {0,0,2,1,3,3,2,4,3,5,5,4,4,0,0,1,0x7d};
+static const unsigned char stbiw__jpg_std_ac_luminance_values[] = {
+   0x01,0x02,0x03,0x00,0x04,0x11,0x05,0x12,0x21,0x31,0x41,0x06,0x13,0x51,0x61,0x07,0x22,0x71,0x14,0x32,0x81,0x91,0xa1,0x08,
+   0x23,0x42,0xb1,0xc1,0x15,0x52,0xd1,0xf0,0x24,0x33,0x62,0x72,0x82,0x09,0x0a,0x16,0x17,0x18,0x19,0x1a,0x25,0x26,0x27,0x28,
+   0x29,0x2a,0x34,0x35,0x36,0x37,0x38,0x39,0x3a,0x43,0x44,0x45,0x46,0x47,0x48,0x49,0x4a,0x53,0x54,0x55,0x56,0x57,0x58,0x59,
+   0x5a,0x63,0x64,0x65,0x66,0x67,0x68,0x69,0x6a,0x73,0x74,0x75,0x76,0x77,0x78,0x79,0x7a,0x83,0x84,0x85,0x86,0x87,0x88,0x89,
+   0x8a,0x92,0x93,0x94,0x95,0x96,0x97,0x98,0x99,0x9a,0xa2,0xa3,0xa4,0xa5,0xa6,0xa7,0xa8,0xa9,0xaa,0xb2,0xb3,0xb4,0xb5,0xb6,
+   0xb7,0xb8,0xb9,0xba,0xc2,0xc3,0xc4,0xc5,0xc6,0xc7,0xc8,0xc9,0xca,0xd2,0xd3,0xd4,0xd5,0xd6,0xd7,0xd8,0xd9,0xda,0xe1,0xe2,
+   0xe3,0xe4,0xe5,0xe6,0xe7,0xe8,0xe9,0xea,0xf1,0xf2,0xf3,0xf4,0xf5,0xf6,0xf7,0xf8,0xf9,0xfa
+};
+static const unsigned char stbiw__jpg_std_dc_chrominance_nrcodes[] = {0,0,3,1,1,1,1,1,1,1,1,1,0,0,0,0,0};
+static const unsigned char stbiw__jpg_std_dc_chrominance_values[] = {0,1,2,3,4,5,6,7,8,9,10,11};
+static const unsigned char stbiw__jpg_std_ac_chrominance_nrcodes[] = {0,0,2,1,2,4,4,3,4,7,5,4,4,0,1,2,0x77};
+static const unsigned char stbiw__jpg_std_ac_chrominance_values[] = {
+   0x00,0x01,0x02,0x03,0x11,0x04,0x05,0x21,0x31,0x06,0x12,0x41,0x51,0x07,0x61,0x71,0x13,0x22,0x32,0x81,0x08,0x14,0x42,0x91,
+   0xa1,0xb1,0xc1,0x09,0x23,0x33,0x52,0xf0,0x15,0x62,0x72,0xd1,0x0a,0x16,0x24,0x34,0xe1,0x25,0xf1,0x17,0x18,0x19,0x1a,0x26,
+   0x27,0x28,0x29,0x2a,0x35,0x36,0x37,0x38,0x39,0x3a,0x43,0x44,0x45,0x46,0x47,0x48,0x49,0x4a,0x53,0x54,0x55,0x56,0x57,0x58,
+   0x59,0x5a,0x63,0x64,0x65,0x66,0x67,0x68,0x69,0x6a,0x73,0x74,0x75,0x76,0x77,0x78,0x79,0x7a,0x82,0x83,0x84,0x85,0x86,0x87,
+   0x88,0x89,0x8a,0x92,0x93,0x94,0x95,0x96,0x97,0x98,0x99,0x9a,0xa2,0xa3,0xa4,0xa5,0xa6,0xa7,0xa8,0xa9,0xaa,0xb2,0xb3,0xb4,
+   0xb5,0xb6,0xb7,0xb8,0xb9,0xba,0xc2,0xc3,0xc4,0xc5,0xc6,0xc7,0xc8,0xc9,0xca,0xd2,0xd3,0xd4,0xd5,0xd6,0xd7,0xd8,0xd9,0xda,
+   0xe2,0xe3,0xe4,0xe5,0xe6,0xe7,0xe8,0xe9,0xea,0xf2,0xf3,0xf4,0xf5,0xf6,0xf7,0xf8,0xf9,0xfa
+};
+
+// SOI, JFIF and the DQT marker come before the tables, the height is 5 bytes into SOF
+#define STBIW__JPG_SOF(ncomp)  (25 + 64 + ((ncomp) == 3 ? 65 : 0) + 5)
+// the baseline header of a colour image up to its scan is 609 bytes
+#define STBIW__JPG_HEAD        640
+
+struct stbi_write_jpg_encoder {
+   int subsample;
+   unsigned char YTable[64], UVTable[64];
+   float fdtbl_Y[64], fdtbl_UV[64];
+   // baseline headers with the standard Huffman tables up to the scan, grey [0] and
+   // colour [1], built without the image size, which is written in at STBIW__JPG_SOF;
+   // a length of 0 means the header was not built
+   unsigned char head[2][STBIW__JPG_HEAD];
+   int headLen[2];
+};
+
+typedef struct {
+   unsigned char *data;
+   int len;
+} stbiw__jpg_head;
+
+static void stbiw__jpg_headWrite(void *context, void *data, int size) {
+   stbiw__jpg_head *h = (stbiw__jpg_head *) context;
+   STBIW_ASSERT(h->len + size <= STBIW__JPG_HEAD);
+   STBIW_MEMMOVE(h->data + h->len, data, size);
+   h->len += size;
+}
+
+static void stbiw__jpg_initEncoder(stbi_write_jpg_encoder *e, int quality) {
+   static const int YQT[] = {16,11,10,16,24,40,51,61,12,12,14,19,26,58,60,55,14,13,16,24,40,57,69,56,14,17,22,29,51,87,80,62,18,22,
+                             37,56,68,109,103,77,24,35,55,64,81,104,113,92,49,64,78,87,103,121,120,101,72,92,95,98,112,100,103,99};
+   static const int UVQT[] = {17,18,24,47,99,99,99,99,18,21,26,66,99,99,99,99,24,26,56,99,99,99,99,99,47,66,99,99,99,99,99,99,
+                              99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99};
+   static const float aasf[] = { 1.0f * 2.828427125f, 1.387039845f * 2.828427125f, 1.306562965f * 2.828427125f, 1.175875602f * 2.828427125f,
+                                 1.0f * 2.828427125f, 0.785694958f * 2.828427125f, 0.541196100f * 2.828427125f, 0.275899379f * 2.828427125f };
+
+   int row, col, i, k;
+
+   quality = quality ? quality : 90;
+   // colour only, grey images are never subsampled
+   e->subsample = quality <= 90 ? 1 : 0;
+   quality = quality < 1 ? 1 : quality > 100 ? 100 : quality;
+   quality = quality < 50 ? 5000 / quality : 200 - quality * 2;
+
+   for(i = 0; i < 64; ++i) {
+      int uvti, yti = (YQT[i]*quality+50)/100;
+      e->YTable[stbiw__jpg_ZigZag[i]] = (unsigned char) (yti < 1 ? 1 : yti > 255 ? 255 : yti);
+      uvti = (UVQT[i]*quality+50)/100;
+      e->UVTable[stbiw__jpg_ZigZag[i]] = (unsigned char) (uvti < 1 ? 1 : uvti > 255 ? 255 : uvti);
+   }
+
+   for(row = 0, k = 0; row < 8; ++row) {
+      for(col = 0; col < 8; ++col, ++k) {
+         e->fdtbl_Y[k]  = 1 / (e->YTable [stbiw__jpg_ZigZag[k]] * aasf[row] * aasf[col]);
+         e->fdtbl_UV[k] = 1 / (e->UVTable[stbiw__jpg_ZigZag[k]] * aasf[row] * aasf[col]);
+      }
+   }
+
+   e->headLen[0] = e->headLen[1] = 0;
+}
+
+// the baseline header of grey (colour 0) or colour images, the tables have to be set
+static void stbiw__jpg_buildHead(stbi_write_jpg_encoder *e, int colour) {
+   static const unsigned char head2[] = { 0xFF,0xDA,0,0xC,3,1,0,2,0x11,3,0x11,0,0x3F,0 };
+   static const unsigned char greyHead2[] = { 0xFF,0xDA,0,0x8,1,1,0,0,0x3F,0 };
+   const unsigned char *bits[4] = { stbiw__jpg_std_dc_luminance_nrcodes, stbiw__jpg_std_ac_luminance_nrcodes, stbiw__jpg_std_dc_chrominance_nrcodes, stbiw__jpg_std_ac_chrominance_nrcodes };
+   const unsigned char *values[4] = { stbiw__jpg_std_dc_luminance_values, stbiw__jpg_std_ac_luminance_values, stbiw__jpg_std_dc_chrominance_values, stbiw__jpg_std_ac_chrominance_values };
+   const int nvalues[4] = { sizeof(stbiw__jpg_std_dc_luminance_values), sizeof(stbiw__jpg_std_ac_luminance_values), sizeof(stbiw__jpg_std_dc_chrominance_values), sizeof(stbiw__jpg_std_ac_chrominance_values) };
+   stbiw__jpg_head h;
+   stbi__write_context s = { 0 };
+   h.data = e->head[colour];
+   h.len = 0;
+   stbi__start_write_callbacks(&s, stbiw__jpg_headWrite, &h);
+   stbiw__jpg_writeHeaders(&s, 0, 0, colour ? 3 : 1, colour ? e->subsample : 0, 0, e->YTable, e->UVTable, bits, values, nvalues);
+   if (colour)
+      s.func(s.context, (void*)head2, sizeof(head2));
+   else
+      s.func(s.context, (void*)greyHead2, sizeof(greyHead2));
+   e->headLen[colour] = h.len;
+}
+
+static int stbiw__jpg_encode(stbi__write_context *s, const stbi_write_jpg_encoder *e, int width, int height, int comp, const void* data) {
    // Huffman tables
    static const unsigned short YDC_HT[256][2] = { {0,2},{2,3},{3,3},{4,3},{5,3},{6,3},{14,4},{30,5},{62,6},{126,7},{254,8},{510,9}};
    static const unsigned short UVDC_HT[256][2] = { {0,2},{1,2},{2,2},{6,3},{14,4},{30,5},{62,6},{126,7},{254,8},{510,9},{1022,10},{2046,11}};
@@ -1460,65 +2571,60 @@ static int stbi_write_jpg_core(stbi__write_context *s, int width, int height, in
       {16352,14},{65517,16},{65518,16},{65519,16},{65520,16},{65521,16},{65522,16},{65523,16},{65524,16},{65525,16},{0,0},{0,0},{0,0},{0,0},{0,0},
       {1018,10},{32707,15},{65526,16},{65527,16},{65528,16},{65529,16},{65530,16},{65531,16},{65532,16},{65533,16},{65534,16},{0,0},{0,0},{0,0},{0,0},{0,0}
    };
-   static const int YQT[] = {16,11,10,16,24,40,51,61,12,12,14,19,26,58,60,55,14,13,16,24,40,57,69,56,14,17,22,29,51,87,80,62,18,22,
-                             37,56,68,109,103,77,24,35,55,64,81,104,113,92,49,64,78,87,103,121,120,101,72,92,95,98,112,100,103,99};
-   static const int UVQT[] = {17,18,24,47,99,99,99,99,18,21,26,66,99,99,99,99,24,26,56,99,99,99,99,99,47,66,99,99,99,99,99,99,
-                              99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99};
-   static const float aasf[] = { 1.0f * 2.828427125f, 1.387039845f * 2.828427125f, 1.306562965f * 2.828427125f, 1.175875602f * 2.828427125f,
-                                 1.0f * 2.828427125f, 0.785694958f * 2.828427125f, 0.541196100f * 2.828427125f, 0.275899379f * 2.828427125f };
-
-   int row, col, i, k, subsample;
-   float fdtbl_Y[64], fdtbl_UV[64];
-   unsigned char YTable[64], UVTable[64];
+   int row, col, i, ncomp, subsample, mcux, mcuy;
+   const float *fdtbl_Y = e->fdtbl_Y, *fdtbl_UV = e->fdtbl_UV;
+   short *coefs = NULL;
+   stbiw__jpg_comp comps[3];
+   const unsigned char *bits[4] = { stbiw__jpg_std_dc_luminance_nrcodes, stbiw__jpg_std_ac_luminance_nrcodes, stbiw__jpg_std_dc_chrominance_nrcodes, stbiw__jpg_std_ac_chrominance_nrcodes };
+   const unsigned char *values[4] = { stbiw__jpg_std_dc_luminance_values, stbiw__jpg_std_ac_luminance_values, stbiw__jpg_std_dc_chrominance_values, stbiw__jpg_std_ac_chrominance_values };
+   int nvalues[4] = { sizeof(stbiw__jpg_std_dc_luminance_values), sizeof(stbiw__jpg_std_ac_luminance_values), sizeof(stbiw__jpg_std_dc_chrominance_values), sizeof(stbiw__jpg_std_ac_chrominance_values) };
 
    if(!data || !width || !height || comp > 4 || comp < 1) {
       return 0;
    }
 
-   quality = quality ? quality : 90;
-   subsample = quality <= 90 ? 1 : 0;
-   quality = quality < 1 ? 1 : quality > 100 ? 100 : quality;
-   quality = quality < 50 ? 5000 / quality : 200 - quality * 2;
-
-   for(i = 0; i < 64; ++i) {
-      int uvti, yti = (YQT[i]*quality+50)/100;
-      YTable[stbiw__jpg_ZigZag[i]] = (unsigned char) (yti < 1 ? 1 : yti > 255 ? 255 : yti);
-      uvti = (UVQT[i]*quality+50)/100;
-      UVTable[stbiw__jpg_ZigZag[i]] = (unsigned char) (uvti < 1 ? 1 : uvti > 255 ? 255 : uvti);
-   }
-
-   for(row = 0, k = 0; row < 8; ++row) {
-      for(col = 0; col < 8; ++col, ++k) {
-         fdtbl_Y[k]  = 1 / (YTable [stbiw__jpg_ZigZag[k]] * aasf[row] * aasf[col]);
-         fdtbl_UV[k] = 1 / (UVTable[stbiw__jpg_ZigZag[k]] * aasf[row] * aasf[col]);
+   // grey and grey+alpha are written with the luma component only
+   ncomp = comp > 2 ? 3 : 1;
+   subsample = ncomp == 3 ? e->subsample : 0;
+
+   mcux = subsample ? (width+15)/16 : (width+7)/8;
+   mcuy = subsample ? (height+15)/16 : (height+7)/8;
+   if (stbi_write_jpg_progressive || stbi_write_jpg_optimize) {
+      // keep the coefficients of every block, the scans are written at the end
+      int ymul = subsample ? 2 : 1;
+      size_t blocks = (size_t) mcux*mcuy * (ymul*ymul + ncomp - 1);
+      coefs = (short *) STBIW_MALLOC(blocks * 64 * sizeof(short));
+      if (!coefs) return 0;
+      for (i = 0; i < ncomp; ++i) {
+         comps[i].h = comps[i].v = i ? 1 : ymul;
+         comps[i].stride = mcux * comps[i].h;
+         comps[i].bw = i ? mcux : (width+7)/8;
+         comps[i].bh = i ? mcuy : (height+7)/8;
+         comps[i].HTDC = i ? UVDC_HT : YDC_HT;
+         comps[i].HTAC = i ? UVAC_HT : YAC_HT;
       }
+      comps[0].coefs = coefs;
+      comps[1].coefs = coefs + (size_t) 64*mcux*mcuy*ymul*ymul;
+      comps[2].coefs = comps[1].coefs + (size_t) 64*mcux*mcuy;
    }
 
-   // Write Headers
-   {
-      static const unsigned char head0[] = { 0xFF,0xD8,0xFF,0xE0,0,0x10,'J','F','I','F',0,1,1,0,0,1,0,1,0,0,0xFF,0xDB,0,0x84,0 };
-      static const unsigned char head2[] = { 0xFF,0xDA,0,0xC,3,1,0,2,0x11,3,0x11,0,0x3F,0 };
-      const unsigned char head1[] = { 0xFF,0xC0,0,0x11,8,(unsigned char)(height>>8),STBIW_UCHAR(height),(unsigned char)(width>>8),STBIW_UCHAR(width),
-                                      3,1,(unsigned char)(subsample?0x22:0x11),0,2,0x11,1,3,0x11,1,0xFF,0xC4,0x01,0xA2,0 };
-      s->func(s->context, (void*)head0, sizeof(head0));
-      s->func(s->context, (void*)YTable, sizeof(YTable));
-      stbiw__putc(s, 1);
-      s->func(s->context, UVTable, sizeof(UVTable));
-      s->func(s->context, (void*)head1, sizeof(head1));
-      s->func(s->context, (void*)(std_dc_luminance_nrcodes+1), sizeof(std_dc_luminance_nrcodes)-1);
-      s->func(s->context, (void*)std_dc_luminance_values, sizeof(std_dc_luminance_values));
-      stbiw__putc(s, 0x10); // HTYACinfo
-      s->func(s->context, (void*)(std_ac_luminance_nrcodes+1), sizeof(std_ac_luminance_nrcodes)-1);
-      s->func(s->context, (void*)std_ac_luminance_values, sizeof(std_ac_luminance_values));
-      stbiw__putc(s, 1); // HTUDCinfo
-      s->func(s->context, (void*)(std_dc_chrominance_nrcodes+1), sizeof(std_dc_chrominance_nrcodes)-1);
-      s->func(s->context, (void*)std_dc_chrominance_values, sizeof(std_dc_chrominance_values));
-      stbiw__putc(s, 0x11); // HTUACinfo
-      s->func(s->context, (void*)(std_ac_chrominance_nrcodes+1), sizeof(std_ac_chrominance_nrcodes)-1);
-      s->func(s->context, (void*)std_ac_chrominance_values, sizeof(std_ac_chrominance_values));
-      s->func(s->context, (void*)head2, sizeof(head2));
+   if (!coefs) {
+      // the prebuilt header with the size of this image
+      const unsigned char *head = e->head[ncomp == 3];
+      unsigned char size[4];
+      int sof = STBIW__JPG_SOF(ncomp);
+      size[0] = (unsigned char)(height>>8);
+      size[1] = STBIW_UCHAR(height);
+      size[2] = (unsigned char)(width>>8);
+      size[3] = STBIW_UCHAR(width);
+      STBIW_ASSERT(e->headLen[ncomp == 3] != 0);
+      s->func(s->context, (void*)head, sof);
+      s->func(s->context, size, 4);
+      s->func(s->context, (void*)(head + sof + 4), e->headLen[ncomp == 3] - sof - 4);
    }
 
+#define stbiw__jpg_keep(c,bx,by)  (coefs ? comps[c].coefs + 64*((by)*comps[c].stride + (bx)) : NULL)
+
    // Encode 8x8 macroblocks
    {
       static const unsigned short fillBits[] = {0x7F, 7};
@@ -1530,7 +2636,64 @@ static int stbi_write_jpg_core(stbi__write_context *s, int width, int height, in
       const unsigned char *dataG = dataR + ofsG;
       const unsigned char *dataB = dataR + ofsB;
       int x, y, pos;
-      if(subsample) {
+      if(stbiw__jpg_isUniform(dataR, width*height, comp)) {
+         // one colour: every block is flat, only the first block of each component
+         // has a DC difference and all other MCUs are the same few codes
+         float r = dataR[0], g = dataG[0], b = dataB[0];
+         float Yv = ncomp == 3 ? +0.29900f*r + 0.58700f*g + 0.11400f*b - 128 : r - 128;
+         float Uv = -0.16874f*r - 0.33126f*g + 0.50000f*b;
+         float Vv = +0.50000f*r - 0.41869f*g - 0.08131f*b;
+         int ny = subsample ? 4 : 1, nmcu = mcux*mcuy;
+         if (subsample) {
+            Uv = (Uv + Uv + Uv + Uv) * 0.25f;
+            Vv = (Vv + Vv + Vv + Vv) * 0.25f;
+         }
+         DCY = stbiw__jpg_flatDC(Yv, fdtbl_Y);
+         DCU = stbiw__jpg_flatDC(Uv, fdtbl_UV);
+         DCV = stbiw__jpg_flatDC(Vv, fdtbl_UV);
+         if (coefs) {
+            size_t blocks = (size_t) nmcu * (ny + ncomp - 1), n;
+            memset(coefs, 0, blocks * 64 * sizeof(short));
+            for (n = 0; n < blocks; ++n)
+               coefs[n*64] = (short) (n < (size_t) nmcu*ny ? DCY : n < (size_t) nmcu*(ny+1) ? DCU : DCV);
+         } else {
+            unsigned short first[18][2], rest[18][2];
+            int nfirst = 0, nrest = 0;
+            for (i = 0; i < ny; ++i) {
+               nfirst = stbiw__jpg_flatCodes(first, nfirst, i ? 0 : DCY, YDC_HT, YAC_HT);
+               nrest = stbiw__jpg_flatCodes(rest, nrest, 0, YDC_HT, YAC_HT);
+            }
+            if (ncomp == 3) {
+               nfirst = stbiw__jpg_flatCodes(first, nfirst, DCU, UVDC_HT, UVAC_HT);
+               nfirst = stbiw__jpg_flatCodes(first, nfirst, DCV, UVDC_HT, UVAC_HT);
+               for (i = 0; i < 2; ++i)
+                  nrest = stbiw__jpg_flatCodes(rest, nrest, 0, UVDC_HT, UVAC_HT);
+            }
+            for (i = 0; i < nfirst; ++i)
+               stbiw__jpg_writeBits(s, &bitBuf, &bitCnt, first[i]);
+            for (pos = 1; pos < nmcu; ++pos)
+               for (i = 0; i < nrest; ++i)
+                  stbiw__jpg_writeBits(s, &bitBuf, &bitCnt, rest[i]);
+         }
+      } else if(ncomp == 1) {
+         for(y = 0; y < height; y += 8) {
+            for(x = 0; x < width; x += 8) {
+               float Y[64];
+               for(row = y, pos = 0; row < y+8; ++row) {
+                  // row >= height => use last input row
+                  int clamped_row = (row < height) ? row : height - 1;
+                  int base_p = (stbi__flip_vertically_on_write ? (height-1-clamped_row) : clamped_row)*width*comp;
+                  for(col = x; col < x+8; ++col, ++pos) {
+                     // if col >= width => use pixel from last input column
+                     int p = base_p + ((col < width) ? col : (width-1))*comp;
+                     Y[pos]= dataR[p] - 128.0f;
+                  }
+               }
+
+               DCY = stbiw__jpg_processDU(s, &bitBuf, &bitCnt, Y, 8, fdtbl_Y, DCY, YDC_HT, YAC_HT, stbiw__jpg_keep(0, x/8, y/8));
+            }
+         }
+      } else if(subsample) {
          for(y = 0; y < height; y += 16) {
             for(x = 0; x < width; x += 16) {
                float Y[256], U[256], V[256];
@@ -1547,10 +2710,10 @@ static int stbi_write_jpg_core(stbi__write_context *s, int width, int height, in
                      V[pos]= +0.50000f*r - 0.41869f*g - 0.08131f*b;
                   }
                }
-               DCY = stbiw__jpg_processDU(s, &bitBuf, &bitCnt, Y+0,   16, fdtbl_Y, DCY, YDC_HT, YAC_HT);
-               DCY = stbiw__jpg_processDU(s, &bitBuf, &bitCnt, Y+8,   16, fdtbl_Y, DCY, YDC_HT, YAC_HT);
-               DCY = stbiw__jpg_processDU(s, &bitBuf, &bitCnt, Y+128, 16, fdtbl_Y, DCY, YDC_HT, YAC_HT);
-               DCY = stbiw__jpg_processDU(s, &bitBuf, &bitCnt, Y+136, 16, fdtbl_Y, DCY, YDC_HT, YAC_HT);
+               DCY = stbiw__jpg_processDU(s, &bitBuf, &bitCnt, Y+0,   16, fdtbl_Y, DCY, YDC_HT, YAC_HT, stbiw__jpg_keep(0, x/8,   y/8));
+               DCY = stbiw__jpg_processDU(s, &bitBuf, &bitCnt, Y+8,   16, fdtbl_Y, DCY, YDC_HT, YAC_HT, stbiw__jpg_keep(0, x/8+1, y/8));
+               DCY = stbiw__jpg_processDU(s, &bitBuf, &bitCnt, Y+128, 16, fdtbl_Y, DCY, YDC_HT, YAC_HT, stbiw__jpg_keep(0, x/8,   y/8+1));
+               DCY = stbiw__jpg_processDU(s, &bitBuf, &bitCnt, Y+136, 16, fdtbl_Y, DCY, YDC_HT, YAC_HT, stbiw__jpg_keep(0, x/8+1, y/8+1));
 
                // subsample U,V
                {
@@ -1563,8 +2726,8 @@ static int stbi_write_jpg_core(stbi__write_context *s, int width, int height, in
                         subV[pos] = (V[j+0] + V[j+1] + V[j+16] + V[j+17]) * 0.25f;
                      }
                   }
-                  DCU = stbiw__jpg_processDU(s, &bitBuf, &bitCnt, subU, 8, fdtbl_UV, DCU, UVDC_HT, UVAC_HT);
-                  DCV = stbiw__jpg_processDU(s, &bitBuf, &bitCnt, subV, 8, fdtbl_UV, DCV, UVDC_HT, UVAC_HT);
+                  DCU = stbiw__jpg_processDU(s, &bitBuf, &bitCnt, subU, 8, fdtbl_UV, DCU, UVDC_HT, UVAC_HT, stbiw__jpg_keep(1, x/16, y/16));
+                  DCV = stbiw__jpg_processDU(s, &bitBuf, &bitCnt, subV, 8, fdtbl_UV, DCV, UVDC_HT, UVAC_HT, stbiw__jpg_keep(2, x/16, y/16));
                }
             }
          }
@@ -1586,9 +2749,9 @@ static int stbi_write_jpg_core(stbi__write_context *s, int width, int height, in
                   }
                }
 
-               DCY = stbiw__jpg_processDU(s, &bitBuf, &bitCnt, Y, 8, fdtbl_Y,  DCY, YDC_HT, YAC_HT);
-               DCU = stbiw__jpg_processDU(s, &bitBuf, &bitCnt, U, 8, fdtbl_UV, DCU, UVDC_HT, UVAC_HT);
-               DCV = stbiw__jpg_processDU(s, &bitBuf, &bitCnt, V, 8, fdtbl_UV, DCV, UVDC_HT, UVAC_HT);
+               DCY = stbiw__jpg_processDU(s, &bitBuf, &bitCnt, Y, 8, fdtbl_Y,  DCY, YDC_HT, YAC_HT, stbiw__jpg_keep(0, x/8, y/8));
+               DCU = stbiw__jpg_processDU(s, &bitBuf, &bitCnt, U, 8, fdtbl_UV, DCU, UVDC_HT, UVAC_HT, stbiw__jpg_keep(1, x/8, y/8));
+               DCV = stbiw__jpg_processDU(s, &bitBuf, &bitCnt, V, 8, fdtbl_UV, DCV, UVDC_HT, UVAC_HT, stbiw__jpg_keep(2, x/8, y/8));
             }
          }
       }
@@ -1596,6 +2759,41 @@ static int stbi_write_jpg_core(stbi__write_context *s, int width, int height, in
       // Do the bit alignment of the EOI marker
       stbiw__jpg_writeBits(s, &bitBuf, &bitCnt, fillBits);
    }
+#undef stbiw__jpg_keep
+
+   if (coefs) {
+      const unsigned char (*script)[5] = !stbi_write_jpg_progressive ? stbiw__jpg_sequential : ncomp == 3 ? stbiw__jpg_progression : stbiw__jpg_greyProgression;
+      int nscans = !stbi_write_jpg_progressive ? 1 : ncomp == 3 ? 10 : 6;
+      int ntables = ncomp == 3 ? 4 : 2;
+      // the standard AC tables have no codes for runs of EOBs, every block ends on its own
+      int eobmax = 1;
+      unsigned int freq[4][257];
+      unsigned char optbits[4][17], optvalues[4][256];
+      unsigned short optHT[4][256][2];
+      if (stbi_write_jpg_optimize) {
+         // a first pass over the scans only counts symbols, the tables are built from that
+         memset(freq, 0, sizeof(freq));
+         for (i = 0; i < ncomp; ++i) {
+            comps[i].freqDC = freq[i ? 2 : 0];
+            comps[i].freqAC = freq[i ? 3 : 1];
+         }
+         if (stbi_write_jpg_progressive) eobmax = 0x7FFF;
+         stbiw__jpg_writeScans(s, comps, ncomp, mcux, mcuy, script, nscans, eobmax, 1);
+         for (i = 0; i < ntables; ++i) {
+            memset(optHT[i], 0, sizeof(optHT[i]));
+            nvalues[i] = stbiw__jpg_optimalTable(freq[i], optbits[i], optvalues[i], optHT[i]);
+            bits[i] = optbits[i];
+            values[i] = optvalues[i];
+         }
+         for (i = 0; i < ncomp; ++i) {
+            comps[i].HTDC = (const unsigned short (*)[2]) optHT[i ? 2 : 0];
+            comps[i].HTAC = (const unsigned short (*)[2]) optHT[i ? 3 : 1];
+         }
+      }
+      stbiw__jpg_writeHeaders(s, width, height, ncomp, subsample, stbi_write_jpg_progressive, e->YTable, e->UVTable, bits, values, nvalues);
+      stbiw__jpg_writeScans(s, comps, ncomp, mcux, mcuy, script, nscans, eobmax, 0);
+      STBIW_FREE(coefs);
+   }
 
    // EOI
    stbiw__putc(s, 0xFF);
@@ -1604,6 +2802,38 @@ static int stbi_write_jpg_core(stbi__write_context *s, int width, int height, in
    return 1;
 }
 
+static int stbi_write_jpg_core(stbi__write_context *s, int width, int height, int comp, const void* data, int quality) {
+   // a single image only needs the header of its own kind, and only for a baseline JPEG
+   stbi_write_jpg_encoder e;
+   stbiw__jpg_initEncoder(&e, quality);
+   if (!stbi_write_jpg_progressive && !stbi_write_jpg_optimize)
+      stbiw__jpg_buildHead(&e, comp > 2);
+   return stbiw__jpg_encode(s, &e, width, height, comp, data);
+}
+
+STBIWDEF stbi_write_jpg_encoder *stbi_write_jpg_encoder_create(int quality)
+{
+   stbi_write_jpg_encoder *e = (stbi_write_jpg_encoder *) STBIW_MALLOC(sizeof(*e));
+   if (e) {
+      stbiw__jpg_initEncoder(e, quality);
+      stbiw__jpg_buildHead(e, 0);
+      stbiw__jpg_buildHead(e, 1);
+   }
+   return e;
+}
+
+STBIWDEF int stbi_write_jpg_encode_to_func(const stbi_write_jpg_encoder *encoder, stbi_write_func *func, void *context, int x, int y, int comp, const void *data)
+{
+   stbi__write_context s = { 0 };
+   stbi__start_write_callbacks(&s, func, context);
+   return stbiw__jpg_encode(&s, encoder, x, y, comp, (void *) data);
+}
+
+STBIWDEF void stbi_write_jpg_encoder_free(stbi_write_jpg_encoder *encoder)
+{
+   STBIW_FREE(encoder);
+}
+
 STBIWDEF int stbi_write_jpg_to_func(stbi_write_func *func, void *context, int x, int y, int comp, const void *data, int quality)
 {
    stbi__write_context s = { 0 };
@@ -1625,6 +2855,125 @@ STBIWDEF int stbi_write_jpg(char const *filename, int x, int y, int comp, const
 }
 #endif
 
+/* ***************************************************************************
+ *
+ * QOI writer
+ *
+ * "Quite OK Image Format", see https://qoiformat.org/qoi-specification.pdf
+ */
+
+#define STBIW__QOI_OP_INDEX  0x00
+#define STBIW__QOI_OP_DIFF   0x40
+#define STBIW__QOI_OP_LUMA   0x80
+#define STBIW__QOI_OP_RUN    0xc0
+#define STBIW__QOI_OP_RGB    0xfe
+#define STBIW__QOI_OP_RGBA   0xff
+#define stbiw__qoi_hash(p)   (((p)[0]*3 + (p)[1]*5 + (p)[2]*7 + (p)[3]*11) & 63)
+
+static int stbi_write_qoi_core(stbi__write_context *s, int width, int height, int comp, const void *data)
+{
+   static const unsigned char padding[8] = { 0,0,0,0,0,0,0,1 };
+   unsigned char index[64][4];
+   unsigned char px[4] = { 0,0,0,255 }, prev[4] = { 0,0,0,255 };
+   unsigned char buffer[4096];
+   int channels = comp == 2 || comp == 4 ? 4 : 3;
+   int x, y, i, n = 0, run = 0;
+
+   if (!data || width <= 0 || height <= 0 || comp < 1 || comp > 4)
+      return 0;
+
+   memset(index, 0, sizeof(index));
+   buffer[n++] = 'q'; buffer[n++] = 'o'; buffer[n++] = 'i'; buffer[n++] = 'f';
+   for (i = 24; i >= 0; i -= 8) buffer[n++] = STBIW_UCHAR(width >> i);
+   for (i = 24; i >= 0; i -= 8) buffer[n++] = STBIW_UCHAR(height >> i);
+   buffer[n++] = (unsigned char) channels;
+   buffer[n++] = 0; // sRGB with linear alpha
+
+   for (y = 0; y < height; ++y) {
+      int row = stbi__flip_vertically_on_write ? height-1-y : y;
+      const unsigned char *d = (const unsigned char *) data + (size_t) row * width * comp;
+      for (x = 0; x < width; ++x, d += comp) {
+         // worst case is a pending run followed by an RGBA op
+         if (n > (int) sizeof(buffer) - 6) {
+            s->func(s->context, buffer, n);
+            n = 0;
+         }
+         if (comp >= 3) {
+            px[0] = d[0]; px[1] = d[1]; px[2] = d[2];
+         } else {
+            px[0] = px[1] = px[2] = d[0];
+         }
+         if (comp == 2 || comp == 4) px[3] = d[comp-1];
+
+         if (px[0] == prev[0] && px[1] == prev[1] && px[2] == prev[2] && px[3] == prev[3]) {
+            if (++run == 62) {
+               buffer[n++] = STBIW__QOI_OP_RUN | (run - 1);
+               run = 0;
+            }
+            continue;
+         }
+         if (run) {
+            buffer[n++] = STBIW_UCHAR(STBIW__QOI_OP_RUN | (run - 1));
+            run = 0;
+         }
+
+         {
+            int h = stbiw__qoi_hash(px);
+            if (index[h][0] == px[0] && index[h][1] == px[1] && index[h][2] == px[2] && index[h][3] == px[3]) {
+               buffer[n++] = STBIW_UCHAR(STBIW__QOI_OP_INDEX | h);
+            } else {
+               memcpy(index[h], px, 4);
+               if (px[3] == prev[3]) {
+                  signed char vr = (signed char) (px[0] - prev[0]);
+                  signed char vg = (signed char) (px[1] - prev[1]);
+                  signed char vb = (signed char) (px[2] - prev[2]);
+                  signed char vg_r = (signed char) (vr - vg);
+                  signed char vg_b = (signed char) (vb - vg);
+                  if (vr > -3 && vr < 2 && vg > -3 && vg < 2 && vb > -3 && vb < 2) {
+                     buffer[n++] = STBIW_UCHAR(STBIW__QOI_OP_DIFF | (vr + 2) << 4 | (vg + 2) << 2 | (vb + 2));
+                  } else if (vg_r > -9 && vg_r < 8 && vg > -33 && vg < 32 && vg_b > -9 && vg_b < 8) {
+                     buffer[n++] = STBIW_UCHAR(STBIW__QOI_OP_LUMA | (vg + 32));
+                     buffer[n++] = STBIW_UCHAR((vg_r + 8) << 4 | (vg_b + 8));
+                  } else {
+                     buffer[n++] = STBIW__QOI_OP_RGB;
+                     buffer[n++] = px[0]; buffer[n++] = px[1]; buffer[n++] = px[2];
+                  }
+               } else {
+                  buffer[n++] = STBIW__QOI_OP_RGBA;
+                  buffer[n++] = px[0]; buffer[n++] = px[1]; buffer[n++] = px[2]; buffer[n++] = px[3];
+               }
+            }
+         }
+         memcpy(prev, px, 4);
+      }
+   }
+   if (run)
+      buffer[n++] = STBIW_UCHAR(STBIW__QOI_OP_RUN | (run - 1));
+   s->func(s->context, buffer, n);
+   s->func(s->context, (void *) padding, sizeof(padding));
+   return 1;
+}
+
+STBIWDEF int stbi_write_qoi_to_func(stbi_write_func *func, void *context, int x, int y, int comp, const void *data)
+{
+   stbi__write_context s = { 0 };
+   stbi__start_write_callbacks(&s, func, context);
+   return stbi_write_qoi_core(&s, x, y, comp, data);
+}
+
+#ifndef STBI_WRITE_NO_STDIO
+STBIWDEF int stbi_write_qoi(char const *filename, int x, int y, int comp, const void *data)
+{
+   stbi__write_context s = { 0 };
+   if (stbi__start_write_file(&s,filename)) {
+      int r = stbi_write_qoi_core(&s, x, y, comp, data);
+      stbi__end_write_file(&s);
+      return r;
+   } else
+      return 0;
+}
+#endif
+
 #endif // STB_IMAGE_WRITE_IMPLEMENTATION
 
 /* Revision history
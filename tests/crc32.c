@@ -0,0 +1,116 @@
+// CRC32 OF PNG CHUNKS
+/* checks the slicing-by-8 and the PCLMULQDQ paths of
+stbiw__crc32 bit for bit against the byte table loop it
+replaced and against zlib, over every length up to a few
+blocks and every misalignment of the buffer. with "bench"
+it times the three paths on a large buffer instead */
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#define STBIW_USE_PTHREADS
+#include "../stb_image_write.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <zlib.h>
+
+#define LENGTHS 4200
+#define OFFSETS 16
+#define BENCH ((size_t)4 << 20)
+#define ROUNDS 64
+
+// the loop before slicing-by-8, one table lookup per byte
+unsigned int crc32_bytes(const unsigned char *buffer, const size_t len){
+    unsigned int crc = ~0u;
+    for (size_t i = 0; i < len; ++i){
+        crc = (crc >> 8) ^ stbiw__crc_table[0][buffer[i] ^ (crc & 0xff)];
+    }
+    return ~crc;
+}
+
+unsigned int crc32_slice8(unsigned char *buffer, const int len){
+    return ~stbiw__crc32_slice8(~0u, buffer, len);
+}
+
+double seconds(void){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+void fill(unsigned char *buffer, const size_t size){
+    uint32_t state = 2463534242u;
+    for (size_t i = 0; i < size; ++i){
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        buffer[i] = (unsigned char)state;
+    }
+}
+
+int check(void){
+    unsigned char *buffer = malloc(LENGTHS + OFFSETS);
+    if (buffer == NULL){ return 1; }
+    fill(buffer, LENGTHS + OFFSETS);
+    size_t failures = 0, checks = 0;
+    for (int offset = 0; offset < OFFSETS; ++offset){
+        for (int len = 0; len <= LENGTHS; ++len){
+            unsigned char *data = buffer + offset;
+            const unsigned int expected = crc32_bytes(data, (size_t)len);
+            const unsigned int slice8 = crc32_slice8(data, len);
+            // clmul when the CPU has it, the tail and short buffers by slicing-by-8
+            const unsigned int chosen = stbiw__crc32(data, len);
+            const unsigned int zlib = (unsigned int)crc32(0, data, (uInt)len);
+            if (slice8 != expected || chosen != expected || zlib != expected){
+                if (failures < 10){
+                    fprintf(stderr, "length %d at offset %d: bytes %08x, slicing-by-8 %08x, "
+                            "stbiw__crc32 %08x, zlib %08x\n",
+                            len, offset, expected, slice8, chosen, zlib);
+                }
+                ++failures;
+            }
+            ++checks;
+        }
+    }
+    free(buffer);
+#ifdef STBIW__CRC32_CLMUL
+    const bool clmul = stbiw__crc_clmul;
+#else
+    const bool clmul = false;
+#endif
+    printf("crc32: %zu lengths and offsets, %zu failed, PCLMULQDQ %s\n",
+           checks, failures, clmul ? "checked" : "not available, slicing-by-8 only");
+    return failures != 0;
+}
+
+int bench(void){
+    unsigned char *buffer = malloc(BENCH);
+    if (buffer == NULL){ return 1; }
+    fill(buffer, BENCH);
+    // each round changes a byte so the calls can not be hoisted
+    unsigned int sink = 0;
+    double start = seconds();
+    for (int i = 0; i < ROUNDS / 8; ++i){ buffer[i] = (unsigned char)sink; sink += crc32_bytes(buffer, BENCH); }
+    const double bytes = (seconds() - start) / (ROUNDS / 8);
+    start = seconds();
+    for (int i = 0; i < ROUNDS; ++i){ buffer[i] = (unsigned char)sink; sink += crc32_slice8(buffer, (int)BENCH); }
+    const double slice8 = (seconds() - start) / ROUNDS;
+    start = seconds();
+    for (int i = 0; i < ROUNDS; ++i){ buffer[i] = (unsigned char)sink; sink += stbiw__crc32(buffer, (int)BENCH); }
+    const double chosen = (seconds() - start) / ROUNDS;
+    start = seconds();
+    for (int i = 0; i < ROUNDS; ++i){ buffer[i] = (unsigned char)sink; sink += (unsigned int)crc32(0, buffer, (uInt)BENCH); }
+    const double zlib = (seconds() - start) / ROUNDS;
+    free(buffer);
+    const double gb = BENCH / 1e9;
+    printf("crc32 of %zu MiB: byte table %.2f GB/s, slicing-by-8 %.2f GB/s, "
+           "stbiw__crc32 %.2f GB/s, zlib %.2f GB/s (%08x)\n",
+           BENCH >> 20, gb / bytes, gb / slice8, gb / chosen, gb / zlib, sink);
+    return 0;
+}
+
+int main(int argc, char const *argv[]){
+    // the tables are set up by the first call
+    unsigned char byte = 0;
+    stbiw__crc32(&byte, 1);
+    if (argc > 1 && strcmp(argv[1], "bench") == 0){ return bench(); }
+    return check();
+}
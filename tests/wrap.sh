@@ -0,0 +1,45 @@
+#!/bin/sh
+# CIFF HEADERS THAT WRAP
+# a width and a height whose product times 3 wraps around to the
+# content size must be refused by every reader with an error, not
+# passed on to the encoders, the tiles, the ladder or the stream
+parser=${1:-$(pwd)/parser}
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+# 8 bytes little endian
+value(){
+    i=0
+    while [ $i -lt 8 ]; do
+        printf "\\$(printf %o $(( ($1 >> (8 * i)) & 255 )))"
+        i=$((i + 1))
+    done
+}
+
+# 1 * (2^64 + 2) / 3 * 3 is 2 modulo 2^64
+{
+    printf CIFF
+    value 38
+    value 2
+    value 1
+    value 6148914691236517206
+    printf 'c\n'
+    printf 'px'
+} > "$dir/wrap.ciff"
+
+failures=0
+for options in "" "-y4m 25" "-tile 256" "-ladder 64,full" "-stream" "-validate" "-format png"; do
+    (cd "$dir" && "$parser" $options -ciff wrap.ciff) > /dev/null 2>&1
+    status=$?
+    # exit(-1), anything above 128 is a signal
+    if [ $status -ne 255 ]; then
+        echo "wrap: \"$options\" exited with $status"
+        failures=$((failures + 1))
+    fi
+done
+if ls "$dir" | grep -qv '^wrap.ciff$'; then
+    echo "wrap: an output was written"
+    failures=$((failures + 1))
+fi
+echo "wrap: $failures failed"
+[ $failures -eq 0 ]